@@ -0,0 +1,211 @@
+/*
+ * oplhw: ALSA hwdep-based library for OPL2-based soundcards.
+ *
+ * Copyright (C) 2023 by David Gow <david@davidgow.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Measures the library's own overhead, using devices which don't talk to any
+ * real hardware. Prints one CSV line per benchmark (or JSON, with --json), so
+ * results can be compared between versions. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "oplhw.h"
+
+#define BATCH_SIZE 64
+
+/* Writes to play a note on a channel, much like a music player would. */
+static const uint16_t note_regs[] = {
+	0x20, 0x23, 0x40, 0x43, 0x60, 0x63, 0x80, 0x83,
+	0xE0, 0xE3, 0xC0, 0xA0, 0xB0, 0x40, 0x43, 0xB0
+};
+#define NUM_NOTE_REGS (sizeof(note_regs) / sizeof(note_regs[0]))
+
+static long iterations = 1000000;
+static bool json = false;
+static bool first_result = true;
+
+static void get_write(long i, oplhw_regwrite *write)
+{
+	/* Move to another channel after each note, so every channel is used. */
+	int channel = (i / NUM_NOTE_REGS) % 9;
+	uint16_t reg = note_regs[i % NUM_NOTE_REGS];
+
+	if (reg >= 0xA0 && reg < 0xD0)
+		reg += channel;
+	else
+		reg += (channel / 3) * 8 + channel % 3;
+
+	write->reg = reg;
+	write->val = (uint8_t)(i * 37);
+	/* Key the note on, then off again. */
+	if (i % NUM_NOTE_REGS == 12)
+		write->val |= 0x20;
+	else if (i % NUM_NOTE_REGS == 15)
+		write->val &= ~0x20;
+}
+
+static void report(const char *name, const char *device, long writes, uint64_t elapsed)
+{
+	double secs = elapsed / 1e9;
+	double per_sec = writes / secs;
+	double ns_per_write = (double)elapsed / writes;
+
+	if (json)
+	{
+		printf("%s\n  {\"name\": \"%s\", \"device\": \"%s\", \"writes\": %ld, \"seconds\": %.6f, "
+		       "\"writes_per_sec\": %.0f, \"ns_per_write\": %.2f}",
+		       first_result ? "[" : ",", name, device, writes, secs, per_sec, ns_per_write);
+	}
+	else
+	{
+		if (first_result)
+			printf("name,device,writes,seconds,writes_per_sec,ns_per_write\n");
+		printf("%s,%s,%ld,%.6f,%.0f,%.2f\n", name, device, writes, secs, per_sec, ns_per_write);
+	}
+	first_result = false;
+}
+
+static void bench_single(const char *name, const char *device, oplhw_device *dev)
+{
+	oplhw_regwrite write;
+	uint64_t start;
+	long i;
+
+	start = oplhw_GetTime();
+	for (i = 0; i < iterations; ++i)
+	{
+		get_write(i, &write);
+		oplhw_Write(dev, write.reg, write.val);
+	}
+	oplhw_Flush(dev);
+	report(name, device, iterations, oplhw_GetTime() - start);
+}
+
+static void bench_batch(const char *name, const char *device, oplhw_device *dev)
+{
+	oplhw_regwrite batch[BATCH_SIZE];
+	uint64_t start;
+	long i;
+	int j;
+
+	start = oplhw_GetTime();
+	for (i = 0; i < iterations; i += BATCH_SIZE)
+	{
+		for (j = 0; j < BATCH_SIZE; ++j)
+			get_write(i + j, &batch[j]);
+		oplhw_WriteBatch(dev, batch, BATCH_SIZE);
+	}
+	oplhw_Flush(dev);
+	report(name, device, i, oplhw_GetTime() - start);
+}
+
+static void bench_reset(const char *name, const char *device, oplhw_device *dev)
+{
+	/* An OPL3 reset writes both banks. */
+	long writes_per_reset = oplhw_IsOPL3(dev) ? 511 : 256;
+	long resets = iterations / writes_per_reset + 1;
+	uint64_t start;
+	long i;
+
+	start = oplhw_GetTime();
+	for (i = 0; i < resets; ++i)
+		oplhw_Reset(dev);
+	oplhw_Flush(dev);
+	report(name, device, resets * writes_per_reset, oplhw_GetTime() - start);
+}
+
+/* Run a benchmark against a device, if it can be opened. */
+static void run(void (*bench)(const char *, const char *, oplhw_device *), const char *name, const char *device)
+{
+	oplhw_device *dev = oplhw_OpenDevice(device);
+
+	if (!dev)
+	{
+		fprintf(stderr, "Skipping %s: couldn't open \"%s\"\n", name, device);
+		return;
+	}
+	bench(name, device, dev);
+	oplhw_CloseDevice(dev);
+}
+
+int main(int argc, char **argv)
+{
+	const char *retrowave_path = "/dev/null";
+	char retrowave_dev[256];
+	oplhw_device *dev;
+	int i;
+
+	for (i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "--iterations") && i + 1 < argc)
+			iterations = atol(argv[++i]);
+		else if (!strcmp(argv[i], "--retrowave") && i + 1 < argc)
+			retrowave_path = argv[++i];
+		else if (!strcmp(argv[i], "--json"))
+			json = true;
+		else
+		{
+			fprintf(stderr, "Usage: %s [--iterations n] [--retrowave path] [--json]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (iterations < BATCH_SIZE)
+		iterations = BATCH_SIZE;
+
+	/* The cost of getting a write to a backend. */
+	run(bench_single, "dispatch", "null:");
+	run(bench_batch, "dispatch_batch", "null:");
+
+	/* The same, without timing each write for the statistics. */
+	dev = oplhw_OpenDevice("null:");
+	oplhw_SetStatsEnabled(dev, false);
+	bench_single("dispatch_nostats", "null:", dev);
+	oplhw_CloseDevice(dev);
+
+	/* Filters. */
+	dev = oplhw_CreateVolumeFilter(oplhw_OpenDevice("null:"));
+	bench_single("volume_filter", "null:", dev);
+	oplhw_CloseDevice(dev);
+
+	dev = oplhw_CreateCacheFilter(oplhw_CreateVolumeFilter(oplhw_OpenDevice("null:")));
+	bench_single("volume_cache_chain", "null:", dev);
+	oplhw_CloseDevice(dev);
+
+	dev = oplhw_CreateCacheFilter(oplhw_CreateVolumeFilter(oplhw_OpenDevice("null:")));
+	bench_batch("volume_cache_chain_batch", "null:", dev);
+	oplhw_CloseDevice(dev);
+
+	/* Retrowave packet encoding, sent somewhere which doesn't care. */
+	snprintf(retrowave_dev, sizeof(retrowave_dev), "retrowave:%s", retrowave_path);
+	run(bench_single, "retrowave", retrowave_dev);
+	run(bench_batch, "retrowave_batch", retrowave_dev);
+	run(bench_reset, "retrowave_reset", retrowave_dev);
+
+	/* ALSA register decoding, without any ioctls. */
+	run(bench_single, "alsa_decode", "alsa:null");
+	run(bench_batch, "alsa_decode_batch", "alsa:null");
+
+	run(bench_reset, "reset", "null:");
+
+	if (json && !first_result)
+		printf("\n]\n");
+
+	return 0;
+}
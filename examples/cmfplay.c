@@ -65,6 +65,11 @@ typedef struct CMFInstrument
 
 CMFInstrument *cmfInstruments;
 
+/* The time the song started, and the time of the current event. */
+uint64_t startTime;
+uint64_t eventTicks;
+uint64_t eventTime;
+
 #define OPLOFFSET(channel)   (((channel) / 3) * 8 + ((channel) % 3))
 
 void SetInstrumentChannel(CMFInstrument *inst, int channel)
@@ -74,17 +79,20 @@ void SetInstrumentChannel(CMFInstrument *inst, int channel)
 	int modReg = OPLOFFSET(channel);
 	int modReg2 = operTbl[channel];
 	printf ("inst:chan = %d, mod reg = %x (%x)\n" , channel, modReg, modReg2);
-	oplhw_Write(oplDevice, 0x20+modReg, inst->modCharacteristic);
-	oplhw_Write(oplDevice, 0x23+modReg, inst->carrCharacteristic);
-	oplhw_Write(oplDevice, 0x40+modReg, inst->modScaleVol);
-	oplhw_Write(oplDevice, 0x43+modReg, inst->carrScaleVol);
-	oplhw_Write(oplDevice, 0x60+modReg, inst->modAttackDecay);
-	oplhw_Write(oplDevice, 0x63+modReg, inst->carrAttackDecay);
-	oplhw_Write(oplDevice, 0x80+modReg, inst->modSustainRelease);
-	oplhw_Write(oplDevice, 0x83+modReg, inst->carrSustainRelease);
-	oplhw_Write(oplDevice, 0xE0+modReg, inst->modWaveSelect);
-	oplhw_Write(oplDevice, 0xE3+modReg, inst->carrWaveSelect);
-	oplhw_Write(oplDevice, 0xC0+channel, inst->feedback | 0xF0);
+	oplhw_regwrite writes[] = {
+		{0x20+modReg, inst->modCharacteristic},
+		{0x23+modReg, inst->carrCharacteristic},
+		{0x40+modReg, inst->modScaleVol},
+		{0x43+modReg, inst->carrScaleVol},
+		{0x60+modReg, inst->modAttackDecay},
+		{0x63+modReg, inst->carrAttackDecay},
+		{0x80+modReg, inst->modSustainRelease},
+		{0x83+modReg, inst->carrSustainRelease},
+		{0xE0+modReg, inst->modWaveSelect},
+		{0xE3+modReg, inst->carrWaveSelect},
+		{0xC0+channel, inst->feedback | 0xF0},
+	};
+	oplhw_WriteBatchAt(oplDevice, eventTime, writes, sizeof(writes) / sizeof(writes[0]));
 }
 
 float MIDINoteToAdlib(int note, int block)
@@ -149,7 +157,10 @@ bool noinst = false;
 bool DoMIDIEvent(FILE *f)
 {
 	uint32_t waitTicks = ReadMIDILength(f);
-	usleep(waitTicks * 1000000.f / cmfHeader.ticksPerSecond);
+	/* Work out when this event happens from the start of the song, so
+	 * we don't drift. */
+	eventTicks += waitTicks;
+	eventTime = startTime + eventTicks * 1000000000ull / cmfHeader.ticksPerSecond;
 	static uint8_t eventType = 0;
 	uint8_t statusByte = fgetc(f);
 	if ((statusByte & 0x80)) eventType = statusByte;
@@ -170,8 +181,8 @@ bool DoMIDIEvent(FILE *f)
 		f_hi |= (block << 2);
 		f_hi &= 0x1F; // Note OFF
 
-		oplhw_Write(oplDevice, 0xA0 | channel, f_lo);
-		oplhw_Write(oplDevice, 0xB0 | channel, f_hi);
+		oplhw_WriteAt(oplDevice, eventTime, 0xA0 | channel, f_lo);
+		oplhw_WriteAt(oplDevice, eventTime, 0xB0 | channel, f_hi);
 		
 	} break;
 	case 0x90:
@@ -190,8 +201,8 @@ bool DoMIDIEvent(FILE *f)
 			f_hi |= 0x20; // Note ON
 
 		int vel = 0x2F - (velocity * 0x2F / 127);
-		oplhw_Write(oplDevice, 0xA0 + channel, f_lo);
-		oplhw_Write(oplDevice, 0xB0 + channel, f_hi);
+		oplhw_WriteAt(oplDevice, eventTime, 0xA0 + channel, f_lo);
+		oplhw_WriteAt(oplDevice, eventTime, 0xB0 + channel, f_hi);
 		//oplhw_Write(oplDevice, 0x43 + OPLOFFSET(channel), 0x00);
 	} break;
 	case 0xB0:
@@ -273,7 +284,9 @@ int main(int argc, char **argv)
 	oplhw_Write(oplDevice, 0xBD, 0xC0);
 
 	ReadHeaders(f);
+	startTime = oplhw_GetTime();
 	while (!DoMIDIEvent(f));
+	oplhw_Flush(oplDevice);
 
 	/*for (int i = 0; i < 255; ++i)
 		oplhw_Write(oplDevice, i, 0);*/
@@ -23,32 +23,17 @@
 
 #include "oplhw.h"
 
-#define DEFAULT_IMFRATE 560
-
-typedef struct IMFPacket {
-	uint8_t reg;
-	uint8_t val;
-	uint16_t delay;
-} IMFPacket;
-
-typedef struct KMFHeader {
-	uint32_t sig;
-	uint16_t rate;
-	uint16_t len;
-} KMFHeader;
-
-#define KMF_SIG 0x1A464D4B
-#define KMF_SIG_LOW (KMF_SIG & 0xFFFF) /* Low bits of the KMF id for detection */
-
 int main(int argc, char **argv)
 {
 	const char *filename = argv[2];
 	const char *devname = NULL;
-	int rate = DEFAULT_IMFRATE, ticrate;
+	unsigned rate = 0;
+	double start_secs = 0;
+	uint64_t start_time;
 	int opl3 = 0;
-	KMFHeader kmf_header;
+	oplhw_songevent event;
+	oplhw_song *song;
 	oplhw_device *dev;
-	FILE *f;
 	int i;
 
 	printf("%s: A simple IMF player using liboplhw.\n", argv[0]);
@@ -68,6 +53,10 @@ int main(int argc, char **argv)
 		{
 			rate = atoi(argv[++i]);
 		}
+		else if (!strcmp(argv[i], "--start"))
+		{
+			start_secs = atof(argv[++i]);
+		}
 		else if (!strcmp(argv[i], "--opl3") || !strcmp(argv[i], "--stereo"))
 		{
 			opl3 = 1;
@@ -76,25 +65,26 @@ int main(int argc, char **argv)
 
 	if (i >= argc)
 	{
-		printf("Usage: %s [--device device] [--rate rate] [--opl3] [filename]\n", argv[0]);
+		printf("Usage: %s [--device device] [--rate rate] [--start seconds] [--opl3] [filename]\n", argv[0]);
 		printf("\tdevice: The liboplhw device.\n");
 		printf("\t\tThis is usually something like \"opl3lpt:parport0\"\n");
 		printf("\trate: The IMF tick rate.\n");
 		printf("\t\tThis is 560Hz for Commander Keen, 700Hz for Wolf 3D.\n");
 		printf("\t\tModdingWiki has a full list! 560Hz is the default.\n");
+		printf("\tstart: Start playing this many seconds into the song.\n");
 		printf("\topl3: Playback in OPL3 mode\n");
 		printf("\t\tThis is used to play back files from stereoimf.\n");
 		printf("\t\tNote that you'll need OPL3 hardware.\n");
-		printf("\tfilename: The IMF (or KMF) file to play.\n");
+		printf("\tfilename: The IMF (or KMF, DRO or VGM) file to play.\n");
 		return -1;
 	}
 
 	filename = argv[i];
 
-	f = fopen(filename, "rb");
-	if (!f)
+	song = oplhw_OpenSong(filename, rate);
+	if (!song)
 	{
-		perror("fopen");
+		fprintf(stderr, "Couldn't open song \"%s\"\n", filename);
 		return -2;
 	}
 
@@ -102,44 +92,13 @@ int main(int argc, char **argv)
 	if (!dev)
 	{
 		fprintf(stderr, "Couldn't open OPL2 device \"%s\"\n", devname);
-		fclose(f);
+		oplhw_CloseSong(song);
 		return -3;
 	}
 
-	/* "Type 1" IMF files start with a length. Assume we're a "Type 1" file
-	 * unless the length is 0.
-	 */
-	uint16_t len;
-	if (fread(&len, sizeof(len), 1, f) != 1)
-	{
-		fprintf(stderr, "Couldn't read a length from \"%s\"!\n", filename);
-		oplhw_CloseDevice(dev);
-		fclose(f);
-		return -4;
-	}
-
-	if (len == 0)
-	{
-		/* Type 0 IMF */
-		fseek(f, 0, SEEK_SET);
-	}
-	else if (len == KMF_SIG_LOW)
-	{
-		/* We've got a KMF file. */
-		fseek(f, 0, SEEK_SET);
-		fread(&kmf_header.sig, sizeof(uint32_t), 1, f);
-		fread(&kmf_header.rate, sizeof(uint16_t), 1, f);
-		fread(&kmf_header.len, sizeof(uint16_t), 1, f);
-		rate = kmf_header.rate;
-		len = kmf_header.len;
-	}
-
-	
-	ticrate = 1000000/rate;
-
 	oplhw_Reset(dev);
 
-	if (opl3)
+	if (opl3 || oplhw_SongIsOPL3(song))
 	{
 		if (!oplhw_IsOPL3(dev))
 		{
@@ -150,79 +109,45 @@ int main(int argc, char **argv)
 		oplhw_Write(dev, 0x104, 0);
 	}
 
-	/* Keep reading until end of file. This will break if there are tags.*/
-	while (!feof(f))
+	if (start_secs > 0)
 	{
-		if (kmf_header.sig == KMF_SIG)
+		/* Bring the chip up to where the song would have been.
+		 * oplhw_RestoreState() sets up OPL3 mode and the channels
+		 * before starting any notes. */
+		oplhw_state state;
+		int num_regs = oplhw_IsOPL3(dev) ? 0x200 : 0x100;
+
+		oplhw_SeekSong(song, (uint64_t)(start_secs * 1000000000.0), state.regs);
+		memset(state.known, 0, sizeof(state.known));
+		for (i = 0; i < num_regs; ++i)
 		{
-			// K1n9_Duk3's KMF file format
-			uint8_t cmd_count, delay;
-			if (fread(&cmd_count, 1, 1, f) != 1)
-			{
-				fprintf(stderr, "Couldn't read command count from KMF file \"%s\"\n", filename);
-				oplhw_CloseDevice(dev);
-				return -5;
-			}
-			if (fread(&delay, 1, 1, f) != 1)
-			{
-				fprintf(stderr, "Couldn't read command delay from KMF file \"%s\"\n", filename);
-				oplhw_CloseDevice(dev);
-				return -5;
-			}
-#ifdef DEBUG
-			printf("num_commands = %d, delay = %x (%d ms)\n", cmd_count, delay, delay*1000/rate);
-#endif
-			len -= 2;
-			while (cmd_count--)
-			{
-				uint8_t reg, val;
-				if (fread(&reg, 1, 1, f) != 1)
-				{
-					fprintf(stderr, "Couldn't read command delay from KMF file \"%s\"\n", filename);
-					oplhw_CloseDevice(dev);
-					return -5;
-				}
-				if (fread(&val, 1, 1, f) != 1)
-				{
-					fprintf(stderr, "Couldn't read command delay from KMF file \"%s\"\n", filename);
-					oplhw_CloseDevice(dev);
-					return -5;
-				}
-				len -= 2;
-				oplhw_Write(dev, reg, val);
-			}
-			if (delay)
-				usleep((useconds_t)delay * ticrate);
-			if (!len)
-				break;
+			/* Leave the timers alone, and keep OPL3 mode if we've
+			 * turned it on ourselves. */
+			if ((i >= 0x02 && i <= 0x04) || (i == 0x105 && (opl3 || oplhw_SongIsOPL3(song))))
+				continue;
+			state.known[i / 8] |= 1 << (i % 8);
 		}
-		else
-		{
-			// A normal IMF file
-			IMFPacket p;
-			if (fread(&p, sizeof(p), 1, f) != 1)
-			{
-				fprintf(stderr, "Couldn't read a packet from \"%s\"!\n", filename);
-				oplhw_CloseDevice(dev);
-				fclose(f);
-				return -5;
-			}
+		oplhw_RestoreState(dev, &state);
+	}
+
+	/* Let the device group together writes which happen at the same time. */
+	oplhw_SetBuffering(dev, true);
 
+	/* Schedule everything relative to when we started, so that time spent
+	 * writing doesn't add up over the course of the song. */
+	start_time = oplhw_GetTime() - (uint64_t)(start_secs * 1000000000.0);
+
+	while (oplhw_NextSongEvent(song, &event))
+	{
 #ifdef DEBUG
-			printf("reg = %x, val = %x, delay = %x (%d ms)\n", p.reg, p.val, p.delay, p.delay*1000/rate);
+		printf("reg = %x, val = %x, delta = %d ms\n", event.reg, event.val, (int)(event.delta_ns / 1000000));
 #endif
-			oplhw_Write(dev, p.reg, p.val);
-			if (p.delay)
-				usleep(p.delay*ticrate);
-
-			/* This'll underflow for type-0 files. */
-			len -= sizeof(IMFPacket);
-			if (!len)
-				break;
-		}
+		oplhw_WriteAt(dev, start_time + event.time_ns, event.reg, event.val);
 	}
 
+	oplhw_Flush(dev);
 	oplhw_CloseDevice(dev);
+	oplhw_CloseSong(song);
 
 	return 0;
 }
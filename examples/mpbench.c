@@ -0,0 +1,146 @@
+/*
+ * oplhw: ALSA hwdep-based library for OPL2-based soundcards.
+ *
+ * Copyright (C) 2023 by David Gow <david@davidgow.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Measures how well several threads can share one device: either through a
+ * thread-safe device, or (with --mutex) a plain device behind a mutex. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "oplhw.h"
+
+#define MAX_THREADS 64
+#define MAX_GROUP_SIZE 256
+
+static oplhw_device *dev;
+static pthread_mutex_t dev_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool use_mutex = false;
+static int num_groups = 100000;
+static int group_size = 8;
+
+typedef struct thread_result
+{
+	int index;
+	uint64_t max_latency;
+} thread_result;
+
+static void *writer_thread(void *data)
+{
+	thread_result *result = (thread_result *)data;
+	oplhw_regwrite group[MAX_GROUP_SIZE];
+	int i, j;
+
+	/* Each thread plays with its own channel, like an SFX voice would. */
+	for (j = 0; j < group_size; ++j)
+	{
+		group[j].reg = 0xA0 + (result->index % 9) + (j & 1) * 0x10;
+		group[j].val = j;
+	}
+
+	for (i = 0; i < num_groups; ++i)
+	{
+		uint64_t start = oplhw_GetTime();
+		uint64_t latency;
+
+		if (use_mutex)
+			pthread_mutex_lock(&dev_lock);
+		oplhw_WriteBatch(dev, group, group_size);
+		if (use_mutex)
+			pthread_mutex_unlock(&dev_lock);
+
+		latency = oplhw_GetTime() - start;
+		if (latency > result->max_latency)
+			result->max_latency = latency;
+	}
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	const char *devname = "emu:";
+	pthread_t threads[MAX_THREADS];
+	thread_result results[MAX_THREADS];
+	int num_threads = 4;
+	uint64_t start, elapsed, max_latency = 0;
+	double total_writes;
+	int i;
+
+	for (i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "--device") && i + 1 < argc)
+			devname = argv[++i];
+		else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+			num_threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--groups") && i + 1 < argc)
+			num_groups = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--group-size") && i + 1 < argc)
+			group_size = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--mutex"))
+			use_mutex = true;
+		else
+		{
+			fprintf(stderr, "Usage: %s [--device dev] [--threads n] [--groups n] [--group-size n] [--mutex]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (num_threads < 1 || num_threads > MAX_THREADS || group_size < 1 || group_size > MAX_GROUP_SIZE)
+	{
+		fprintf(stderr, "Between 1 and %d threads, and groups of 1 to %d writes, please.\n", MAX_THREADS, MAX_GROUP_SIZE);
+		return 1;
+	}
+
+	dev = oplhw_OpenDevice(devname);
+	if (!dev)
+	{
+		fprintf(stderr, "Couldn't open OPL device \"%s\"\n", devname);
+		return 1;
+	}
+	if (!use_mutex)
+		dev = oplhw_CreateThreadSafeDevice(dev);
+
+	start = oplhw_GetTime();
+	for (i = 0; i < num_threads; ++i)
+	{
+		results[i].index = i;
+		results[i].max_latency = 0;
+		pthread_create(&threads[i], NULL, writer_thread, &results[i]);
+	}
+	for (i = 0; i < num_threads; ++i)
+	{
+		pthread_join(threads[i], NULL);
+		if (results[i].max_latency > max_latency)
+			max_latency = results[i].max_latency;
+	}
+	oplhw_Flush(dev);
+	elapsed = oplhw_GetTime() - start;
+
+	total_writes = (double)num_threads * num_groups * group_size;
+	printf("%s, %d threads, %d groups of %d writes each:\n",
+	       use_mutex ? "mutex" : "thread-safe device", num_threads, num_groups, group_size);
+	printf("  %.3f s, %.0f writes/s, worst call %.1f us\n",
+	       elapsed / 1e9, total_writes * 1e9 / elapsed, max_latency / 1e3);
+
+	oplhw_CloseDevice(dev);
+	return 0;
+}
@@ -19,6 +19,7 @@
 #define OPLHW_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #if defined(_WIN32) || defined(__CYGWIN__)
@@ -33,23 +34,290 @@
 
 typedef struct oplhw_device oplhw_device;
 
+/* A single register write, for use with oplhw_WriteBatch() */
+typedef struct oplhw_regwrite
+{
+	uint16_t reg;
+	uint8_t val;
+} oplhw_regwrite;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* A record of what devices have been doing, for oplhw_SetTrace(). */
+typedef struct oplhw_trace oplhw_trace;
+
+/* The number of buckets in the latency histogram. */
+#define OPLHW_LATENCY_BUCKETS 256
+
+/* Statistics about what a device has been doing, from oplhw_GetStats(). */
+typedef struct oplhw_stats
+{
+	/* Register writes made to the device. */
+	uint64_t writes;
+	/* Writes the device threw away (e.g. a cache filter's redundant writes). */
+	uint64_t dropped;
+	/* System calls and ioctls which failed. */
+	uint64_t errors;
+	/* Bytes sent to the hardware, including any protocol overhead. */
+	uint64_t bytes_sent;
+	uint64_t syscalls;
+	uint64_t ioctls;
+	/* Time spent waiting for the chip, and doing I/O, in ns. */
+	uint64_t sleep_ns;
+	uint64_t io_ns;
+	/* Time spent waiting for data which had been sent to actually go out
+	 * (e.g. for a serial port to finish transmitting) on oplhw_Flush(), in
+	 * ns, and how many times we waited. Not included in io_ns. */
+	uint64_t drain_ns;
+	uint64_t drains;
+	/* The number of write calls (oplhw_Write(), oplhw_WriteBatch() and so on)
+	 * which took each length of time. oplhw_GetLatencyBucketStart() gives
+	 * the shortest time counted in each bucket. */
+	uint64_t latency[OPLHW_LATENCY_BUCKETS];
+} oplhw_stats;
+
+/* The kinds of device oplhw_EnumerateDevices() can find. */
+typedef enum oplhw_backend
+{
+	OPLHW_BACKEND_ALSA,
+	OPLHW_BACKEND_LPT,
+	OPLHW_BACKEND_RETROWAVE,
+	OPLHW_BACKEND_UNIX
+} oplhw_backend;
+
+/* A device found by oplhw_EnumerateDevices(). */
+typedef struct oplhw_device_info
+{
+	/* The name to give oplhw_OpenDevice(). */
+	char uri[256];
+	/* Something to show the user. */
+	char description[128];
+	oplhw_backend backend;
+	bool isOPL3;
+} oplhw_device_info;
+
 /* Core API */
 OPLHW_API oplhw_device *oplhw_OpenDevice(const char *dev_name);
+/* Find the devices which are attached, filling in at most max of them.
+ * Returns how many there are. Every backend is probed at once, and the results
+ * are kept (and used by oplhw_OpenDevice() to find default devices), so later
+ * calls are quick. Pass refresh to probe again, e.g. after a hotplug. */
+OPLHW_API size_t oplhw_EnumerateDevices(oplhw_device_info *devices, size_t max, bool refresh);
 OPLHW_API void oplhw_CloseDevice(oplhw_device *dev);
 OPLHW_API void oplhw_Write(oplhw_device *dev, uint16_t reg, uint8_t val);
+/* Write n registers, in order. This is much faster than calling oplhw_Write()
+ * in a loop on devices which support batching. */
+OPLHW_API void oplhw_WriteBatch(oplhw_device *dev, const oplhw_regwrite *writes, size_t n);
+/* Allow the device to hold onto writes and send them together. While buffering
+ * is enabled, writes are only guaranteed to reach the chip once oplhw_Flush()
+ * or oplhw_WriteBatch() returns. Returns the previous setting. */
+OPLHW_API bool oplhw_SetBuffering(oplhw_device *dev, bool enabled);
+/* Send any writes the device is holding onto. */
+OPLHW_API void oplhw_Flush(oplhw_device *dev);
 OPLHW_API bool oplhw_IsOPL3(oplhw_device *dev);
+/* Set every register to 0, stopping all notes first. This also takes an OPL3
+ * back to OPL2 mode. */
 OPLHW_API void oplhw_Reset(oplhw_device *dev);
+/* Like oplhw_Reset(), but only clears registers which haven't been written
+ * since the last reset, or which were last set to something other than 0. */
+OPLHW_API void oplhw_SoftReset(oplhw_device *dev);
+
+/* Register state */
+
+/* Everything written to a device, from oplhw_SaveState(). */
+typedef struct oplhw_state
+{
+	uint8_t regs[0x200];
+	/* Which registers have been written, one bit each. */
+	uint8_t known[0x200 / 8];
+} oplhw_state;
+
+/* Get the value of every register written to the device. On a pool, this only
+ * covers the first chip. */
+OPLHW_API void oplhw_SaveState(oplhw_device *dev, oplhw_state *state);
+/* Bring the device back to a saved state, in a single batch with as few
+ * writes as possible. Notes which change are stopped first, and only started
+ * again once their channels are set up. Registers which weren't known when
+ * the state was saved are left alone. */
+OPLHW_API void oplhw_RestoreState(oplhw_device *dev, const oplhw_state *state);
+
+/* Statistics */
+
+/* Get the statistics for a device. Wrapper devices (filters, schedulers and
+ * so on) have their own statistics, separate from the device they wrap. */
+OPLHW_API void oplhw_GetStats(oplhw_device *dev, oplhw_stats *stats);
+OPLHW_API void oplhw_ResetStats(oplhw_device *dev);
+/* Statistics are on by default, which costs two clock reads per write call.
+ * Turning them off stops counting writes and their latency (the backend's own
+ * I/O is still counted). Returns the previous setting. */
+OPLHW_API bool oplhw_SetStatsEnabled(oplhw_device *dev, bool enabled);
+/* Get the shortest latency, in ns, counted in a histogram bucket. Buckets are
+ * 1ns wide up to 8ns, then each power of two is split into 8. */
+OPLHW_API uint64_t oplhw_GetLatencyBucketStart(unsigned bucket);
+/* Get the latency (in ns) which the given fraction (0-1) of calls were
+ * faster than, to within a bucket. */
+OPLHW_API uint64_t oplhw_GetLatencyPercentile(const oplhw_stats *stats, double fraction);
+
+/* Tracing */
+
+/* Create a trace, which keeps the last num_records events (rounded up to a
+ * power of two). Returns NULL if num_records is 0. */
+OPLHW_API oplhw_trace *oplhw_CreateTrace(size_t num_records);
+/* Destroy a trace. No device may still be recording to it. */
+OPLHW_API void oplhw_DestroyTrace(oplhw_trace *trace);
+/* Start recording dev's writes, waits and I/O to trace, under the given name,
+ * or stop if trace is NULL. Several devices (e.g. a filter, and the device it
+ * wraps) can record to the same trace, to follow writes from one to the
+ * other. Tracing costs a single branch per write when it's off. */
+OPLHW_API void oplhw_SetTrace(oplhw_device *dev, oplhw_trace *trace, const char *name);
+/* Write the trace as Chrome trace event JSON, which can be loaded into
+ * chrome://tracing or Perfetto. Records made while this runs may be garbled.
+ * Returns false if the file can't be written. */
+OPLHW_API bool oplhw_DumpTrace(oplhw_trace *trace, const char *path);
+
+/* Scheduled writes */
+
+/* Get the current time in nanoseconds, on the clock used by oplhw_WriteAt(). */
+OPLHW_API uint64_t oplhw_GetTime(void);
+/* Write a register at the given time (from oplhw_GetTime()). Writes with a
+ * deadline in the past are sent immediately. On most devices, this waits
+ * until the deadline: use a scheduler device to return straight away. */
+OPLHW_API void oplhw_WriteAt(oplhw_device *dev, uint64_t deadline_ns, uint16_t reg, uint8_t val);
+/* Write n registers, in order, at the given time. */
+OPLHW_API void oplhw_WriteBatchAt(oplhw_device *dev, uint64_t deadline_ns, const oplhw_regwrite *writes, size_t n);
+/* Create a scheduler device, which keeps a queue of timestamped writes and
+ * sends them to backing_dev from its own thread when they're due. Writes
+ * still queued when the device is closed are discarded: use oplhw_Flush() to
+ * wait for them. */
+OPLHW_API oplhw_device *oplhw_CreateScheduler(oplhw_device *backing_dev);
+
+/* Asynchronous output */
+
+/* Create a device which queues writes and sends them to backing_dev from its
+ * own thread, so oplhw_Write() never waits for the chip. oplhw_Flush() waits
+ * until everything queued has been written. */
+OPLHW_API oplhw_device *oplhw_CreateAsyncDevice(oplhw_device *backing_dev);
+/* Get the number of writes waiting to be sent. The device must be an async device. */
+OPLHW_API size_t oplhw_GetQueueDepth(oplhw_device *async_dev);
+
+/* Thread safety */
+
+/* Create a device which can be written from several threads at once. Each
+ * oplhw_WriteBatch() (or oplhw_WriteBatchAt()) call reaches backing_dev as a
+ * whole, never interleaved with another thread's writes, and each thread's
+ * writes stay in order. Writers only wait for the chip if others are keeping
+ * it busy. oplhw_Flush() waits for everything written so far. */
+OPLHW_API oplhw_device *oplhw_CreateThreadSafeDevice(oplhw_device *backing_dev);
+
+/* Multiple chips */
+
+/* The register number for a register on a given chip in a pool. */
+#define OPLHW_POOL_REG(chip, reg) ((uint16_t)(((chip) << 9) | ((reg) & 0x1ff)))
+
+/* Create a pool device, which spreads one large register space over several
+ * chips: use OPLHW_POOL_REG() to address them. The pool owns the devices, and
+ * closes them when it's closed. If parallel is true, each chip gets its own
+ * output thread, so a slow chip doesn't hold up the others. At most 128 chips
+ * can be pooled. */
+OPLHW_API oplhw_device *oplhw_CreatePool(oplhw_device **devs, size_t num_devs, bool parallel);
+
+/* Create an OPL3 device from two OPL2 devices. Bank 0 (and, in OPL2 mode,
+ * everything) goes to left_dev, and bank 1 to right_dev, with each chip
+ * hard-panned. 4-op channels, per-channel panning and the extra waveforms
+ * aren't available. The new device owns both devices. */
+OPLHW_API oplhw_device *oplhw_CreateDualOPL2(oplhw_device *left_dev, oplhw_device *right_dev);
+
+/* Sharing a device */
+
+/* Reserve channels (bit n for channel n, with bank 1's channels at 9-17) on a
+ * "unix:" device, so oplhwd drops other clients' writes to them. Channels are
+ * released by leaving them out of a later call, or by closing the device.
+ * Returns the channels now reserved, which won't include any that another client
+ * already has. Returns 0 if unix_dev isn't a "unix:" device. */
+OPLHW_API uint32_t oplhw_ReserveChannels(oplhw_device *unix_dev, uint32_t channels);
+
+/* Song files */
+
+/* A register dump song file: IMF, KMF, DRO or VGM. */
+typedef struct oplhw_song oplhw_song;
+
+typedef struct oplhw_songevent
+{
+	/* Time since the start of the song, and since the last event. */
+	uint64_t time_ns;
+	uint64_t delta_ns;
+	uint16_t reg;
+	uint8_t val;
+} oplhw_songevent;
+
+/* Open a song file. The format is detected from the contents. IMF files
+ * don't record their tick rate, so it's given by imf_rate (0 for 560Hz).
+ * Returns NULL if the file can't be opened or isn't a song we understand. */
+OPLHW_API oplhw_song *oplhw_OpenSong(const char *path, unsigned imf_rate);
+OPLHW_API void oplhw_CloseSong(oplhw_song *song);
+/* Whether the song was recorded from (and needs) an OPL3. */
+OPLHW_API bool oplhw_SongIsOPL3(oplhw_song *song);
+/* Get the length of the song, in nanoseconds. */
+OPLHW_API uint64_t oplhw_GetSongLength(oplhw_song *song);
+/* Get the next register write. Returns false at the end of the song. */
+OPLHW_API bool oplhw_NextSongEvent(oplhw_song *song, oplhw_songevent *event);
+/* Jump to the given time, so the next event is the first at or after it. If
+ * regs is not NULL, it's filled in with the value of all 0x200 registers at
+ * that point, so the caller can bring the chip up to date. */
+OPLHW_API void oplhw_SeekSong(oplhw_song *song, uint64_t time_ns, uint8_t *regs);
+
+/* Software emulation */
+
+/* The sample rate of the emulator: that of a real OPL3 (14.318MHz / 288). */
+#define OPLHW_EMU_SAMPLE_RATE 49716
+
+/* Render frames of interleaved, signed 16-bit stereo from an "emu:" device.
+ * Writes take effect between calls, so the caller is responsible for
+ * interleaving them with rendering. Returns the number of frames rendered,
+ * which is 0 if the device is rendering to a file. */
+OPLHW_API size_t oplhw_EmuRender(oplhw_device *emu_dev, int16_t *buffer, size_t frames);
 
 /* Filters */
 
+/* A filter is given each batch of writes in a buffer with room for capacity
+ * of them. It can change, drop or add writes in place, and returns how many
+ * there are now. Single writes come as a batch of one. */
+typedef size_t (*oplhw_filter_func)(void *userdata, oplhw_regwrite *writes, size_t n, size_t capacity);
+
+/* Create a device which passes everything written to it through func, then
+ * on to backing_dev. destroy (which may be NULL) is called with userdata when
+ * the device is closed. Filters created on top of other filters are merged
+ * with them, so a chain of filters costs little more than one. */
+OPLHW_API oplhw_device *oplhw_CreateFilter(oplhw_device *backing_dev, oplhw_filter_func func, void (*destroy)(void *userdata), void *userdata);
+/* Get the userdata of a device from oplhw_CreateFilter(). */
+OPLHW_API void *oplhw_GetFilterData(oplhw_device *filter_dev);
+
 /* Create a volume filter device. */
 OPLHW_API oplhw_device *oplhw_CreateVolumeFilter(oplhw_device *backing_dev);
-/* Set the volume. The device must be a volume filter device. */
+/* Set the volume, from 0 to 255. The device must be a volume filter device.
+ * Only carriers (the operators which are heard) are scaled, and notes which
+ * are already playing are updated. Returns the old volume. */
 OPLHW_API int oplhw_SetVolume(oplhw_device *volume_dev, int volume);
+/* Fade to a volume over duration_ns. The fade moves along as writes are made,
+ * and only registers which change are rewritten. Call oplhw_UpdateFade()
+ * between writes to keep it moving when there aren't many. */
+OPLHW_API void oplhw_FadeVolume(oplhw_device *volume_dev, int volume, uint64_t duration_ns);
+/* Bring the volume up to date with a fade. Returns true if it's still fading. */
+OPLHW_API bool oplhw_UpdateFade(oplhw_device *volume_dev);
+
+/* Create a cache filter device, which drops writes which wouldn't change
+ * the value of a register. Writes with side effects (key on, timer control)
+ * are always passed through. */
+OPLHW_API oplhw_device *oplhw_CreateCacheFilter(oplhw_device *backing_dev);
+/* Get the number of writes dropped. The device must be a cache filter device. */
+OPLHW_API uint64_t oplhw_GetCacheDropCount(oplhw_device *cache_dev);
+
+/* Create a capture filter device, which records every write, with its time,
+ * to a file as well as passing it on. The file is VGM if path ends in ".vgm",
+ * and DOSBox DRO otherwise. Returns NULL if the file can't be created. */
+OPLHW_API oplhw_device *oplhw_CreateCaptureFilter(oplhw_device *backing_dev, const char *path);
 
 #ifdef __cplusplus
 }
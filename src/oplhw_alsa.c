@@ -18,6 +18,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "oplhw.h"
@@ -29,6 +30,9 @@
 #include <unistd.h>
 
 
+/* If buffering, the longest we'll hold onto changes before sending them. */
+#define ALSA_MAX_AGE (1000 * OPLHW_NS_PER_USEC)
+
 typedef struct oplhw_alsa_device
 {
 	oplhw_device dev;
@@ -37,55 +41,187 @@ typedef struct oplhw_alsa_device
 	struct snd_dm_fm_voice oplOperators[35];
 	struct snd_dm_fm_note oplChannels[18];
 	struct snd_dm_fm_params oplParams;
+
+	/* The kernel's interface works on whole operators and channels, so we
+	 * just note what's changed, and send each of them once. */
+	uint64_t dirtyOperators;
+	uint32_t dirtyChannels;
+	bool paramsDirty;
+	bool buffered;
+	/* When the oldest unsent change was made. */
+	uint64_t dirtyStart;
 } oplhw_alsa_device;
 
-const int regToOper[0x20] =
+/* What each row of registers (reg >> 4) controls. */
+enum
+{
+	ALSA_REG_NONE,
+	ALSA_REG_AM_VIB,
+	ALSA_REG_KSL_LEVEL,
+	ALSA_REG_ATTACK_DECAY,
+	ALSA_REG_SUSTAIN_RELEASE,
+	ALSA_REG_FNUM_LOW,
+	ALSA_REG_KEYON_BLOCK,
+	ALSA_REG_FEEDBACK_CONNECTION,
+	ALSA_REG_WAVE_SELECT
+};
+
+static const uint8_t regRowType[0x10] = {
+	ALSA_REG_NONE, ALSA_REG_NONE,
+	ALSA_REG_AM_VIB, ALSA_REG_AM_VIB,
+	ALSA_REG_KSL_LEVEL, ALSA_REG_KSL_LEVEL,
+	ALSA_REG_ATTACK_DECAY, ALSA_REG_ATTACK_DECAY,
+	ALSA_REG_SUSTAIN_RELEASE, ALSA_REG_SUSTAIN_RELEASE,
+	ALSA_REG_FNUM_LOW, ALSA_REG_KEYON_BLOCK, ALSA_REG_FEEDBACK_CONNECTION,
+	ALSA_REG_NONE,
+	ALSA_REG_WAVE_SELECT, ALSA_REG_WAVE_SELECT};
+
+static const int regToOper[0x20] =
 	{0, 1, 2, 3, 4, 5, -1, -1, 6, 7, 8, 9, 10, 11, -1, -1,
 		12, 13, 14, 15, 16, 17, -1, -1, -1, -1, -1, -1, -1, -1, -1};
 
-void oplhw_alsa_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
+/* The first operator of each channel. */
+static const int operTbl[18] = {0, 1, 2, 6, 7, 8, 12, 13, 14, 18, 19, 20, 24, 25, 26, 30, 31, 32};
+
+static void alsa_Ioctl(oplhw_alsa_device *alsa_dev, unsigned int request, void *arg, size_t bytes)
 {
-	oplhw_alsa_device *alsa_dev = (oplhw_alsa_device *)dev;
-	bool paramsDirty = false;
-	if (reg == 0x08)
+	uint64_t start = oplhw_time_Now();
+	int res = 0;
+
+	/* Without a hwdep, we're just pretending (see oplhw_alsa_OpenDevice()). */
+	if (alsa_dev->oplHwDep)
+		res = snd_hwdep_ioctl(alsa_dev->oplHwDep, request, arg);
+	oplhw_stats_IO(&alsa_dev->dev, OPLHW_IO_IOCTL, start, res >= 0, bytes);
+}
+
+/* Send everything which has changed to the kernel. Voices go first, then
+ * parameters (which hold the drum key-ons), so that notes are played with the
+ * right instrument. */
+static void alsa_Flush(oplhw_alsa_device *alsa_dev)
+{
+	while (alsa_dev->dirtyOperators)
 	{
-		alsa_dev->oplParams.kbd_split = (val >> 6) & 1;
-		paramsDirty = true;
+		int oper = __builtin_ctzll(alsa_dev->dirtyOperators);
+		alsa_Ioctl(alsa_dev, SNDRV_DM_FM_IOCTL_SET_VOICE, &alsa_dev->oplOperators[oper], sizeof(alsa_dev->oplOperators[oper]));
+		alsa_dev->dirtyOperators &= alsa_dev->dirtyOperators - 1;
 	}
-	else if (reg == 0xBD)
+
+	if (alsa_dev->paramsDirty)
 	{
-		/* Perussion / Params */
-		alsa_dev->oplParams.hihat = (val)&1;
-		alsa_dev->oplParams.cymbal = (val >> 1) & 1;
-		alsa_dev->oplParams.tomtom = (val >> 2) & 1;
-		alsa_dev->oplParams.snare = (val >> 3) & 1;
-		alsa_dev->oplParams.bass = (val >> 4) & 1;
-		alsa_dev->oplParams.rhythm = (val >> 5) & 1;
-		alsa_dev->oplParams.vib_depth = (val >> 6) & 1;
-		alsa_dev->oplParams.am_depth = (val >> 7) & 1;
-		paramsDirty = true;
+		alsa_Ioctl(alsa_dev, SNDRV_DM_FM_IOCTL_SET_PARAMS, &alsa_dev->oplParams, sizeof(alsa_dev->oplParams));
+		alsa_dev->paramsDirty = false;
 	}
-	else if ((reg & 0xf0) == 0xa0)
+
+	while (alsa_dev->dirtyChannels)
 	{
-		/* Channel Freq (low 8 bits) */
-		int channel = (reg & 0xf) + ((alsa_dev->opl3Enabled && (reg & 0x100)) ? 8 : 0);
-		alsa_dev->oplChannels[channel].fnum = (alsa_dev->oplChannels[channel].fnum & 0x300) | (val & 0xff);
-		snd_hwdep_ioctl(alsa_dev->oplHwDep, SNDRV_DM_FM_IOCTL_PLAY_NOTE, (void *)&alsa_dev->oplChannels[channel]);
+		int channel = __builtin_ctz(alsa_dev->dirtyChannels);
+		alsa_Ioctl(alsa_dev, SNDRV_DM_FM_IOCTL_PLAY_NOTE, &alsa_dev->oplChannels[channel], sizeof(alsa_dev->oplChannels[channel]));
+		alsa_dev->dirtyChannels &= alsa_dev->dirtyChannels - 1;
 	}
-	else if ((reg & 0xf0) == 0xb0)
+}
+
+static bool alsa_IsDirty(oplhw_alsa_device *alsa_dev)
+{
+	return alsa_dev->paramsDirty || alsa_dev->dirtyOperators || alsa_dev->dirtyChannels;
+}
+
+static void alsa_MarkOperator(oplhw_alsa_device *alsa_dev, int oper)
+{
+	if (!alsa_IsDirty(alsa_dev))
+		alsa_dev->dirtyStart = oplhw_time_Now();
+	alsa_dev->dirtyOperators |= 1ull << oper;
+}
+
+static void alsa_MarkChannel(oplhw_alsa_device *alsa_dev, int channel)
+{
+	if (!alsa_IsDirty(alsa_dev))
+		alsa_dev->dirtyStart = oplhw_time_Now();
+	alsa_dev->dirtyChannels |= 1u << channel;
+}
+
+static void alsa_MarkParams(oplhw_alsa_device *alsa_dev)
+{
+	if (!alsa_IsDirty(alsa_dev))
+		alsa_dev->dirtyStart = oplhw_time_Now();
+	alsa_dev->paramsDirty = true;
+}
+
+static void alsa_WriteOperator(oplhw_alsa_device *alsa_dev, int type, uint16_t reg, uint8_t val)
+{
+	struct snd_dm_fm_voice *voice;
+	int oper = regToOper[reg & 0x1f];
+
+	if (oper == -1)
+		return;
+	if (alsa_dev->opl3Enabled && (reg & 0x100))
+		oper += 17;
+	voice = &alsa_dev->oplOperators[oper];
+
+	switch (type)
 	{
-		/* Channel freq (high 3 bits) */
-		int channel = (reg & 0xf) + ((alsa_dev->opl3Enabled && (reg & 0x100)) ? 8 : 0);
-		alsa_dev->oplChannels[channel].fnum = (alsa_dev->oplChannels[channel].fnum & 0xff) | ((val << 8) & 0x300);
-		alsa_dev->oplChannels[channel].octave = (val >> 2) & 7;
-		alsa_dev->oplChannels[channel].key_on = (val >> 5) & 1;
-		snd_hwdep_ioctl(alsa_dev->oplHwDep, SNDRV_DM_FM_IOCTL_PLAY_NOTE, (void *)&alsa_dev->oplChannels[channel]);
+	case ALSA_REG_AM_VIB:
+		voice->harmonic = val & 0xf;
+		voice->kbd_scale = (val >> 4) & 1;
+		voice->do_sustain = (val >> 5) & 1;
+		voice->vibrato = (val >> 6) & 1;
+		voice->am = (val >> 7) & 1;
+		break;
+	case ALSA_REG_KSL_LEVEL:
+		voice->volume = ~val & 0x3f;
+		voice->scale_level = (val >> 6) & 3;
+		break;
+	case ALSA_REG_ATTACK_DECAY:
+		voice->decay = val & 0xf;
+		voice->attack = (val >> 4) & 0xf;
+		break;
+	case ALSA_REG_SUSTAIN_RELEASE:
+		voice->release = val & 0xf;
+		voice->sustain = (val >> 4) & 0xf;
+		break;
+	case ALSA_REG_WAVE_SELECT:
+		voice->waveform = val & (alsa_dev->opl3Enabled ? 0x7 : 0x3);
+		break;
 	}
-	else if ((reg & 0xf0) == 0xc0)
+
+	alsa_MarkOperator(alsa_dev, oper);
+}
+
+static void alsa_WriteChannel(oplhw_alsa_device *alsa_dev, int type, uint16_t reg, uint8_t val)
+{
+	int channel = (reg & 0xf) + ((alsa_dev->opl3Enabled && (reg & 0x100)) ? 8 : 0);
+	struct snd_dm_fm_note *note;
+	int oper;
+
+	if ((reg & 0xf) > 8)
+		return;
+	note = &alsa_dev->oplChannels[channel];
+
+	switch (type)
 	{
-		int operTbl[] = {0, 1, 2, 6, 7, 8, 12, 13, 14, 18, 19, 20, 24, 25, 26, 30, 31, 32};
-		int channel = (reg & 0xf) + ((alsa_dev->opl3Enabled && (reg & 0x100)) ? 8 : 0);
-		int oper = operTbl[channel];
+	case ALSA_REG_FNUM_LOW:
+		/* Channel Freq (low 8 bits) */
+		note->fnum = (note->fnum & 0x300) | (val & 0xff);
+		alsa_MarkChannel(alsa_dev, channel);
+		break;
+	case ALSA_REG_KEYON_BLOCK:
+		/* Channel freq (high 3 bits) */
+		note->fnum = (note->fnum & 0xff) | ((val << 8) & 0x300);
+		note->octave = (val >> 2) & 7;
+		/* Key on and off have to reach the chip in order, or notes
+		 * won't be retriggered, so send them straight away. */
+		if (note->key_on != ((val >> 5) & 1))
+		{
+			note->key_on = (val >> 5) & 1;
+			alsa_MarkChannel(alsa_dev, channel);
+			alsa_Flush(alsa_dev);
+		}
+		else
+		{
+			alsa_MarkChannel(alsa_dev, channel);
+		}
+		break;
+	case ALSA_REG_FEEDBACK_CONNECTION:
+		oper = operTbl[channel];
 		if (oper >= ((alsa_dev->opl3Enabled) ? 35 : 18))
 			return;
 		alsa_dev->oplOperators[oper].connection = (val)&1;
@@ -106,74 +242,72 @@ void oplhw_alsa_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
 			alsa_dev->oplOperators[oper + 3].left = 1;
 			alsa_dev->oplOperators[oper + 3].right = 1;
 		}
-		snd_hwdep_ioctl(alsa_dev->oplHwDep, SNDRV_DM_FM_IOCTL_SET_VOICE, (void *)&alsa_dev->oplOperators[oper]);
-	}
-	else if ((reg & 0xe0) == 0x20)
-	{
-		int oper = regToOper[reg & 0x1f];
-		if (alsa_dev->opl3Enabled && (reg & 0x100)) oper += 17;
-		if (oper == -1)
-			return;
-		alsa_dev->oplOperators[oper].harmonic = val & 0xf;
-		alsa_dev->oplOperators[oper].kbd_scale = (val >> 4) & 1;
-		alsa_dev->oplOperators[oper].do_sustain = (val >> 5) & 1;
-		alsa_dev->oplOperators[oper].vibrato = (val >> 6) & 1;
-		alsa_dev->oplOperators[oper].am = (val >> 7) & 1;
-		snd_hwdep_ioctl(alsa_dev->oplHwDep, SNDRV_DM_FM_IOCTL_SET_VOICE, (void *)&alsa_dev->oplOperators[oper]);
+		/* The kernel sets the connection from the first operator. */
+		alsa_MarkOperator(alsa_dev, oper);
+		break;
 	}
-	else if ((reg & 0xe0) == 0x40)
+}
+
+static void alsa_WriteReg(oplhw_alsa_device *alsa_dev, uint16_t reg, uint8_t val)
+{
+	int type = regRowType[(reg >> 4) & 0xf];
+
+	if (type == ALSA_REG_FNUM_LOW || type == ALSA_REG_KEYON_BLOCK || type == ALSA_REG_FEEDBACK_CONNECTION)
 	{
-		int oper = regToOper[reg & 0x1f];
-		if (alsa_dev->opl3Enabled && (reg & 0x100)) oper += 17;
-		if (oper == -1)
+		if (reg != 0xBD)
+		{
+			alsa_WriteChannel(alsa_dev, type, reg, val);
 			return;
-		alsa_dev->oplOperators[oper].volume = ~val & 0x3f;
-		alsa_dev->oplOperators[oper].scale_level = (val >> 6) & 3;
-		snd_hwdep_ioctl(alsa_dev->oplHwDep, SNDRV_DM_FM_IOCTL_SET_VOICE, (void *)&alsa_dev->oplOperators[oper]);
+		}
 	}
-	else if ((reg & 0xe0) == 0x60)
+	else if (type != ALSA_REG_NONE)
 	{
-		int oper = regToOper[reg & 0x1f];
-		if (alsa_dev->opl3Enabled && (reg & 0x100)) oper += 17;
-		if (oper == -1)
-			return;
-		alsa_dev->oplOperators[oper].decay = val & 0xf;
-		alsa_dev->oplOperators[oper].attack = (val >> 4) & 0xf;
-		snd_hwdep_ioctl(alsa_dev->oplHwDep, SNDRV_DM_FM_IOCTL_SET_VOICE, (void *)&alsa_dev->oplOperators[oper]);
+		alsa_WriteOperator(alsa_dev, type, reg, val);
+		return;
 	}
-	else if ((reg & 0xe0) == 0x80)
+
+	if (reg == 0x08)
 	{
-		int oper = regToOper[reg & 0x1f];
-		if (alsa_dev->opl3Enabled && (reg & 0x100)) oper += 17;
-		if (oper == -1)
-			return;
-		alsa_dev->oplOperators[oper].release = val & 0xf;
-		alsa_dev->oplOperators[oper].sustain = (val >> 4) & 0xf;
-		snd_hwdep_ioctl(alsa_dev->oplHwDep, SNDRV_DM_FM_IOCTL_SET_VOICE, (void *)&alsa_dev->oplOperators[oper]);
+		alsa_dev->oplParams.kbd_split = (val >> 6) & 1;
+		alsa_MarkParams(alsa_dev);
 	}
-	else if ((reg & 0xe0) == 0xe0)
+	else if (reg == 0xBD)
 	{
-		int oper = regToOper[reg & 0x1f];
-		if (alsa_dev->opl3Enabled && (reg & 0x100)) oper += 17;
-		if (oper == -1)
-			return;
-		alsa_dev->oplOperators[oper].waveform = val & (alsa_dev->opl3Enabled ? 0x7 : 0x3);
-		snd_hwdep_ioctl(alsa_dev->oplHwDep, SNDRV_DM_FM_IOCTL_SET_VOICE, (void *)&alsa_dev->oplOperators[oper]);
+		/* Perussion / Params */
+		uint8_t old_drums = alsa_dev->oplParams.hihat | (alsa_dev->oplParams.cymbal << 1) |
+			(alsa_dev->oplParams.tomtom << 2) | (alsa_dev->oplParams.snare << 3) |
+			(alsa_dev->oplParams.bass << 4);
+
+		alsa_dev->oplParams.hihat = (val)&1;
+		alsa_dev->oplParams.cymbal = (val >> 1) & 1;
+		alsa_dev->oplParams.tomtom = (val >> 2) & 1;
+		alsa_dev->oplParams.snare = (val >> 3) & 1;
+		alsa_dev->oplParams.bass = (val >> 4) & 1;
+		alsa_dev->oplParams.rhythm = (val >> 5) & 1;
+		alsa_dev->oplParams.vib_depth = (val >> 6) & 1;
+		alsa_dev->oplParams.am_depth = (val >> 7) & 1;
+		alsa_MarkParams(alsa_dev);
+		/* Like key on and off for channels, drums have to be
+		 * triggered in order. */
+		if ((val & 0x1f) != old_drums)
+			alsa_Flush(alsa_dev);
 	}
 	else if (reg == 0x104)
 	{
+		/* This changes how the kernel interprets voices, so send
+		 * everything before it. */
+		alsa_Flush(alsa_dev);
 		if (alsa_dev->opl3Enabled)
 		{
-			snd_hwdep_ioctl(alsa_dev->oplHwDep, SNDRV_DM_FM_IOCTL_SET_CONNECTION, (void *)(uintptr_t)val);
+			alsa_Ioctl(alsa_dev, SNDRV_DM_FM_IOCTL_SET_CONNECTION, (void *)(uintptr_t)val, 0);
 		}
 		else
 		{	
-			snd_hwdep_ioctl(alsa_dev->oplHwDep, SNDRV_DM_FM_IOCTL_SET_CONNECTION, (void *)0);
+			alsa_Ioctl(alsa_dev, SNDRV_DM_FM_IOCTL_SET_CONNECTION, (void *)0, 0);
 		}
 	}
 	else if (reg == 0x105)
 	{
-		printf("Setting opl3 mode to %d", val);
 		alsa_dev->opl3Enabled = (val & 1) ? true : false;
 		//void *mode = (void *)(uintptr_t)((val & 1) ? SNDRV_DM_FM_MODE_OPL3 : SNDRV_DM_FM_MODE_OPL2);
 		//snd_hwdep_ioctl(alsa_dev->oplHwDep, SNDRV_DM_FM_IOCTL_SET_MODE, mode);
@@ -183,34 +317,78 @@ void oplhw_alsa_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
 		/* Unsupported register write. */
 		/* TODO: Report this as an error somehow. */
 	}
+}
+
+void oplhw_alsa_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
+{
+	oplhw_alsa_device *alsa_dev = (oplhw_alsa_device *)dev;
+
+	alsa_WriteReg(alsa_dev, reg, val);
 
-	if (paramsDirty)
-		snd_hwdep_ioctl(alsa_dev->oplHwDep, SNDRV_DM_FM_IOCTL_SET_PARAMS, (void *)&alsa_dev->oplParams);
+	if (!alsa_dev->buffered || (alsa_IsDirty(alsa_dev) &&
+	    oplhw_time_Now() - alsa_dev->dirtyStart >= ALSA_MAX_AGE))
+		alsa_Flush(alsa_dev);
+}
+
+void oplhw_alsa_WriteBatch(oplhw_device *dev, const oplhw_regwrite *writes, size_t n)
+{
+	oplhw_alsa_device *alsa_dev = (oplhw_alsa_device *)dev;
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		alsa_WriteReg(alsa_dev, writes[i].reg, writes[i].val);
+	alsa_Flush(alsa_dev);
+}
+
+void oplhw_alsa_Flush(oplhw_device *dev)
+{
+	alsa_Flush((oplhw_alsa_device *)dev);
 }
 
-/* Find an OPL2 hwdep device to use as the default. */
-static const char *findHwDep()
+bool oplhw_alsa_SetBuffering(oplhw_device *dev, bool enabled)
+{
+	oplhw_alsa_device *alsa_dev = (oplhw_alsa_device *)dev;
+	bool was_buffered = alsa_dev->buffered;
+
+	alsa_dev->buffered = enabled;
+	if (!enabled)
+		alsa_Flush(alsa_dev);
+	return was_buffered;
+}
+
+size_t oplhw_alsa_Enumerate(oplhw_device_info *devices, size_t max)
 {
 	void **hints, **current_hint;
-	const char *hwdep_name = NULL;
+	size_t found = 0;
 	int err = snd_device_name_hint(-1, "hwdep", &hints);
 	if (err) {
-		return NULL;
+		return 0;
 	}
 
 	for (current_hint = hints; *current_hint; current_hint++)
 	{
-		const char *name = snd_device_name_get_hint(*current_hint, "NAME");
-		const char *desc = snd_device_name_get_hint(*current_hint, "DESC");
-		if (strstr(desc, "OPL3") || strstr(desc, "OPL2"))
+		char *name = snd_device_name_get_hint(*current_hint, "NAME");
+		char *desc = snd_device_name_get_hint(*current_hint, "DESC");
+		/* Leave out anything with a name too long to open. */
+		if (name && desc && (strstr(desc, "OPL3") || strstr(desc, "OPL2")) &&
+		    strlen(name) < sizeof(devices[0].uri) - strlen("alsa:"))
 		{
-			hwdep_name = strdup(name);
-			break;
+			if (found < max)
+			{
+				oplhw_device_info *info = &devices[found];
+				snprintf(info->uri, sizeof(info->uri), "alsa:%s", name);
+				snprintf(info->description, sizeof(info->description), "%s", desc);
+				info->backend = OPLHW_BACKEND_ALSA;
+				info->isOPL3 = strstr(desc, "OPL3") != NULL;
+			}
+			found++;
 		}
+		free(name);
+		free(desc);
 	}
 
 	snd_device_name_free_hint(hints);
-	return hwdep_name;
+	return found;
 }
 
 static void setupStructs(oplhw_alsa_device *dev)
@@ -235,42 +413,84 @@ static void setupStructs(oplhw_alsa_device *dev)
 	}
 }
 
+void oplhw_alsa_Reset(oplhw_device *dev)
+{
+	oplhw_alsa_device *alsa_dev = (oplhw_alsa_device *)dev;
+	int i;
+
+	/* The kernel keys off and silences every voice, and goes back to OPL2
+	 * mode, in one go. Anything we haven't sent yet doesn't matter. */
+	alsa_Ioctl(alsa_dev, SNDRV_DM_FM_IOCTL_RESET, NULL, 0);
+	setupStructs(alsa_dev);
+	alsa_dev->opl3Enabled = false;
+	alsa_dev->dirtyOperators = 0;
+	alsa_dev->dirtyChannels = 0;
+	alsa_dev->paramsDirty = false;
+
+	/* oplhw_Reset() assumes every register is now 0, but the kernel leaves
+	 * the total level at 0x3f (silent). Make our voices match a level of 0,
+	 * and send the OPL2 ones, so that later writes which skip registers
+	 * already at 0 still sound right. */
+	for (i = 0; i < 35; ++i)
+		alsa_dev->oplOperators[i].volume = 0x3f;
+	alsa_dev->dirtyOperators = (1ull << 18) - 1;
+	alsa_Flush(alsa_dev);
+}
+
 void oplhw_alsa_CloseDevice(oplhw_device *dev)
 {
 	oplhw_alsa_device *alsa_dev = (oplhw_alsa_device *)dev;
-	snd_hwdep_close(alsa_dev->oplHwDep);
+	alsa_Flush(alsa_dev);
+	if (alsa_dev->oplHwDep)
+		snd_hwdep_close(alsa_dev->oplHwDep);
 	free(alsa_dev);
 }
 
 oplhw_device *oplhw_alsa_OpenDevice(const char *dev_name)
 {
-	bool should_free_name = false;
+	oplhw_device_info default_dev;
 	oplhw_alsa_device *dev = calloc(1, sizeof(*dev));
+	bool use_default = !dev_name || !dev_name[0];
 
 	dev->dev.close = &oplhw_alsa_CloseDevice;
 	dev->dev.write = &oplhw_alsa_Write;
+	dev->dev.write_batch = &oplhw_alsa_WriteBatch;
+	dev->dev.flush = &oplhw_alsa_Flush;
+	dev->dev.set_buffering = &oplhw_alsa_SetBuffering;
+	dev->dev.reset = &oplhw_alsa_Reset;
 
 	/* If we don't have a dev_name, attempt to find one. */
-	if (!dev_name || !dev_name[0])
+	if (use_default)
 	{
-		dev_name = findHwDep();
-		if (dev_name)
-			should_free_name = true;
-		else
+		if (!oplhw_enum_GetDefault(OPLHW_BACKEND_ALSA, false, &default_dev))
+		{
+			free(dev);
 			return NULL;
+		}
+		dev_name = default_dev.uri + strlen("alsa:");
+	}
+
+	/* The "null" device decodes writes as usual, but never sends them to
+	 * a card, so the decoding can be benchmarked. */
+	if (!strcmp(dev_name, "null"))
+	{
+		dev->dev.isOPL3 = true;
+		setupStructs(dev);
+		return (oplhw_device *)dev;
 	}
 
 	if (snd_hwdep_open(&dev->oplHwDep, dev_name, SND_HWDEP_OPEN_WRITE) < 0)
 	{
-		if (should_free_name)
-			free((char*)dev_name);
-		/* TODO: Report errors properly. */
-		free(dev);
-		return NULL;
+		/* The card we found last time might have gone away, so look
+		 * again before giving up. */
+		if (!use_default || !oplhw_enum_GetDefault(OPLHW_BACKEND_ALSA, true, &default_dev) ||
+		    snd_hwdep_open(&dev->oplHwDep, default_dev.uri + strlen("alsa:"), SND_HWDEP_OPEN_WRITE) < 0)
+		{
+			/* TODO: Report errors properly. */
+			free(dev);
+			return NULL;
+		}
 	}
-	
-	if (should_free_name)
-		free((char*)dev_name);
 
 	snd_hwdep_info_t *info;
 	snd_hwdep_info_alloca(&info);
@@ -302,3 +522,17 @@ oplhw_device *oplhw_alsa_OpenDevice(const char *dev_name)
 
 	return (oplhw_device *)dev;
 }
+
+#ifdef OPLHW_BUILDING_PLUGIN
+static oplhw_device *alsa_PluginOpen(const char *dev_name, bool isOPL3)
+{
+	(void)isOPL3;
+	return oplhw_alsa_OpenDevice(dev_name);
+}
+
+OPLHW_API const oplhw_plugin oplhw_plugin_entry = {
+	OPLHW_PLUGIN_ABI,
+	alsa_PluginOpen,
+	oplhw_alsa_Enumerate
+};
+#endif
@@ -0,0 +1,251 @@
+/*
+ * oplhw: ALSA hwdep-based library for OPL2-based soundcards.
+ *
+ * Copyright (C) 2023 by David Gow <david@davidgow.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "oplhw.h"
+#include "oplhw_internal.h"
+
+/* Must be a power of two. */
+#define ASYNC_QUEUE_LEN 4096
+#define ASYNC_QUEUE_MASK (ASYNC_QUEUE_LEN - 1)
+
+/* The async device is a single-producer, single-consumer ring buffer: the
+ * application writes into it, and an output thread drains it into the
+ * backing device. The only locking is when the output thread goes to sleep
+ * because the queue is empty, or when waiting for the queue to drain.
+ */
+typedef struct oplhw_async_device
+{
+	oplhw_device dev;
+	oplhw_device *next;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t drained;
+	bool quit;
+	/* Set by oplhw_Flush(), to have the output thread flush the backing
+	 * device (and wait for it) once the queue empties. */
+	bool flush_wanted;
+	/* Set by the output thread when it's about to sleep. */
+	int sleeping;
+
+	/* head is only written by the application, and tail only by the output
+	 * thread. Keep them on separate cache lines. */
+	size_t head;
+	uint8_t pad[64];
+	size_t tail;
+
+	oplhw_regwrite ring[ASYNC_QUEUE_LEN];
+} oplhw_async_device;
+
+static void *async_OutputThread(void *data)
+{
+	oplhw_async_device *dev = (oplhw_async_device *)data;
+	size_t tail = dev->tail;
+
+	for (;;)
+	{
+		size_t head = __atomic_load_n(&dev->head, __ATOMIC_ACQUIRE);
+		size_t count;
+
+		if (head == tail)
+		{
+			bool was_buffered;
+
+			/* Nothing left to do: make sure the backing device isn't
+			 * holding onto anything, then wait for more writes. This
+			 * doesn't wait for it to be played (which can block for a
+			 * while on serial devices), unless someone has asked. */
+			was_buffered = oplhw_SetBuffering(dev->next, false);
+			oplhw_SetBuffering(dev->next, was_buffered);
+
+			pthread_mutex_lock(&dev->lock);
+			if (dev->flush_wanted)
+			{
+				dev->flush_wanted = false;
+				pthread_mutex_unlock(&dev->lock);
+				oplhw_Flush(dev->next);
+				continue;
+			}
+			__atomic_store_n(&dev->sleeping, 1, __ATOMIC_SEQ_CST);
+			pthread_cond_broadcast(&dev->drained);
+			while (!dev->quit && !dev->flush_wanted && __atomic_load_n(&dev->head, __ATOMIC_SEQ_CST) == tail)
+				pthread_cond_wait(&dev->wake, &dev->lock);
+			__atomic_store_n(&dev->sleeping, 0, __ATOMIC_SEQ_CST);
+			if (dev->quit && __atomic_load_n(&dev->head, __ATOMIC_SEQ_CST) == tail)
+			{
+				pthread_mutex_unlock(&dev->lock);
+				break;
+			}
+			pthread_mutex_unlock(&dev->lock);
+			continue;
+		}
+
+		/* Send everything up to the end of the ring in one batch. */
+		count = head - tail;
+		if (count > ASYNC_QUEUE_LEN - (tail & ASYNC_QUEUE_MASK))
+			count = ASYNC_QUEUE_LEN - (tail & ASYNC_QUEUE_MASK);
+
+		oplhw_WriteBatch(dev->next, &dev->ring[tail & ASYNC_QUEUE_MASK], count);
+
+		tail += count;
+		__atomic_store_n(&dev->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/* Wake the output thread, if it's asleep. */
+static void async_Wake(oplhw_async_device *dev)
+{
+	if (__atomic_load_n(&dev->sleeping, __ATOMIC_SEQ_CST))
+	{
+		pthread_mutex_lock(&dev->lock);
+		pthread_cond_signal(&dev->wake);
+		pthread_mutex_unlock(&dev->lock);
+	}
+}
+
+/* Get the number of free slots in the ring, waiting for at least one. */
+static size_t async_WaitForSpace(oplhw_async_device *dev, size_t head)
+{
+	size_t space;
+
+	/* If the queue is full, the chip simply can't keep up, so there's
+	 * nothing better to do than wait for it. */
+	while (!(space = ASYNC_QUEUE_LEN - (head - __atomic_load_n(&dev->tail, __ATOMIC_ACQUIRE))))
+	{
+		async_Wake(dev);
+		sched_yield();
+	}
+	return space;
+}
+
+void oplhw_async_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
+{
+	oplhw_async_device *async_dev = (oplhw_async_device *)dev;
+	size_t head = async_dev->head;
+
+	async_WaitForSpace(async_dev, head);
+
+	async_dev->ring[head & ASYNC_QUEUE_MASK].reg = reg;
+	async_dev->ring[head & ASYNC_QUEUE_MASK].val = val;
+	__atomic_store_n(&async_dev->head, head + 1, __ATOMIC_SEQ_CST);
+	OPLHW_TRACE(dev, OPLHW_TRACE_ENQUEUE, 1, 0);
+
+	async_Wake(async_dev);
+}
+
+void oplhw_async_WriteBatch(oplhw_device *dev, const oplhw_regwrite *writes, size_t n)
+{
+	oplhw_async_device *async_dev = (oplhw_async_device *)dev;
+	size_t head = async_dev->head;
+
+	while (n)
+	{
+		size_t count = async_WaitForSpace(async_dev, head);
+		size_t i;
+
+		if (count > n)
+			count = n;
+
+		for (i = 0; i < count; ++i)
+			async_dev->ring[(head + i) & ASYNC_QUEUE_MASK] = writes[i];
+
+		head += count;
+		writes += count;
+		n -= count;
+		__atomic_store_n(&async_dev->head, head, __ATOMIC_SEQ_CST);
+		OPLHW_TRACE(dev, OPLHW_TRACE_ENQUEUE, count, 0);
+		async_Wake(async_dev);
+	}
+}
+
+void oplhw_async_Flush(oplhw_device *dev)
+{
+	oplhw_async_device *async_dev = (oplhw_async_device *)dev;
+
+	/* Have the output thread flush the backing device once the queue
+	 * empties, and wait for it to go back to sleep. */
+	pthread_mutex_lock(&async_dev->lock);
+	async_dev->flush_wanted = true;
+	pthread_cond_signal(&async_dev->wake);
+	while (__atomic_load_n(&async_dev->tail, __ATOMIC_ACQUIRE) != async_dev->head ||
+	       !__atomic_load_n(&async_dev->sleeping, __ATOMIC_SEQ_CST) ||
+	       async_dev->flush_wanted)
+		pthread_cond_wait(&async_dev->drained, &async_dev->lock);
+	pthread_mutex_unlock(&async_dev->lock);
+}
+
+void oplhw_async_CloseDevice(oplhw_device *dev)
+{
+	oplhw_async_device *async_dev = (oplhw_async_device *)dev;
+
+	/* Let the output thread finish whatever is left in the queue. */
+	pthread_mutex_lock(&async_dev->lock);
+	async_dev->quit = true;
+	pthread_cond_signal(&async_dev->wake);
+	pthread_mutex_unlock(&async_dev->lock);
+	pthread_join(async_dev->thread, NULL);
+
+	pthread_cond_destroy(&async_dev->drained);
+	pthread_cond_destroy(&async_dev->wake);
+	pthread_mutex_destroy(&async_dev->lock);
+
+	oplhw_CloseDevice(async_dev->next);
+	free(async_dev);
+}
+
+oplhw_device *oplhw_CreateAsyncDevice(oplhw_device *backing_dev)
+{
+	oplhw_async_device *dev = calloc(1, sizeof(*dev));
+
+	dev->dev.close = &oplhw_async_CloseDevice;
+	dev->dev.write = &oplhw_async_Write;
+	dev->dev.write_batch = &oplhw_async_WriteBatch;
+	dev->dev.flush = &oplhw_async_Flush;
+	dev->dev.isOPL3 = backing_dev->isOPL3;
+	dev->next = backing_dev;
+
+	pthread_mutex_init(&dev->lock, NULL);
+	pthread_cond_init(&dev->wake, NULL);
+	pthread_cond_init(&dev->drained, NULL);
+
+	if (pthread_create(&dev->thread, NULL, async_OutputThread, dev))
+	{
+		pthread_cond_destroy(&dev->drained);
+		pthread_cond_destroy(&dev->wake);
+		pthread_mutex_destroy(&dev->lock);
+		free(dev);
+		return NULL;
+	}
+
+	return (oplhw_device *)dev;
+}
+
+size_t oplhw_GetQueueDepth(oplhw_device *async_dev)
+{
+	oplhw_async_device *dev = (oplhw_async_device *)async_dev;
+	return dev->head - __atomic_load_n(&dev->tail, __ATOMIC_ACQUIRE);
+}
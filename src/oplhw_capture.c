@@ -0,0 +1,417 @@
+/*
+ * oplhw: ALSA hwdep-based library for OPL2-based soundcards.
+ *
+ * Copyright (C) 2023 by David Gow <david@davidgow.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Record register writes to a DOSBox DRO (v2) or VGM file.
+ *
+ * This is both a backend ("capture:file.dro"), which just records, and a
+ * filter, which records and passes everything on to another device. Writes
+ * are timestamped and encoded into a large buffer, which is only written out
+ * when it fills up, so recording doesn't slow down the live device.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "oplhw.h"
+#include "oplhw_internal.h"
+
+#define CAPTURE_BUF_LEN (64 * 1024)
+
+#define DRO_HEADER_LEN 26
+#define DRO_HW_OPL2 0
+#define DRO_HW_OPL3 2
+
+#define VGM_HEADER_LEN 0x80
+#define VGM_SAMPLE_RATE 44100
+#define VGM_YM3812_CLOCK 3579545
+#define VGM_YMF262_CLOCK 14318180
+
+typedef enum capture_format
+{
+	CAPTURE_DRO,
+	CAPTURE_VGM
+} capture_format;
+
+typedef struct oplhw_capture_device
+{
+	oplhw_device dev;
+	/* The device we pass writes on to, or NULL if we're only recording. */
+	oplhw_device *next;
+
+	FILE *out_file;
+	capture_format format;
+
+	/* Time of the first write, and of the last one we recorded. */
+	bool started;
+	uint64_t start_time;
+	uint64_t last_time;
+	/* How much delay we've written out so far: milliseconds for DRO,
+	 * samples for VGM. */
+	uint64_t delay_written;
+	/* Number of register/value pairs, for the DRO header. */
+	uint32_t num_pairs;
+
+	/* DRO only: register to codemap index, or 0xff if not recorded. */
+	uint8_t dro_codes[0x100];
+	uint8_t dro_codemap[0x80];
+	uint8_t dro_codemap_len;
+
+	size_t buf_len;
+	uint8_t buf[CAPTURE_BUF_LEN];
+} oplhw_capture_device;
+
+static void capture_FlushBuffer(oplhw_capture_device *dev)
+{
+	if (dev->buf_len)
+	{
+		uint64_t start = oplhw_time_Now();
+		size_t written = fwrite(dev->buf, 1, dev->buf_len, dev->out_file);
+		oplhw_stats_IO(&dev->dev, OPLHW_IO_SYSCALL, start, written == dev->buf_len, written);
+	}
+	dev->buf_len = 0;
+}
+
+static void capture_Put(oplhw_capture_device *dev, const uint8_t *data, size_t len)
+{
+	if (dev->buf_len + len > CAPTURE_BUF_LEN)
+		capture_FlushBuffer(dev);
+	memcpy(dev->buf + dev->buf_len, data, len);
+	dev->buf_len += len;
+}
+
+static void capture_PutLE(uint8_t *buf, uint32_t val, int len)
+{
+	int i;
+	for (i = 0; i < len; ++i)
+		buf[i] = (val >> (i * 8)) & 0xff;
+}
+
+/* DRO */
+
+/* Every register which does anything, on either bank, gets a code. */
+static void dro_BuildCodemap(oplhw_capture_device *dev)
+{
+	static const uint8_t op_offsets[18] = {
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x08, 0x09, 0x0a,
+		0x0b, 0x0c, 0x0d, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15};
+	static const uint8_t globals[7] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x08, 0xbd};
+	static const uint8_t op_bases[5] = {0x20, 0x40, 0x60, 0x80, 0xe0};
+	static const uint8_t ch_bases[3] = {0xa0, 0xb0, 0xc0};
+	int i, j;
+
+	memset(dev->dro_codes, 0xff, sizeof(dev->dro_codes));
+	dev->dro_codemap_len = 0;
+
+	for (i = 0; i < 7; ++i)
+		dev->dro_codemap[dev->dro_codemap_len++] = globals[i];
+	for (i = 0; i < 5; ++i)
+		for (j = 0; j < 18; ++j)
+			dev->dro_codemap[dev->dro_codemap_len++] = op_bases[i] + op_offsets[j];
+	for (i = 0; i < 3; ++i)
+		for (j = 0; j < 9; ++j)
+			dev->dro_codemap[dev->dro_codemap_len++] = ch_bases[i] + j;
+
+	for (i = 0; i < dev->dro_codemap_len; ++i)
+		dev->dro_codes[dev->dro_codemap[i]] = i;
+}
+
+static void dro_WriteHeader(oplhw_capture_device *dev)
+{
+	uint8_t hdr[DRO_HEADER_LEN];
+
+	memcpy(hdr, "DBRAWOPL", 8);
+	capture_PutLE(hdr + 8, 2, 2);  /* Version 2.0 */
+	capture_PutLE(hdr + 10, 0, 2);
+	capture_PutLE(hdr + 12, dev->num_pairs, 4);
+	capture_PutLE(hdr + 16, (uint32_t)dev->delay_written, 4);
+	hdr[20] = dev->dev.isOPL3 ? DRO_HW_OPL3 : DRO_HW_OPL2;
+	hdr[21] = 0;                   /* Interleaved format */
+	hdr[22] = 0;                   /* Uncompressed */
+	/* The two codes after the codemap are the short and long delays. */
+	hdr[23] = dev->dro_codemap_len;
+	hdr[24] = dev->dro_codemap_len + 1;
+	hdr[25] = dev->dro_codemap_len;
+
+	fwrite(hdr, sizeof(hdr), 1, dev->out_file);
+	fwrite(dev->dro_codemap, dev->dro_codemap_len, 1, dev->out_file);
+}
+
+static void dro_Delay(oplhw_capture_device *dev, uint64_t time)
+{
+	uint64_t ms = (time - dev->start_time) / (OPLHW_NS_PER_SEC / 1000);
+	uint64_t delay = ms - dev->delay_written;
+	uint8_t pair[2];
+
+	while (delay > 256)
+	{
+		uint64_t blocks = delay / 256;
+		if (blocks > 256)
+			blocks = 256;
+		pair[0] = dev->dro_codemap_len + 1;
+		pair[1] = blocks - 1;
+		capture_Put(dev, pair, 2);
+		dev->num_pairs++;
+		delay -= blocks * 256;
+	}
+	if (delay)
+	{
+		pair[0] = dev->dro_codemap_len;
+		pair[1] = delay - 1;
+		capture_Put(dev, pair, 2);
+		dev->num_pairs++;
+	}
+	dev->delay_written = ms;
+}
+
+static void dro_Write(oplhw_capture_device *dev, uint16_t reg, uint8_t val)
+{
+	uint8_t code = dev->dro_codes[reg & 0xff];
+	uint8_t pair[2];
+
+	if (code == 0xff || (reg & 0x100 && !dev->dev.isOPL3))
+		return;
+
+	pair[0] = code | ((reg & 0x100) ? 0x80 : 0);
+	pair[1] = val;
+	capture_Put(dev, pair, 2);
+	dev->num_pairs++;
+}
+
+/* VGM */
+
+static void vgm_WriteHeader(oplhw_capture_device *dev, uint32_t file_len)
+{
+	uint8_t hdr[VGM_HEADER_LEN];
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, "Vgm ", 4);
+	capture_PutLE(hdr + 0x04, file_len - 4, 4);
+	capture_PutLE(hdr + 0x08, 0x151, 4);
+	capture_PutLE(hdr + 0x18, (uint32_t)dev->delay_written, 4);
+	capture_PutLE(hdr + 0x24, 60, 4);
+	/* The data offset is relative to its own position. */
+	capture_PutLE(hdr + 0x34, VGM_HEADER_LEN - 0x34, 4);
+	if (dev->dev.isOPL3)
+		capture_PutLE(hdr + 0x5c, VGM_YMF262_CLOCK, 4);
+	else
+		capture_PutLE(hdr + 0x50, VGM_YM3812_CLOCK, 4);
+
+	fwrite(hdr, sizeof(hdr), 1, dev->out_file);
+}
+
+static void vgm_Delay(oplhw_capture_device *dev, uint64_t time)
+{
+	uint64_t samples = (time - dev->start_time) * VGM_SAMPLE_RATE / OPLHW_NS_PER_SEC;
+	uint64_t delay = samples - dev->delay_written;
+	uint8_t cmd[3];
+
+	while (delay)
+	{
+		uint32_t wait = (delay > 0xffff) ? 0xffff : (uint32_t)delay;
+		if (wait <= 16)
+		{
+			cmd[0] = 0x70 + wait - 1;
+			capture_Put(dev, cmd, 1);
+		}
+		else if (wait == 735 || wait == 882)
+		{
+			cmd[0] = (wait == 735) ? 0x62 : 0x63;
+			capture_Put(dev, cmd, 1);
+		}
+		else
+		{
+			cmd[0] = 0x61;
+			capture_PutLE(cmd + 1, wait, 2);
+			capture_Put(dev, cmd, 3);
+		}
+		delay -= wait;
+	}
+	dev->delay_written = samples;
+}
+
+static void vgm_Write(oplhw_capture_device *dev, uint16_t reg, uint8_t val)
+{
+	uint8_t cmd[3];
+
+	if (dev->dev.isOPL3)
+		cmd[0] = (reg & 0x100) ? 0x5f : 0x5e;
+	else if (reg & 0x100)
+		return;
+	else
+		cmd[0] = 0x5a;
+	cmd[1] = reg & 0xff;
+	cmd[2] = val;
+	capture_Put(dev, cmd, 3);
+}
+
+/* Record a batch of writes which happened at the given time. */
+static void capture_Record(oplhw_capture_device *dev, uint64_t time, const oplhw_regwrite *writes, size_t n)
+{
+	size_t i;
+
+	if (!dev->started)
+	{
+		dev->started = true;
+		dev->start_time = dev->last_time = time;
+	}
+	/* Writes can't go back in time, even if their deadlines did. */
+	if (time < dev->last_time)
+		time = dev->last_time;
+	dev->last_time = time;
+
+	if (dev->format == CAPTURE_VGM)
+	{
+		vgm_Delay(dev, time);
+		for (i = 0; i < n; ++i)
+			vgm_Write(dev, writes[i].reg, writes[i].val);
+	}
+	else
+	{
+		dro_Delay(dev, time);
+		for (i = 0; i < n; ++i)
+			dro_Write(dev, writes[i].reg, writes[i].val);
+	}
+}
+
+void oplhw_capture_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
+{
+	oplhw_capture_device *cap_dev = (oplhw_capture_device *)dev;
+	oplhw_regwrite write;
+
+	write.reg = reg;
+	write.val = val;
+	capture_Record(cap_dev, oplhw_time_Now(), &write, 1);
+	if (cap_dev->next)
+		oplhw_Write(cap_dev->next, reg, val);
+}
+
+void oplhw_capture_WriteBatch(oplhw_device *dev, const oplhw_regwrite *writes, size_t n)
+{
+	oplhw_capture_device *cap_dev = (oplhw_capture_device *)dev;
+
+	capture_Record(cap_dev, oplhw_time_Now(), writes, n);
+	if (cap_dev->next)
+		oplhw_WriteBatch(cap_dev->next, writes, n);
+}
+
+void oplhw_capture_WriteAt(oplhw_device *dev, uint64_t deadline, const oplhw_regwrite *writes, size_t n)
+{
+	oplhw_capture_device *cap_dev = (oplhw_capture_device *)dev;
+	uint64_t now = oplhw_time_Now();
+
+	/* With nothing to wait for, record at the deadline and return
+	 * straight away, so a log can be made faster than real time. */
+	capture_Record(cap_dev, (deadline > now) ? deadline : now, writes, n);
+	if (cap_dev->next)
+		oplhw_WriteBatchAt(cap_dev->next, deadline, writes, n);
+}
+
+void oplhw_capture_Flush(oplhw_device *dev)
+{
+	oplhw_capture_device *cap_dev = (oplhw_capture_device *)dev;
+	if (cap_dev->next)
+		oplhw_Flush(cap_dev->next);
+}
+
+bool oplhw_capture_SetBuffering(oplhw_device *dev, bool enabled)
+{
+	oplhw_capture_device *cap_dev = (oplhw_capture_device *)dev;
+	if (cap_dev->next)
+		return oplhw_SetBuffering(cap_dev->next, enabled);
+	return false;
+}
+
+void oplhw_capture_CloseDevice(oplhw_device *dev)
+{
+	oplhw_capture_device *cap_dev = (oplhw_capture_device *)dev;
+
+	if (cap_dev->format == CAPTURE_VGM)
+	{
+		uint8_t end = 0x66;
+		capture_Put(cap_dev, &end, 1);
+	}
+	capture_FlushBuffer(cap_dev);
+
+	/* Now we know how long everything was, fill in the header. */
+	if (cap_dev->format == CAPTURE_VGM)
+	{
+		long file_len = ftell(cap_dev->out_file);
+		fseek(cap_dev->out_file, 0, SEEK_SET);
+		vgm_WriteHeader(cap_dev, (uint32_t)file_len);
+	}
+	else
+	{
+		fseek(cap_dev->out_file, 0, SEEK_SET);
+		dro_WriteHeader(cap_dev);
+	}
+	fclose(cap_dev->out_file);
+
+	if (cap_dev->next)
+		oplhw_CloseDevice(cap_dev->next);
+	free(cap_dev);
+}
+
+static oplhw_device *capture_Create(oplhw_device *backing_dev, const char *path)
+{
+	oplhw_capture_device *dev = calloc(1, sizeof(*dev));
+	size_t path_len = strlen(path);
+
+	dev->dev.close = &oplhw_capture_CloseDevice;
+	dev->dev.write = &oplhw_capture_Write;
+	dev->dev.write_batch = &oplhw_capture_WriteBatch;
+	dev->dev.write_at = &oplhw_capture_WriteAt;
+	dev->dev.flush = &oplhw_capture_Flush;
+	dev->dev.set_buffering = &oplhw_capture_SetBuffering;
+	dev->dev.isOPL3 = backing_dev ? backing_dev->isOPL3 : true;
+	dev->next = backing_dev;
+
+	dev->out_file = fopen(path, "wb");
+	if (!dev->out_file)
+	{
+		free(dev);
+		return NULL;
+	}
+	/* We do our own buffering. */
+	setvbuf(dev->out_file, NULL, _IONBF, 0);
+
+	if (path_len > 4 && !strcmp(path + path_len - 4, ".vgm"))
+	{
+		dev->format = CAPTURE_VGM;
+		vgm_WriteHeader(dev, VGM_HEADER_LEN);
+	}
+	else
+	{
+		dev->format = CAPTURE_DRO;
+		dro_BuildCodemap(dev);
+		dro_WriteHeader(dev);
+	}
+
+	return (oplhw_device *)dev;
+}
+
+oplhw_device *oplhw_capture_OpenDevice(const char *dev_name)
+{
+	return capture_Create(NULL, dev_name);
+}
+
+oplhw_device *oplhw_CreateCaptureFilter(oplhw_device *backing_dev, const char *path)
+{
+	return capture_Create(backing_dev, path);
+}
@@ -0,0 +1,1117 @@
+/*
+ * oplhw: ALSA hwdep-based library for OPL2-based soundcards.
+ *
+ * Copyright (C) 2023 by David Gow <david@davidgow.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* A software OPL3 (and therefore OPL2), for when there's no real chip around.
+ *
+ * This follows the structure of the real chip (and of Nuked OPL3, which
+ * documents it very well): log-sin and exponent ROMs, a 9-bit attenuation
+ * envelope, and a 19-bit phase accumulator for each operator. It's not
+ * cycle-accurate, though: rather than stepping the whole chip one sample at a
+ * time, we render in blocks, one operator at a time, so that the inner loops
+ * are short and simple. Register writes take effect at block boundaries.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <pthread.h>
+
+#include "oplhw.h"
+#include "oplhw_internal.h"
+
+#define EMU_BLOCK 64
+#define EMU_NUM_SLOTS 36
+#define EMU_NUM_CHANNELS 18
+
+/* Bytes in a WAV header. */
+#define EMU_WAV_HEADER_LEN 44
+
+enum
+{
+	EG_ATTACK,
+	EG_DECAY,
+	EG_SUSTAIN,
+	EG_RELEASE
+};
+
+enum
+{
+	CH_2OP,
+	CH_4OP,
+	CH_4OP2,
+	CH_DRUM
+};
+
+/* Special modulation sources; anything else is a slot number. */
+#define MOD_NONE -1
+#define MOD_FEEDBACK -2
+
+/* Key on sources. */
+#define KEY_NORMAL 1
+#define KEY_DRUM 2
+
+typedef struct emu_slot
+{
+	/* Registers */
+	uint8_t mult, ksr, egt, vib, am;
+	uint8_t ksl, tl;
+	uint8_t ar, dr, sl, rr;
+	uint8_t wf;
+
+	/* Derived */
+	uint8_t channel;
+	int8_t mod;
+	int16_t eg_ksl;
+
+	/* State */
+	uint8_t key;
+	uint8_t eg_gen;
+	uint16_t eg_rout;
+	uint32_t pg_phase;
+	int16_t out, prout, fbmod;
+
+	/* The phase and output for the current block. */
+	uint16_t phase[EMU_BLOCK];
+	int16_t buf[EMU_BLOCK];
+} emu_slot;
+
+typedef struct emu_channel
+{
+	uint16_t fnum;
+	uint8_t block;
+	uint8_t ksv;
+	uint8_t fb, con;
+	uint8_t chtype;
+	bool left, right;
+	uint8_t slots[2];
+	/* The other half of a 4-op channel. */
+	int8_t pair;
+	/* Slots mixed into the output. Drum outputs appear twice. */
+	int8_t out[4];
+} emu_channel;
+
+typedef struct emu_chip
+{
+	emu_slot slots[EMU_NUM_SLOTS];
+	emu_channel channels[EMU_NUM_CHANNELS];
+
+	uint8_t nts;
+	uint8_t rhy;
+	uint8_t dam, dvb;
+	uint8_t newm;
+	uint8_t connection;
+
+	/* Global timers, LFOs and noise. */
+	uint32_t timer;
+	uint64_t eg_timer;
+	uint8_t eg_state;
+	uint8_t eg_add;
+	uint8_t tremolopos;
+	uint8_t vibpos;
+	uint32_t noise;
+} emu_chip;
+
+typedef struct oplhw_emu_device
+{
+	oplhw_device dev;
+	emu_chip chip;
+
+	/* If we're writing to a file, rather than being pulled from. */
+	FILE *out_file;
+	bool out_wav;
+	uint64_t start_time;
+	uint64_t frames_rendered;
+} oplhw_emu_device;
+
+/* ROMs, generated once on first open. */
+static uint16_t emu_logsinrom[256];
+static uint16_t emu_exprom[256];
+/* Each waveform over a full period, as a log-sin value with the sign in the
+ * top bit, so operators don't need to branch on the waveform. */
+static uint16_t emu_wavetable[8][1024];
+static pthread_once_t emu_roms_once = PTHREAD_ONCE_INIT;
+
+/* Frequency multipliers, times two. */
+static const uint8_t emu_mt[16] = {1, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 20, 24, 24, 30, 30};
+static const uint8_t emu_kslrom[16] = {0, 32, 40, 45, 48, 51, 53, 55, 56, 58, 59, 60, 61, 62, 63, 64};
+static const uint8_t emu_kslshift[4] = {8, 1, 2, 0};
+static const uint8_t emu_eg_incstep[4][4] = {{0, 0, 0, 0}, {1, 0, 0, 0}, {1, 0, 1, 0}, {1, 1, 1, 0}};
+/* Register offset (low 5 bits) to slot number. */
+static const int8_t emu_ad_slot[0x20] = {
+	0, 1, 2, 3, 4, 5, -1, -1, 6, 7, 8, 9, 10, 11, -1, -1,
+	12, 13, 14, 15, 16, 17, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1};
+/* Slot number (within a bank) to channel (within a bank). */
+static const uint8_t emu_ch_slot[18] = {0, 1, 2, 0, 1, 2, 3, 4, 5, 3, 4, 5, 6, 7, 8, 6, 7, 8};
+
+static inline int16_t emu_CalcExp(uint32_t level)
+{
+	if (level > 0x1fff)
+		level = 0x1fff;
+	return (emu_exprom[level & 0xff] << 1) >> (level >> 8);
+}
+
+/* The eight OPL3 waveforms, from the 10-bit phase. */
+static uint16_t emu_WaveLog(uint8_t wf, uint16_t phase)
+{
+	uint16_t out = 0;
+	uint16_t neg = 0;
+
+	switch (wf)
+	{
+	case 0: /* Sine */
+		if (phase & 0x200)
+			neg = 0x8000;
+		out = emu_logsinrom[(phase & 0x100) ? ((phase & 0xff) ^ 0xff) : (phase & 0xff)];
+		break;
+	case 1: /* Half sine */
+		if (phase & 0x200)
+			out = 0x1000;
+		else
+			out = emu_logsinrom[(phase & 0x100) ? ((phase & 0xff) ^ 0xff) : (phase & 0xff)];
+		break;
+	case 2: /* Absolute sine */
+		out = emu_logsinrom[(phase & 0x100) ? ((phase & 0xff) ^ 0xff) : (phase & 0xff)];
+		break;
+	case 3: /* Pulse sine */
+		if (phase & 0x100)
+			out = 0x1000;
+		else
+			out = emu_logsinrom[phase & 0xff];
+		break;
+	case 4: /* Alternating sine */
+		if ((phase & 0x300) == 0x100)
+			neg = 0x8000;
+		if (phase & 0x200)
+			out = 0x1000;
+		else if (phase & 0x80)
+			out = emu_logsinrom[((phase ^ 0xff) << 1) & 0xff];
+		else
+			out = emu_logsinrom[(phase << 1) & 0xff];
+		break;
+	case 5: /* Camel sine */
+		if (phase & 0x200)
+			out = 0x1000;
+		else if (phase & 0x80)
+			out = emu_logsinrom[((phase ^ 0xff) << 1) & 0xff];
+		else
+			out = emu_logsinrom[(phase << 1) & 0xff];
+		break;
+	case 6: /* Square */
+		if (phase & 0x200)
+			neg = 0x8000;
+		out = 0;
+		break;
+	case 7: /* Derived square */
+		if (phase & 0x200)
+		{
+			neg = 0x8000;
+			phase = (phase & 0x1ff) ^ 0x1ff;
+		}
+		out = phase << 3;
+		break;
+	}
+
+	return out | neg;
+}
+
+static void emu_InitRoms(void)
+{
+	int i, wf;
+
+	for (i = 0; i < 256; ++i)
+	{
+		/* -log2(sin(x)) over the first quarter wave, in 1/256ths. */
+		double s = sin((i + 0.5) * M_PI / 512.0);
+		emu_logsinrom[i] = (uint16_t)(-log(s) / log(2.0) * 256.0 + 0.5);
+		/* 2^x over one octave, with 10 bits of fraction. */
+		emu_exprom[i] = (uint16_t)(pow(2.0, (255 - i) / 256.0) * 1024.0);
+	}
+
+	for (wf = 0; wf < 8; ++wf)
+		for (i = 0; i < 1024; ++i)
+			emu_wavetable[wf][i] = emu_WaveLog(wf, i);
+}
+
+static inline int16_t emu_Operator(const uint16_t *wave, uint16_t phase, uint16_t env)
+{
+	uint16_t w = wave[phase & 0x3ff];
+	return emu_CalcExp((w & 0x7fff) + (env << 3)) ^ -(int16_t)(w >> 15);
+}
+
+/* Register handling */
+
+static void emu_UpdateKSL(emu_channel *ch, emu_slot *slot)
+{
+	int16_t ksl = (emu_kslrom[ch->fnum >> 6] << 2) - ((0x08 - ch->block) << 5);
+	slot->eg_ksl = (ksl < 0) ? 0 : ksl;
+}
+
+static void emu_UpdateFreq(emu_chip *chip, emu_channel *ch)
+{
+	ch->ksv = (ch->block << 1) | ((ch->fnum >> (0x09 - chip->nts)) & 1);
+	emu_UpdateKSL(ch, &chip->slots[ch->slots[0]]);
+	emu_UpdateKSL(ch, &chip->slots[ch->slots[1]]);
+}
+
+static void emu_KeyOn(emu_slot *slot, uint8_t type)
+{
+	if (!slot->key)
+	{
+		slot->eg_gen = EG_ATTACK;
+		slot->pg_phase = 0;
+		/* The fastest attack rate is instant (see also
+		 * emu_EnvelopeBlock, for rates raised to it by key scaling). */
+		if (slot->ar == 0x0f)
+			slot->eg_rout = 0;
+	}
+	slot->key |= type;
+}
+
+static void emu_KeyOff(emu_slot *slot, uint8_t type)
+{
+	if (slot->key)
+	{
+		slot->key &= ~type;
+		if (!slot->key)
+			slot->eg_gen = EG_RELEASE;
+	}
+}
+
+static void emu_ChannelKey(emu_chip *chip, emu_channel *ch, bool on)
+{
+	int num_slots = (ch->chtype == CH_4OP) ? 4 : 2;
+	uint8_t slots[4];
+	int i;
+
+	slots[0] = ch->slots[0];
+	slots[1] = ch->slots[1];
+	if (ch->chtype == CH_4OP)
+	{
+		slots[2] = chip->channels[ch->pair].slots[0];
+		slots[3] = chip->channels[ch->pair].slots[1];
+	}
+
+	for (i = 0; i < num_slots; ++i)
+	{
+		if (on)
+			emu_KeyOn(&chip->slots[slots[i]], KEY_NORMAL);
+		else
+			emu_KeyOff(&chip->slots[slots[i]], KEY_NORMAL);
+	}
+}
+
+/* Work out how a channel's slots are wired together, and which are heard. */
+static void emu_SetupAlg(emu_chip *chip, emu_channel *ch)
+{
+	emu_slot *s0 = &chip->slots[ch->slots[0]];
+	emu_slot *s1 = &chip->slots[ch->slots[1]];
+	int num = ch - chip->channels;
+
+	ch->out[0] = ch->out[1] = ch->out[2] = ch->out[3] = -1;
+
+	if (ch->chtype == CH_DRUM)
+	{
+		if (num == 7 || num == 8)
+		{
+			/* Hi-hat and snare, or tom-tom and cymbal. */
+			s0->mod = MOD_NONE;
+			s1->mod = MOD_NONE;
+			ch->out[0] = ch->out[1] = ch->slots[0];
+			ch->out[2] = ch->out[3] = ch->slots[1];
+		}
+		else
+		{
+			/* Bass drum. */
+			s0->mod = MOD_FEEDBACK;
+			s1->mod = ch->con ? MOD_NONE : ch->slots[0];
+			ch->out[0] = ch->out[1] = ch->slots[1];
+		}
+		return;
+	}
+
+	if (ch->chtype == CH_4OP2)
+		return;
+
+	if (ch->chtype == CH_4OP)
+	{
+		emu_channel *pair = &chip->channels[ch->pair];
+		emu_slot *p0 = &chip->slots[pair->slots[0]];
+		emu_slot *p1 = &chip->slots[pair->slots[1]];
+
+		s0->mod = MOD_FEEDBACK;
+		p1->mod = pair->slots[0];
+		switch ((ch->con << 1) | pair->con)
+		{
+		case 0: /* FM-FM */
+			s1->mod = ch->slots[0];
+			p0->mod = ch->slots[1];
+			ch->out[0] = pair->slots[1];
+			break;
+		case 1: /* FM-AM */
+			s1->mod = ch->slots[0];
+			p0->mod = MOD_NONE;
+			ch->out[0] = ch->slots[1];
+			ch->out[1] = pair->slots[1];
+			break;
+		case 2: /* AM-FM */
+			s1->mod = MOD_NONE;
+			p0->mod = ch->slots[1];
+			ch->out[0] = ch->slots[0];
+			ch->out[1] = pair->slots[1];
+			break;
+		case 3: /* AM-AM */
+			s1->mod = MOD_NONE;
+			p0->mod = ch->slots[1];
+			p1->mod = MOD_NONE;
+			ch->out[0] = ch->slots[0];
+			ch->out[1] = pair->slots[0];
+			ch->out[2] = pair->slots[1];
+			break;
+		}
+		return;
+	}
+
+	s0->mod = MOD_FEEDBACK;
+	if (ch->con)
+	{
+		s1->mod = MOD_NONE;
+		ch->out[0] = ch->slots[0];
+		ch->out[1] = ch->slots[1];
+	}
+	else
+	{
+		s1->mod = ch->slots[0];
+		ch->out[0] = ch->slots[1];
+	}
+}
+
+/* Recompute every channel's type, after 0x104, 0x105 or 0xBD changes. */
+static void emu_UpdateChannelTypes(emu_chip *chip)
+{
+	static const uint8_t pairs[6] = {0, 1, 2, 9, 10, 11};
+	int i;
+
+	for (i = 0; i < EMU_NUM_CHANNELS; ++i)
+	{
+		chip->channels[i].chtype = CH_2OP;
+		chip->channels[i].pair = -1;
+	}
+
+	if (chip->newm)
+	{
+		for (i = 0; i < 6; ++i)
+		{
+			if (chip->connection & (1 << i))
+			{
+				chip->channels[pairs[i]].chtype = CH_4OP;
+				chip->channels[pairs[i]].pair = pairs[i] + 3;
+				chip->channels[pairs[i] + 3].chtype = CH_4OP2;
+				chip->channels[pairs[i] + 3].pair = pairs[i];
+			}
+		}
+	}
+
+	if (chip->rhy & 0x20)
+	{
+		for (i = 6; i < 9; ++i)
+			chip->channels[i].chtype = CH_DRUM;
+	}
+
+	for (i = 0; i < EMU_NUM_CHANNELS; ++i)
+	{
+		emu_channel *ch = &chip->channels[i];
+		if (!chip->newm)
+			ch->left = ch->right = true;
+		emu_SetupAlg(chip, ch);
+	}
+}
+
+static void emu_WriteBD(emu_chip *chip, uint8_t val)
+{
+	/* Rhythm mode slots: BD uses both of channel 6, and the rest get one each. */
+	static const uint8_t drum_slot[5] = {13, 17, 14, 16, 12};
+	uint8_t old_rhy = chip->rhy;
+	int i;
+
+	chip->dam = val >> 7;
+	chip->dvb = (val >> 6) & 1;
+	chip->rhy = val & 0x3f;
+
+	if ((old_rhy ^ chip->rhy) & 0x20)
+		emu_UpdateChannelTypes(chip);
+
+	for (i = 0; i < 5; ++i)
+	{
+		bool on = (chip->rhy & 0x20) && (val & (1 << i));
+		emu_slot *slot = &chip->slots[drum_slot[i]];
+		if (on)
+			emu_KeyOn(slot, KEY_DRUM);
+		else
+			emu_KeyOff(slot, KEY_DRUM);
+		/* The bass drum uses both slots. */
+		if (i == 4)
+		{
+			if (on)
+				emu_KeyOn(&chip->slots[15], KEY_DRUM);
+			else
+				emu_KeyOff(&chip->slots[15], KEY_DRUM);
+		}
+	}
+}
+
+static void emu_WriteReg(emu_chip *chip, uint16_t reg, uint8_t val)
+{
+	int high = (reg >> 8) & 1;
+	uint8_t regm = reg & 0xff;
+	emu_slot *slot = NULL;
+	emu_channel *ch = NULL;
+
+	switch (regm & 0xf0)
+	{
+	case 0x00:
+		if (high)
+		{
+			if (regm == 0x04)
+			{
+				chip->connection = val & 0x3f;
+				emu_UpdateChannelTypes(chip);
+			}
+			else if (regm == 0x05)
+			{
+				chip->newm = val & 1;
+				emu_UpdateChannelTypes(chip);
+			}
+		}
+		else if (regm == 0x08)
+		{
+			int i;
+			chip->nts = (val >> 6) & 1;
+			for (i = 0; i < EMU_NUM_CHANNELS; ++i)
+				emu_UpdateFreq(chip, &chip->channels[i]);
+		}
+		return;
+	case 0xa0:
+		if ((regm & 0x0f) < 9)
+		{
+			ch = &chip->channels[9 * high + (regm & 0x0f)];
+			if (chip->newm && ch->chtype == CH_4OP2)
+				return;
+			ch->fnum = (ch->fnum & 0x300) | val;
+			emu_UpdateFreq(chip, ch);
+			if (ch->chtype == CH_4OP)
+			{
+				emu_channel *pair = &chip->channels[ch->pair];
+				pair->fnum = ch->fnum;
+				emu_UpdateFreq(chip, pair);
+			}
+		}
+		return;
+	case 0xb0:
+		if (regm == 0xbd && !high)
+		{
+			emu_WriteBD(chip, val);
+			return;
+		}
+		if ((regm & 0x0f) < 9)
+		{
+			ch = &chip->channels[9 * high + (regm & 0x0f)];
+			if (chip->newm && ch->chtype == CH_4OP2)
+				return;
+			ch->fnum = (ch->fnum & 0xff) | ((val & 0x03) << 8);
+			ch->block = (val >> 2) & 0x07;
+			emu_UpdateFreq(chip, ch);
+			if (ch->chtype == CH_4OP)
+			{
+				emu_channel *pair = &chip->channels[ch->pair];
+				pair->fnum = ch->fnum;
+				pair->block = ch->block;
+				emu_UpdateFreq(chip, pair);
+			}
+			emu_ChannelKey(chip, ch, (val & 0x20) != 0);
+		}
+		return;
+	case 0xc0:
+		if ((regm & 0x0f) < 9)
+		{
+			ch = &chip->channels[9 * high + (regm & 0x0f)];
+			ch->fb = (val >> 1) & 0x07;
+			ch->con = val & 0x01;
+			if (chip->newm)
+			{
+				ch->left = (val >> 4) & 1;
+				ch->right = (val >> 5) & 1;
+			}
+			else
+			{
+				ch->left = ch->right = true;
+			}
+			/* Changing the second half of a 4-op channel changes the first. */
+			if (ch->chtype == CH_4OP2)
+				emu_SetupAlg(chip, &chip->channels[ch->pair]);
+			else
+				emu_SetupAlg(chip, ch);
+		}
+		return;
+	case 0xd0:
+		return;
+	}
+
+	/* Everything else is an operator register. */
+	if (emu_ad_slot[regm & 0x1f] < 0)
+		return;
+	slot = &chip->slots[18 * high + emu_ad_slot[regm & 0x1f]];
+	ch = &chip->channels[slot->channel];
+
+	switch (regm & 0xe0)
+	{
+	case 0x20:
+		slot->am = (val >> 7) & 1;
+		slot->vib = (val >> 6) & 1;
+		slot->egt = (val >> 5) & 1;
+		slot->ksr = (val >> 4) & 1;
+		slot->mult = val & 0x0f;
+		break;
+	case 0x40:
+		slot->ksl = (val >> 6) & 0x03;
+		slot->tl = val & 0x3f;
+		emu_UpdateKSL(ch, slot);
+		break;
+	case 0x60:
+		slot->ar = (val >> 4) & 0x0f;
+		slot->dr = val & 0x0f;
+		break;
+	case 0x80:
+		slot->sl = (val >> 4) & 0x0f;
+		if (slot->sl == 0x0f)
+			slot->sl = 0x1f;
+		slot->rr = val & 0x0f;
+		break;
+	case 0xe0:
+		slot->wf = val & (chip->newm ? 0x07 : 0x03);
+		break;
+	}
+}
+
+static void emu_ResetChip(emu_chip *chip)
+{
+	int i;
+
+	memset(chip, 0, sizeof(*chip));
+
+	for (i = 0; i < EMU_NUM_SLOTS; ++i)
+	{
+		emu_slot *slot = &chip->slots[i];
+		slot->channel = emu_ch_slot[i % 18] + 9 * (i / 18);
+		slot->eg_rout = 0x1ff;
+		slot->eg_gen = EG_RELEASE;
+	}
+
+	for (i = 0; i < EMU_NUM_CHANNELS; ++i)
+	{
+		emu_channel *ch = &chip->channels[i];
+		int local = i % 9;
+		int base = 18 * (i / 9) + (local / 3) * 6 + local % 3;
+		ch->slots[0] = base;
+		ch->slots[1] = base + 3;
+		ch->left = ch->right = true;
+	}
+
+	chip->noise = 1;
+	emu_UpdateChannelTypes(chip);
+}
+
+/* Rendering */
+
+/* Per-sample values shared by every slot during a block. */
+typedef struct emu_globals
+{
+	uint8_t eg_state[EMU_BLOCK];
+	uint8_t eg_add[EMU_BLOCK];
+	uint8_t timer[EMU_BLOCK];
+	uint8_t tremolo[EMU_BLOCK];
+	uint8_t vibpos[EMU_BLOCK];
+	uint32_t noise[EMU_BLOCK];
+} emu_globals;
+
+static void emu_StepGlobals(emu_chip *chip, emu_globals *g, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+	{
+		uint8_t trem_shift = chip->dam ? 2 : 4;
+		uint32_t n_bit;
+
+		g->eg_state[i] = chip->eg_state;
+		g->eg_add[i] = chip->eg_add;
+		g->timer[i] = chip->timer & 3;
+		g->vibpos[i] = chip->vibpos;
+		g->noise[i] = chip->noise;
+		if (chip->tremolopos < 105)
+			g->tremolo[i] = chip->tremolopos >> trem_shift;
+		else
+			g->tremolo[i] = (210 - chip->tremolopos) >> trem_shift;
+
+		if ((chip->timer & 0x3f) == 0x3f)
+			chip->tremolopos = (chip->tremolopos + 1) % 210;
+		if ((chip->timer & 0x3ff) == 0x3ff)
+			chip->vibpos = (chip->vibpos + 1) & 7;
+		chip->timer++;
+
+		/* The envelope generator runs at half the sample rate. */
+		if (chip->eg_state)
+		{
+			int shift = 0;
+			while (shift < 13 && !((chip->eg_timer >> shift) & 1))
+				shift++;
+			chip->eg_add = (shift > 12) ? 0 : shift + 1;
+			chip->eg_timer = (chip->eg_timer + 1) & 0xfffffffffull;
+		}
+		chip->eg_state ^= 1;
+
+		n_bit = ((chip->noise >> 14) ^ chip->noise) & 1;
+		chip->noise = (chip->noise >> 1) | (n_bit << 22);
+	}
+}
+
+static void emu_PhaseBlock(emu_chip *chip, emu_slot *slot, const emu_globals *g, size_t n)
+{
+	emu_channel *ch = &chip->channels[slot->channel];
+	uint32_t phase = slot->pg_phase;
+	size_t i;
+
+	if (!slot->vib)
+	{
+		/* No vibrato, so the increment is the same every sample. */
+		uint32_t inc = ((((uint32_t)ch->fnum << ch->block) >> 1) * emu_mt[slot->mult]) >> 1;
+		for (i = 0; i < n; ++i)
+		{
+			slot->phase[i] = phase >> 9;
+			phase += inc;
+		}
+	}
+	else
+	{
+		for (i = 0; i < n; ++i)
+		{
+			int32_t fnum = ch->fnum;
+			int32_t range = (fnum >> 7) & 7;
+			uint8_t vibpos = g->vibpos[i];
+
+			if (!(vibpos & 3))
+				range = 0;
+			else if (vibpos & 1)
+				range >>= 1;
+			range >>= !chip->dvb;
+			if (vibpos & 4)
+				range = -range;
+			fnum += range;
+
+			slot->phase[i] = phase >> 9;
+			phase += ((((uint32_t)fnum << ch->block) >> 1) * emu_mt[slot->mult]) >> 1;
+		}
+	}
+
+	slot->pg_phase = phase & 0x7ffff;
+}
+
+/* Replace the phases of the percussion slots which use the noise generator. */
+static void emu_RhythmPhase(emu_chip *chip, const emu_globals *g, size_t n)
+{
+	emu_slot *hh = &chip->slots[13];
+	emu_slot *sd = &chip->slots[16];
+	emu_slot *tc = &chip->slots[17];
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+	{
+		uint16_t hh_phase = hh->phase[i];
+		uint16_t tc_phase = tc->phase[i];
+		uint8_t hh_bit2 = (hh_phase >> 2) & 1;
+		uint8_t hh_bit3 = (hh_phase >> 3) & 1;
+		uint8_t hh_bit7 = (hh_phase >> 7) & 1;
+		uint8_t hh_bit8 = (hh_phase >> 8) & 1;
+		uint8_t tc_bit3 = (tc_phase >> 3) & 1;
+		uint8_t tc_bit5 = (tc_phase >> 5) & 1;
+		uint8_t rm_xor = (hh_bit2 ^ hh_bit7) | (hh_bit3 ^ tc_bit5) | (tc_bit3 ^ tc_bit5);
+		uint8_t noise = g->noise[i] & 1;
+
+		hh->phase[i] = (rm_xor << 9) | ((rm_xor ^ noise) ? 0xd0 : 0x34);
+		sd->phase[i] = (hh_bit8 << 9) | ((hh_bit8 ^ noise) << 8);
+		tc->phase[i] = (rm_xor << 9) | 0x80;
+	}
+}
+
+static inline bool emu_SlotSilent(const emu_slot *slot)
+{
+	return slot->eg_gen == EG_RELEASE && slot->eg_rout == 0x1ff;
+}
+
+/* Run the envelope generator for a block, giving the final attenuation. */
+static void emu_EnvelopeBlock(emu_chip *chip, emu_slot *slot, const emu_globals *g, uint16_t *eg_out, size_t n)
+{
+	emu_channel *ch = &chip->channels[slot->channel];
+	uint16_t base = (slot->tl << 2) + (slot->eg_ksl >> emu_kslshift[slot->ksl]);
+	uint8_t ks = ch->ksv >> ((!slot->ksr) << 1);
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+	{
+		uint8_t reg_rate, rate, rate_hi, rate_lo;
+		uint8_t shift = 0;
+		uint16_t rout = slot->eg_rout;
+		uint32_t out;
+
+		switch (slot->eg_gen)
+		{
+		case EG_ATTACK: reg_rate = slot->ar; break;
+		case EG_DECAY: reg_rate = slot->dr; break;
+		case EG_SUSTAIN: reg_rate = slot->egt ? 0 : slot->rr; break;
+		default: reg_rate = slot->rr; break;
+		}
+
+		if (reg_rate)
+		{
+			rate = reg_rate * 4 + ks;
+			if (rate > 0x3c)
+				rate = 0x3c;
+			rate_hi = rate >> 2;
+			rate_lo = rate & 3;
+			if (rate_hi < 12)
+			{
+				if (g->eg_state[i])
+				{
+					switch (rate_hi + g->eg_add[i])
+					{
+					case 12: shift = 1; break;
+					case 13: shift = (rate_lo >> 1) & 1; break;
+					case 14: shift = rate_lo & 1; break;
+					}
+				}
+			}
+			else
+			{
+				shift = (rate_hi & 3) + emu_eg_incstep[rate_lo][g->timer[i]];
+				/* Rate 15 is no faster than 14, as on the chip. */
+				if (shift & 4)
+					shift = 3;
+				if (!shift)
+					shift = g->eg_state[i];
+			}
+		}
+		else
+		{
+			rate_hi = 0;
+		}
+
+		switch (slot->eg_gen)
+		{
+		case EG_ATTACK:
+			/* Rate 15, which key scaling can reach from AR 12-14,
+			 * attacks instantly rather than stepping. */
+			if (rate_hi == 0x0f)
+				rout = 0;
+			if (!rout)
+				slot->eg_gen = EG_DECAY;
+			else if (shift)
+				rout -= (rout >> (4 - shift)) + 1;
+			break;
+		case EG_DECAY:
+			if ((rout >> 4) == slot->sl)
+				slot->eg_gen = EG_SUSTAIN;
+			else if (shift)
+				rout += 1 << (shift - 1);
+			break;
+		default:
+			if (shift)
+				rout += 1 << (shift - 1);
+			break;
+		}
+
+		/* Once it gets near silence, the envelope is just switched off. */
+		if (slot->eg_gen != EG_ATTACK && (rout & 0x1f8) == 0x1f8)
+			rout = 0x1ff;
+		if (rout > 0x1ff)
+			rout = 0x1ff;
+		slot->eg_rout = rout;
+
+		out = rout + base + (slot->am ? g->tremolo[i] : 0);
+		eg_out[i] = (out > 0x1ff) ? 0x1ff : out;
+	}
+}
+
+static void emu_SlotBlock(emu_chip *chip, emu_slot *slot, const emu_globals *g, size_t n)
+{
+	emu_channel *ch = &chip->channels[slot->channel];
+	const uint16_t *wave = emu_wavetable[slot->wf];
+	uint16_t eg_out[EMU_BLOCK];
+	size_t i;
+
+	if (emu_SlotSilent(slot))
+	{
+		memset(slot->buf, 0, n * sizeof(int16_t));
+		slot->out = slot->prout = slot->fbmod = 0;
+		return;
+	}
+
+	emu_EnvelopeBlock(chip, slot, g, eg_out, n);
+
+	if (slot->mod == MOD_FEEDBACK)
+	{
+		/* Feedback depends on the last two samples, so do this one at a time. */
+		if (ch->chtype == CH_4OP2)
+			ch = &chip->channels[ch->pair];
+		for (i = 0; i < n; ++i)
+		{
+			slot->fbmod = ch->fb ? (slot->prout + slot->out) >> (0x09 - ch->fb) : 0;
+			slot->prout = slot->out;
+			slot->out = emu_Operator(wave, slot->phase[i] + slot->fbmod, eg_out[i]);
+			slot->buf[i] = slot->out;
+		}
+	}
+	else if (slot->mod == MOD_NONE)
+	{
+		for (i = 0; i < n; ++i)
+			slot->buf[i] = emu_Operator(wave, slot->phase[i], eg_out[i]);
+		slot->prout = slot->buf[n > 1 ? n - 2 : 0];
+		slot->out = slot->buf[n - 1];
+	}
+	else
+	{
+		const int16_t *mod = chip->slots[slot->mod].buf;
+		for (i = 0; i < n; ++i)
+			slot->buf[i] = emu_Operator(wave, slot->phase[i] + mod[i], eg_out[i]);
+		slot->prout = slot->buf[n > 1 ? n - 2 : 0];
+		slot->out = slot->buf[n - 1];
+	}
+}
+
+static void emu_RenderBlock(emu_chip *chip, int16_t *out, size_t n)
+{
+	emu_globals g;
+	int32_t mix_l[EMU_BLOCK], mix_r[EMU_BLOCK];
+	int i, j;
+	size_t k;
+
+	emu_StepGlobals(chip, &g, n);
+
+	for (i = 0; i < EMU_NUM_SLOTS; ++i)
+		emu_PhaseBlock(chip, &chip->slots[i], &g, n);
+	if (chip->rhy & 0x20)
+		emu_RhythmPhase(chip, &g, n);
+
+	memset(mix_l, 0, n * sizeof(int32_t));
+	memset(mix_r, 0, n * sizeof(int32_t));
+
+	for (i = 0; i < EMU_NUM_CHANNELS; ++i)
+	{
+		emu_channel *ch = &chip->channels[i];
+
+		if (ch->chtype == CH_4OP2)
+			continue;
+
+		/* Slots are ordered so that modulators are always done first. */
+		emu_SlotBlock(chip, &chip->slots[ch->slots[0]], &g, n);
+		emu_SlotBlock(chip, &chip->slots[ch->slots[1]], &g, n);
+		if (ch->chtype == CH_4OP)
+		{
+			emu_channel *pair = &chip->channels[ch->pair];
+			emu_SlotBlock(chip, &chip->slots[pair->slots[0]], &g, n);
+			emu_SlotBlock(chip, &chip->slots[pair->slots[1]], &g, n);
+		}
+
+		for (j = 0; j < 4; ++j)
+		{
+			const int16_t *buf;
+			if (ch->out[j] < 0)
+				continue;
+			buf = chip->slots[ch->out[j]].buf;
+			if (ch->left)
+				for (k = 0; k < n; ++k)
+					mix_l[k] += buf[k];
+			if (ch->right)
+				for (k = 0; k < n; ++k)
+					mix_r[k] += buf[k];
+		}
+	}
+
+	for (k = 0; k < n; ++k)
+	{
+		int32_t l = mix_l[k], r = mix_r[k];
+		out[k * 2] = (l > 32767) ? 32767 : (l < -32768) ? -32768 : l;
+		out[k * 2 + 1] = (r > 32767) ? 32767 : (r < -32768) ? -32768 : r;
+	}
+}
+
+static void emu_Render(emu_chip *chip, int16_t *out, size_t frames)
+{
+	while (frames)
+	{
+		size_t n = (frames < EMU_BLOCK) ? frames : EMU_BLOCK;
+		emu_RenderBlock(chip, out, n);
+		out += n * 2;
+		frames -= n;
+	}
+}
+
+/* File output */
+
+static void emu_PutLE(uint8_t *buf, uint32_t val, int len)
+{
+	int i;
+	for (i = 0; i < len; ++i)
+		buf[i] = (val >> (i * 8)) & 0xff;
+}
+
+static void emu_WriteWavHeader(oplhw_emu_device *dev)
+{
+	uint8_t hdr[EMU_WAV_HEADER_LEN];
+	uint32_t data_len = (uint32_t)(dev->frames_rendered * 4);
+
+	memcpy(hdr, "RIFF", 4);
+	emu_PutLE(hdr + 4, data_len + EMU_WAV_HEADER_LEN - 8, 4);
+	memcpy(hdr + 8, "WAVEfmt ", 8);
+	emu_PutLE(hdr + 16, 16, 4);
+	emu_PutLE(hdr + 20, 1, 2);                        /* PCM */
+	emu_PutLE(hdr + 22, 2, 2);                        /* Stereo */
+	emu_PutLE(hdr + 24, OPLHW_EMU_SAMPLE_RATE, 4);
+	emu_PutLE(hdr + 28, OPLHW_EMU_SAMPLE_RATE * 4, 4);
+	emu_PutLE(hdr + 32, 4, 2);
+	emu_PutLE(hdr + 34, 16, 2);
+	memcpy(hdr + 36, "data", 4);
+	emu_PutLE(hdr + 40, data_len, 4);
+
+	fseek(dev->out_file, 0, SEEK_SET);
+	fwrite(hdr, sizeof(hdr), 1, dev->out_file);
+	fseek(dev->out_file, 0, SEEK_END);
+}
+
+/* When writing to a file, render everything up until now. */
+static void emu_CatchUp(oplhw_emu_device *dev)
+{
+	int16_t buf[EMU_BLOCK * 2];
+	uint64_t target;
+
+	if (!dev->out_file)
+		return;
+
+	target = (oplhw_time_Now() - dev->start_time) * OPLHW_EMU_SAMPLE_RATE / OPLHW_NS_PER_SEC;
+	while (dev->frames_rendered < target)
+	{
+		size_t n = target - dev->frames_rendered;
+		size_t k;
+		if (n > EMU_BLOCK)
+			n = EMU_BLOCK;
+		emu_RenderBlock(&dev->chip, buf, n);
+		/* WAV files are little-endian. */
+		for (k = 0; k < n * 2; ++k)
+		{
+			uint8_t le[2];
+			emu_PutLE(le, (uint16_t)buf[k], 2);
+			memcpy(&buf[k], le, 2);
+		}
+		fwrite(buf, 4, n, dev->out_file);
+		dev->frames_rendered += n;
+	}
+}
+
+/* Device */
+
+void oplhw_emu_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
+{
+	oplhw_emu_device *emu_dev = (oplhw_emu_device *)dev;
+	emu_CatchUp(emu_dev);
+	emu_WriteReg(&emu_dev->chip, reg, val);
+}
+
+void oplhw_emu_WriteBatch(oplhw_device *dev, const oplhw_regwrite *writes, size_t n)
+{
+	oplhw_emu_device *emu_dev = (oplhw_emu_device *)dev;
+	size_t i;
+
+	emu_CatchUp(emu_dev);
+	for (i = 0; i < n; ++i)
+		emu_WriteReg(&emu_dev->chip, writes[i].reg, writes[i].val);
+}
+
+void oplhw_emu_Flush(oplhw_device *dev)
+{
+	emu_CatchUp((oplhw_emu_device *)dev);
+}
+
+void oplhw_emu_CloseDevice(oplhw_device *dev)
+{
+	oplhw_emu_device *emu_dev = (oplhw_emu_device *)dev;
+
+	if (emu_dev->out_file)
+	{
+		emu_CatchUp(emu_dev);
+		if (emu_dev->out_wav)
+			emu_WriteWavHeader(emu_dev);
+		fclose(emu_dev->out_file);
+	}
+	free(emu_dev);
+}
+
+oplhw_device *oplhw_emu_OpenDevice(const char *dev_name)
+{
+	oplhw_emu_device *dev = calloc(1, sizeof(*dev));
+	size_t name_len = strlen(dev_name);
+
+	dev->dev.close = &oplhw_emu_CloseDevice;
+	dev->dev.write = &oplhw_emu_Write;
+	dev->dev.write_batch = &oplhw_emu_WriteBatch;
+	dev->dev.flush = &oplhw_emu_Flush;
+	dev->dev.isOPL3 = true;
+
+	pthread_once(&emu_roms_once, emu_InitRoms);
+	emu_ResetChip(&dev->chip);
+
+	/* With a filename, render to it in real time. Otherwise, the
+	 * application pulls samples with oplhw_EmuRender(). */
+	if (name_len)
+	{
+		dev->out_file = fopen(dev_name, "wb");
+		if (!dev->out_file)
+		{
+			free(dev);
+			return NULL;
+		}
+		dev->out_wav = name_len > 4 && !strcmp(dev_name + name_len - 4, ".wav");
+		if (dev->out_wav)
+			emu_WriteWavHeader(dev);
+		dev->start_time = oplhw_time_Now();
+	}
+
+	return (oplhw_device *)dev;
+}
+
+size_t oplhw_EmuRender(oplhw_device *emu_dev, int16_t *buffer, size_t frames)
+{
+	oplhw_emu_device *dev = (oplhw_emu_device *)emu_dev;
+
+	/* Devices rendering to a file are driven by the clock instead. */
+	if (dev->out_file)
+		return 0;
+
+	emu_Render(&dev->chip, buffer, frames);
+	return frames;
+}
@@ -0,0 +1,152 @@
+/*
+ * oplhw: ALSA hwdep-based library for OPL2-based soundcards.
+ *
+ * Copyright (C) 2023 by David Gow <david@davidgow.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "oplhw.h"
+#include "oplhw_internal.h"
+
+/* The most devices we'll keep from each backend. */
+#define ENUM_MAX_DEVICES 16
+
+typedef struct enum_backend
+{
+	oplhw_backend backend;
+	size_t (*enumerate)(oplhw_device_info *devices, size_t max);
+} enum_backend;
+
+/* What a backend found last time, if it's been probed. */
+typedef struct enum_cache
+{
+	const enum_backend *backend;
+	bool probed;
+	size_t num_devices;
+	oplhw_device_info devices[ENUM_MAX_DEVICES];
+} enum_cache;
+
+static const enum_backend enum_backends[] = {
+#ifdef WITH_OPLHW_MODULE_ALSA
+	{ OPLHW_BACKEND_ALSA, oplhw_alsa_Enumerate },
+#endif
+#ifdef WITH_OPLHW_MODULE_LPT
+	{ OPLHW_BACKEND_LPT, oplhw_lpt_Enumerate },
+#endif
+#ifdef WITH_OPLHW_MODULE_RETROWAVE
+	{ OPLHW_BACKEND_RETROWAVE, oplhw_retrowave_Enumerate },
+#endif
+#ifdef WITH_OPLHW_MODULE_UNIX
+	{ OPLHW_BACKEND_UNIX, oplhw_unix_Enumerate },
+#endif
+};
+#define ENUM_NUM_BACKENDS (sizeof(enum_backends) / sizeof(enum_backends[0]))
+
+static enum_cache enum_caches[ENUM_NUM_BACKENDS];
+
+/* Held while probing, so the cache is only filled in once. */
+static pthread_mutex_t enum_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *enum_Probe(void *data)
+{
+	enum_cache *cache = (enum_cache *)data;
+
+	cache->num_devices = cache->backend->enumerate(cache->devices, ENUM_MAX_DEVICES);
+	if (cache->num_devices > ENUM_MAX_DEVICES)
+		cache->num_devices = ENUM_MAX_DEVICES;
+	cache->probed = true;
+	return NULL;
+}
+
+/* Probe every backend which needs it, each on its own thread, as some of
+ * them (e.g. ALSA) can be slow. Must hold enum_lock. */
+static void enum_ProbeAll(bool refresh)
+{
+	pthread_t threads[ENUM_NUM_BACKENDS + 1];
+	bool started[ENUM_NUM_BACKENDS + 1];
+	size_t i;
+
+	for (i = 0; i < ENUM_NUM_BACKENDS; ++i)
+	{
+		enum_cache *cache = &enum_caches[i];
+
+		started[i] = false;
+		cache->backend = &enum_backends[i];
+		if (cache->probed && !refresh)
+			continue;
+		started[i] = !pthread_create(&threads[i], NULL, enum_Probe, cache);
+		/* If we can't have a thread, just do it here. */
+		if (!started[i])
+			enum_Probe(cache);
+	}
+
+	for (i = 0; i < ENUM_NUM_BACKENDS; ++i)
+	{
+		if (started[i])
+			pthread_join(threads[i], NULL);
+	}
+}
+
+size_t oplhw_EnumerateDevices(oplhw_device_info *devices, size_t max, bool refresh)
+{
+	size_t total = 0;
+	size_t i, j;
+
+	pthread_mutex_lock(&enum_lock);
+	enum_ProbeAll(refresh);
+
+	for (i = 0; i < ENUM_NUM_BACKENDS; ++i)
+	{
+		for (j = 0; j < enum_caches[i].num_devices; ++j, ++total)
+		{
+			if (total < max)
+				devices[total] = enum_caches[i].devices[j];
+		}
+	}
+	pthread_mutex_unlock(&enum_lock);
+
+	return total;
+}
+
+bool oplhw_enum_GetDefault(oplhw_backend backend, bool refresh, oplhw_device_info *info)
+{
+	bool found = false;
+	size_t i;
+
+	pthread_mutex_lock(&enum_lock);
+	for (i = 0; i < ENUM_NUM_BACKENDS; ++i)
+	{
+		enum_cache *cache = &enum_caches[i];
+		if (enum_backends[i].backend != backend)
+			continue;
+		/* Only probe the backend we're after. If it found nothing last
+		 * time, something might have been plugged in since. */
+		cache->backend = &enum_backends[i];
+		if (!cache->probed || !cache->num_devices || refresh)
+			enum_Probe(cache);
+		if (cache->num_devices)
+		{
+			*info = cache->devices[0];
+			found = true;
+		}
+	}
+	pthread_mutex_unlock(&enum_lock);
+
+	return found;
+}
@@ -16,62 +16,432 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "oplhw.h"
 #include "oplhw_internal.h"
 
+/* How many writes a filter will process at once in a batch... */
+#define FILTER_BATCH_SIZE 256
+/* ...and how many they can grow to, if filters add writes. */
+#define FILTER_BUFFER_SIZE (2 * FILTER_BATCH_SIZE)
+/* The most filters which can be merged into one device. */
+#define FILTER_MAX_STAGES 16
+
+typedef struct filter_stage
+{
+	oplhw_filter_func func;
+	void *userdata;
+	/* The device the filter was created as, which drops are counted on. */
+	oplhw_device *owner;
+} filter_stage;
+
+/* A filter device runs its filter, and those of any filter devices it was
+ * created on top of, then writes straight to the first device which isn't a
+ * filter. So a chain of filters costs one device's worth of calls. */
 typedef struct oplhw_filter_device
 {
 	oplhw_device dev;
+	/* The device we were created on, which we own. */
+	oplhw_device *backing;
+	/* Where the writes go, after all of the filters. */
 	oplhw_device *next;
+	void (*destroy)(void *userdata);
+	void *userdata;
+	size_t num_stages;
+	filter_stage stages[FILTER_MAX_STAGES];
 } oplhw_filter_device;
 
-typedef struct oplhw_volume_filter_device
+/* The volume filter scales the total level (TL) of carriers: the operators
+ * which are actually heard. Modulators are left alone, so the sound of each
+ * instrument doesn't change. */
+typedef struct volume_filter
 {
-	oplhw_filter_device dev;
 	int volume;
-} oplhw_volume_filter_device;
+	/* Fading from fade_from to fade_to, starting at fade_start. */
+	bool fading;
+	int fade_from, fade_to;
+	uint64_t fade_start, fade_duration;
+	/* Whether some operators' TL might need to be rewritten. */
+	bool dirty;
+	/* The last value written to each register, before scaling. Only the
+	 * TL, connection, 4-op and rhythm registers are kept. */
+	uint8_t regs[0x200];
+	/* The TL registers' values after scaling, as sent to the chip. */
+	uint8_t sent[0x200];
+	uint8_t known[0x200 / 8];
+} volume_filter;
+
+typedef struct cache_filter
+{
+	/* The last value written to each register, if it's known. */
+	uint8_t regs[0x200];
+	uint8_t known[0x200 / 8];
+} cache_filter;
+
+/* Run every filter over the writes in buf, which has room for
+ * FILTER_BUFFER_SIZE. Returns how many writes are left. */
+static size_t filter_Run(oplhw_filter_device *dev, oplhw_regwrite *buf, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < dev->num_stages && n; ++i)
+	{
+		filter_stage *stage = &dev->stages[i];
+		size_t out = stage->func(stage->userdata, buf, n, FILTER_BUFFER_SIZE);
+
+		if (out < n)
+			stage->owner->stats.dropped += n - out;
+		n = out;
+	}
+	return n;
+}
+
+void oplhw_filter_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
+{
+	oplhw_filter_device *filter_dev = (oplhw_filter_device *)dev;
+	oplhw_regwrite buf[FILTER_BUFFER_SIZE];
+	size_t n, i;
+
+	buf[0].reg = reg;
+	buf[0].val = val;
+	n = filter_Run(filter_dev, buf, 1);
+
+	/* Keep single writes single, so that they're buffered (or not) the
+	 * same way. */
+	for (i = 0; i < n; ++i)
+		oplhw_Write(filter_dev->next, buf[i].reg, buf[i].val);
+}
+
+static void filter_Batch(oplhw_filter_device *dev, const uint64_t *deadline, const oplhw_regwrite *writes, size_t n)
+{
+	oplhw_regwrite buf[FILTER_BUFFER_SIZE];
+
+	while (n)
+	{
+		size_t count = (n < FILTER_BATCH_SIZE) ? n : FILTER_BATCH_SIZE;
+		size_t out;
+
+		memcpy(buf, writes, count * sizeof(oplhw_regwrite));
+		out = filter_Run(dev, buf, count);
+		if (out)
+		{
+			if (deadline)
+				oplhw_WriteBatchAt(dev->next, *deadline, buf, out);
+			else
+				oplhw_WriteBatch(dev->next, buf, out);
+		}
+		writes += count;
+		n -= count;
+	}
+}
+
+void oplhw_filter_WriteBatch(oplhw_device *dev, const oplhw_regwrite *writes, size_t n)
+{
+	filter_Batch((oplhw_filter_device *)dev, NULL, writes, n);
+}
+
+void oplhw_filter_WriteAt(oplhw_device *dev, uint64_t deadline, const oplhw_regwrite *writes, size_t n)
+{
+	filter_Batch((oplhw_filter_device *)dev, &deadline, writes, n);
+}
 
 void oplhw_filter_CloseDevice(oplhw_device *dev)
 {
 	oplhw_filter_device *filter_dev = (oplhw_filter_device *)dev;
-	filter_dev->next->close(filter_dev->next);
+	oplhw_CloseDevice(filter_dev->backing);
+	if (filter_dev->destroy)
+		filter_dev->destroy(filter_dev->userdata);
 	free(filter_dev);
 }
 
-void oplhw_volume_filter_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
+void oplhw_filter_Flush(oplhw_device *dev)
 {
-	oplhw_volume_filter_device *vol_dev = (oplhw_volume_filter_device *)dev;
+	oplhw_filter_device *filter_dev = (oplhw_filter_device *)dev;
+	oplhw_Flush(filter_dev->next);
+}
+
+bool oplhw_filter_SetBuffering(oplhw_device *dev, bool enabled)
+{
+	oplhw_filter_device *filter_dev = (oplhw_filter_device *)dev;
+	return oplhw_SetBuffering(filter_dev->next, enabled);
+}
+
+oplhw_device *oplhw_CreateFilter(oplhw_device *backing_dev, oplhw_filter_func func, void (*destroy)(void *userdata), void *userdata)
+{
+	oplhw_filter_device *dev = calloc(1, sizeof(*dev));
+	dev->dev.close = oplhw_filter_CloseDevice;
+	dev->dev.write = oplhw_filter_Write;
+	dev->dev.write_batch = oplhw_filter_WriteBatch;
+	dev->dev.write_at = oplhw_filter_WriteAt;
+	dev->dev.flush = oplhw_filter_Flush;
+	dev->dev.set_buffering = oplhw_filter_SetBuffering;
+	dev->dev.isOPL3 = backing_dev->isOPL3;
+	dev->backing = backing_dev;
+	dev->next = backing_dev;
+	dev->destroy = destroy;
+	dev->userdata = userdata;
 
-	/* If we've got a volume set command. */
-	if ((reg & 0xe0) == 0x40)
+	dev->stages[0].func = func;
+	dev->stages[0].userdata = userdata;
+	dev->stages[0].owner = &dev->dev;
+	dev->num_stages = 1;
+
+	/* If we're on top of another filter, skip it, and run its filters
+	 * ourselves. */
+	if (backing_dev->write == oplhw_filter_Write)
 	{
-		int volume = ~val & 0x3f;
+		oplhw_filter_device *backing_filter = (oplhw_filter_device *)backing_dev;
+		if (backing_filter->num_stages < FILTER_MAX_STAGES)
+		{
+			memcpy(&dev->stages[1], backing_filter->stages, backing_filter->num_stages * sizeof(filter_stage));
+			dev->num_stages += backing_filter->num_stages;
+			dev->next = backing_filter->next;
+		}
+	}
+
+	return (oplhw_device *)dev;
+}
+
+void *oplhw_GetFilterData(oplhw_device *filter_dev)
+{
+	return ((oplhw_filter_device *)filter_dev)->userdata;
+}
+
+/* Returns true if the operator a TL register belongs to is a carrier. */
+static bool volume_filter_IsCarrier(volume_filter *vol, uint16_t reg)
+{
+	uint16_t bank = reg & 0x100;
+	int slot = reg & 0x1f;
+	int channel = (slot >> 3) * 3 + (slot & 7) % 3;
+	bool second_op = (slot & 7) >= 3;
+
+	/* In rhythm mode, both operators of channels 7 and 8 are drums. */
+	if (!bank && (vol->regs[0xBD] & 0x20) && channel >= 7)
+		return true;
 
-		/* Scale the volume. */
-		volume = (volume * vol_dev->volume) >> 8;
+	/* 4-op channels pair channel 0-2 with channel 3-5 in each bank. */
+	if ((vol->regs[0x105] & 0x01) && channel < 6 &&
+	    (vol->regs[0x104] & (1 << ((channel % 3) + (bank ? 3 : 0)))))
+	{
+		int first = channel % 3;
+		int algorithm = (vol->regs[bank | (0xC0 + first)] & 1) << 1 | (vol->regs[bank | (0xC0 + first + 3)] & 1);
+		int op = (channel >= 3 ? 2 : 0) + second_op;
+		/* Which of the 4 operators are carriers, for each algorithm. */
+		static const uint8_t carriers[4] = { 0x8, 0xA, 0x9, 0xD };
 
-		/* Update the value. */
-		val = (val & ~0x3f) | (~volume & 0x3f);
+		return (carriers[algorithm] >> op) & 1;
 	}
 
-	vol_dev->dev.next->write(vol_dev->dev.next, reg, val);
+	return second_op || (vol->regs[bank | (0xC0 + channel)] & 1);
+}
+
+static bool volume_filter_IsTL(uint16_t reg)
+{
+	int slot = reg & 0x1f;
+	return (reg & 0xe0) == 0x40 && slot < 0x16 && (slot & 7) < 6;
+}
+
+/* The value a TL register should have, at the current volume. */
+static uint8_t volume_filter_Scale(volume_filter *vol, uint16_t reg)
+{
+	uint8_t val = vol->regs[reg];
+	int volume = ~val & 0x3f;
+
+	if (!volume_filter_IsCarrier(vol, reg))
+		return val;
+
+	/* Scale the volume. */
+	volume = (volume * vol->volume) >> 8;
+
+	return (val & ~0x3f) | (~volume & 0x3f);
+}
+
+/* Update the volume, if we're fading. */
+static void volume_filter_Fade(volume_filter *vol)
+{
+	uint64_t elapsed = oplhw_GetTime() - vol->fade_start;
+	int volume;
+
+	if (elapsed >= vol->fade_duration)
+	{
+		volume = vol->fade_to;
+		vol->fading = false;
+	}
+	else
+		volume = vol->fade_from + (int)((vol->fade_to - vol->fade_from) * (int64_t)elapsed / (int64_t)vol->fade_duration);
+
+	if (volume != vol->volume)
+	{
+		vol->volume = volume;
+		vol->dirty = true;
+	}
+}
+
+/* Add writes for every TL register whose value is out of date, as long as
+ * there's room. If unscaled, the writes are of the values before scaling. */
+static size_t volume_filter_Refresh(volume_filter *vol, oplhw_regwrite *writes, size_t n, size_t capacity, bool unscaled)
+{
+	uint16_t reg;
+
+	for (reg = 0x40; reg < 0x156; ++reg)
+	{
+		if (reg == 0x56)
+			reg = 0x140;
+		if (!(vol->known[reg >> 3] & (1 << (reg & 7))) || !volume_filter_IsTL(reg))
+			continue;
+		if (volume_filter_Scale(vol, reg) == vol->sent[reg])
+			continue;
+		if (n == capacity)
+			return n;
+		writes[n].reg = reg;
+		writes[n].val = unscaled ? vol->regs[reg] : volume_filter_Scale(vol, reg);
+		if (!unscaled)
+			vol->sent[reg] = writes[n].val;
+		n++;
+	}
+
+	vol->dirty = false;
+	return n;
+}
+
+static size_t volume_filter_Func(void *userdata, oplhw_regwrite *writes, size_t n, size_t capacity)
+{
+	volume_filter *vol = (volume_filter *)userdata;
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+	{
+		uint16_t reg = writes[i].reg & 0x1ff;
+		uint8_t low = reg & 0xff;
+
+		if (volume_filter_IsTL(reg))
+		{
+			vol->regs[reg] = writes[i].val;
+			vol->known[reg >> 3] |= 1 << (reg & 7);
+			writes[i].val = vol->sent[reg] = volume_filter_Scale(vol, reg);
+		}
+		else if ((low >= 0xC0 && low <= 0xC8) || reg == 0xBD || reg == 0x104 || reg == 0x105)
+		{
+			/* These change which operators are carriers. */
+			if (vol->regs[reg] != writes[i].val)
+				vol->dirty = true;
+			vol->regs[reg] = writes[i].val;
+		}
+	}
+
+	if (vol->fading)
+		volume_filter_Fade(vol);
+	if (vol->dirty)
+		n = volume_filter_Refresh(vol, writes, n, capacity, false);
+	return n;
 }
 
 oplhw_device *oplhw_CreateVolumeFilter(oplhw_device *backing_dev)
 {
-	oplhw_volume_filter_device *dev = calloc(1, sizeof(*dev));
-	dev->dev.dev.close = oplhw_filter_CloseDevice;
-	dev->dev.dev.write = oplhw_volume_filter_Write;
-	dev->dev.next = backing_dev;
-	dev->volume = 255;
-	return (oplhw_device *)dev;
+	volume_filter *vol = calloc(1, sizeof(*vol));
+	vol->volume = 255;
+	return oplhw_CreateFilter(backing_dev, volume_filter_Func, free, vol);
+}
+
+/* Rewrite any TL registers which are out of date, right away. */
+static void volume_filter_Update(oplhw_device *volume_dev, volume_filter *vol)
+{
+	/* Enough for every operator: 18 in each bank. */
+	oplhw_regwrite writes[36];
+	size_t n;
+
+	if (!vol->dirty)
+		return;
+
+	/* These go through the filter, which scales them. */
+	n = volume_filter_Refresh(vol, writes, 0, 36, true);
+	if (n)
+		oplhw_WriteBatch(volume_dev, writes, n);
 }
 
 int oplhw_SetVolume(oplhw_device *volume_dev, int volume)
 {
-	oplhw_volume_filter_device *vol_dev = (oplhw_volume_filter_device *)volume_dev;
-	int old_vol = vol_dev->volume;
-	vol_dev->volume = volume;
+	volume_filter *vol = (volume_filter *)oplhw_GetFilterData(volume_dev);
+	int old_vol = vol->volume;
+	vol->volume = volume;
+	vol->fading = false;
+	vol->dirty = true;
+	volume_filter_Update(volume_dev, vol);
 	return old_vol;
 }
+
+void oplhw_FadeVolume(oplhw_device *volume_dev, int volume, uint64_t duration_ns)
+{
+	volume_filter *vol = (volume_filter *)oplhw_GetFilterData(volume_dev);
+
+	if (!duration_ns)
+	{
+		oplhw_SetVolume(volume_dev, volume);
+		return;
+	}
+
+	vol->fading = true;
+	vol->fade_from = vol->volume;
+	vol->fade_to = volume;
+	vol->fade_start = oplhw_GetTime();
+	vol->fade_duration = duration_ns;
+}
+
+bool oplhw_UpdateFade(oplhw_device *volume_dev)
+{
+	volume_filter *vol = (volume_filter *)oplhw_GetFilterData(volume_dev);
+
+	if (vol->fading)
+		volume_filter_Fade(vol);
+	volume_filter_Update(volume_dev, vol);
+	return vol->fading;
+}
+
+/* Returns true if writing the same value twice to reg does something. */
+static bool cache_filter_HasSideEffects(uint16_t reg)
+{
+	uint8_t low = reg & 0xFF;
+
+	/* Timer control / IRQ reset */
+	if (reg == 0x04)
+		return true;
+	/* Key on, and the percussion key on bits. */
+	if ((low >= 0xB0 && low <= 0xB8) || low == 0xBD)
+		return true;
+	return false;
+}
+
+static size_t cache_filter_Func(void *userdata, oplhw_regwrite *writes, size_t n, size_t capacity)
+{
+	cache_filter *cache = (cache_filter *)userdata;
+	size_t out = 0;
+	size_t i;
+
+	(void)capacity;
+
+	for (i = 0; i < n; ++i)
+	{
+		uint16_t idx = writes[i].reg & 0x1FF;
+		uint8_t bit = 1 << (idx & 7);
+
+		/* Drop writes which wouldn't change anything. */
+		if ((cache->known[idx >> 3] & bit) && cache->regs[idx] == writes[i].val && !cache_filter_HasSideEffects(idx))
+			continue;
+
+		cache->regs[idx] = writes[i].val;
+		cache->known[idx >> 3] |= bit;
+		writes[out++] = writes[i];
+	}
+	return out;
+}
+
+oplhw_device *oplhw_CreateCacheFilter(oplhw_device *backing_dev)
+{
+	return oplhw_CreateFilter(backing_dev, cache_filter_Func, free, calloc(1, sizeof(cache_filter)));
+}
+
+uint64_t oplhw_GetCacheDropCount(oplhw_device *cache_dev)
+{
+	return cache_dev->stats.dropped;
+}
@@ -23,16 +23,164 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "oplhw.h"
+
+/* Backends built as plugins call back into the library, so anything they use
+ * has to be visible to them. */
+#if defined(OPLHW_PLUGINS) && __GNUC__ >= 4
+#define OPLHW_PLUGIN_API __attribute__((visibility("default")))
+#else
+#define OPLHW_PLUGIN_API
+#endif
+
 typedef struct oplhw_device
 {
 	bool isOPL3;
 	void (*close)(struct oplhw_device *dev);
 	void (*write)(struct oplhw_device *dev, uint16_t reg, uint8_t val);
+	/* Optional: if NULL, oplhw_WriteBatch() falls back to write(). */
+	void (*write_batch)(struct oplhw_device *dev, const oplhw_regwrite *writes, size_t n);
+	/* Optional: only needed if the device buffers writes. */
+	void (*flush)(struct oplhw_device *dev);
+	bool (*set_buffering)(struct oplhw_device *dev, bool enabled);
+	/* Optional: if NULL, oplhw_WriteBatchAt() waits for the deadline itself. */
+	void (*write_at)(struct oplhw_device *dev, uint64_t deadline, const oplhw_regwrite *writes, size_t n);
+	/* Optional: a quicker way to do oplhw_Reset(), if the device has one. */
+	void (*reset)(struct oplhw_device *dev);
+	/* Optional: for devices made up of other devices, which have to do
+	 * oplhw_SoftReset() on each of them. */
+	void (*soft_reset)(struct oplhw_device *dev);
+	/* The last value written to each register, and whether it's known,
+	 * kept by oplhw_Write() and friends for oplhw_SoftReset(). Registers
+	 * past 0x1ff (on other chips in a pool) aren't kept. */
+	uint8_t shadow[0x200];
+	uint8_t shadow_known[0x200 / 8];
+	/* Filled in by oplhw_Write() and friends, and the backend itself. */
+	oplhw_stats stats;
+	/* Set by oplhw_SetStatsEnabled(), to skip timing each write. */
+	bool stats_off;
+	/* Set if several threads can write at once, so oplhw_Write() and
+	 * friends have to update the statistics and shadow atomically. */
+	bool shared;
+	/* If not NULL, where to record what the device is doing. */
+	oplhw_trace *trace;
+	uint16_t trace_track;
 } oplhw_device;
 
+#define OPLHW_NS_PER_SEC 1000000000ull
+#define OPLHW_NS_PER_USEC 1000ull
+
+/* Get the writes oplhw_Reset() makes, in order: key off first, and OPL3 mode
+ * last. If minimal, leave out registers known to be zero already. writes must
+ * have room for 0x200. Returns how many there are. */
+size_t oplhw_reset_GetWrites(oplhw_device *dev, bool minimal, oplhw_regwrite *writes);
+
+/* Current CLOCK_MONOTONIC time, in nanoseconds. */
+OPLHW_PLUGIN_API uint64_t oplhw_time_Now(void);
+/* Wait until the given CLOCK_MONOTONIC time. This sleeps for as long as it
+ * safely can, then spins for the last little bit. */
+void oplhw_time_SleepUntil(uint64_t deadline);
+/* Busy-wait until the given time. Only for very short waits. */
+void oplhw_time_SpinUntil(uint64_t deadline);
+
+/* Statistics. Backends should record everything they do to the hardware,
+ * with the time (from oplhw_time_Now()) they started doing it. */
+typedef enum oplhw_io_kind
+{
+	OPLHW_IO_PORT,
+	OPLHW_IO_SYSCALL,
+	OPLHW_IO_IOCTL,
+	/* Waiting for sent data to leave the device. */
+	OPLHW_IO_DRAIN
+} oplhw_io_kind;
+
+OPLHW_PLUGIN_API void oplhw_stats_IO(oplhw_device *dev, oplhw_io_kind kind, uint64_t start, bool ok, size_t bytes);
+/* Record a write call, made at start. */
+void oplhw_stats_Write(oplhw_device *dev, uint64_t start, const oplhw_regwrite *writes, size_t n);
+
+/* Tracing. Each record marks the beginning or end of something, or (for
+ * OPLHW_TRACE_ENQUEUE) a single moment. */
+typedef enum oplhw_trace_phase
+{
+	/* A call to oplhw_Write(), with the register and value. */
+	OPLHW_TRACE_WRITE_BEGIN,
+	OPLHW_TRACE_WRITE_END,
+	/* A batch write call, with the number of writes in reg. */
+	OPLHW_TRACE_BATCH_BEGIN,
+	OPLHW_TRACE_BATCH_END,
+	/* Waiting for the chip to be ready. */
+	OPLHW_TRACE_PACE_BEGIN,
+	OPLHW_TRACE_PACE_END,
+	/* I/O, with the number of bytes in reg, and the oplhw_io_kind in val. */
+	OPLHW_TRACE_IO_BEGIN,
+	OPLHW_TRACE_IO_END,
+	/* Writes added to a queue, with the number of writes in reg. */
+	OPLHW_TRACE_ENQUEUE
+} oplhw_trace_phase;
+
+OPLHW_PLUGIN_API void oplhw_trace_Record(oplhw_device *dev, oplhw_trace_phase phase, uint64_t time, uint16_t reg, uint8_t val);
+
+/* Whether write calls need timing, for statistics or tracing. */
+#define OPLHW_WRITE_TIMED(dev) (!(dev)->stats_off || (dev)->trace != NULL)
+
+/* Record an event now, if the device is being traced. */
+#define OPLHW_TRACE(dev, phase, reg, val) \
+	do { \
+		if (__builtin_expect((dev)->trace != NULL, 0)) \
+			oplhw_trace_Record((dev), (phase), oplhw_time_Now(), (reg), (val)); \
+	} while (0)
+
+/* Write pacing, for backends which drive the chip's bus directly. The chip
+ * needs time to settle after each address and data write, so we remember
+ * when it'll next be ready, and only wait for whatever's left of that. */
+typedef struct oplhw_pacing
+{
+	uint64_t address_settle_ns;
+	uint64_t data_settle_ns;
+	uint64_t ready_at;
+} oplhw_pacing;
+
+OPLHW_PLUGIN_API void oplhw_pacing_Init(oplhw_pacing *pacing, bool isOPL3);
+/* Wait until the chip can accept another write, counting the time against
+ * dev's statistics. */
+OPLHW_PLUGIN_API void oplhw_pacing_Wait(oplhw_pacing *pacing, oplhw_device *dev);
+/* Call after writing to the address or data port. */
+OPLHW_PLUGIN_API void oplhw_pacing_AddressWritten(oplhw_pacing *pacing);
+OPLHW_PLUGIN_API void oplhw_pacing_DataWritten(oplhw_pacing *pacing);
+
 oplhw_device *oplhw_retrowave_OpenDevice(const char *dev_name);
 oplhw_device *oplhw_ioport_OpenDevice(const char *dev_name);
 oplhw_device *oplhw_lpt_OpenDevice(const char *dev_name, bool isOPL3);
 oplhw_device *oplhw_alsa_OpenDevice(const char *dev_name);
+oplhw_device *oplhw_emu_OpenDevice(const char *dev_name);
+oplhw_device *oplhw_capture_OpenDevice(const char *dev_name);
+oplhw_device *oplhw_unix_OpenDevice(const char *dev_name);
+oplhw_device *oplhw_null_OpenDevice(const char *dev_name);
+
+/* Backends which can find their own devices fill in at most max of them, and
+ * return how many they found. */
+size_t oplhw_alsa_Enumerate(oplhw_device_info *devices, size_t max);
+size_t oplhw_lpt_Enumerate(oplhw_device_info *devices, size_t max);
+size_t oplhw_retrowave_Enumerate(oplhw_device_info *devices, size_t max);
+size_t oplhw_unix_Enumerate(oplhw_device_info *devices, size_t max);
+/* Get the first device a backend found, enumerating it if it hasn't found
+ * any yet, or if refresh is set (e.g. because the last one couldn't be
+ * opened). Returns false if there aren't any. */
+OPLHW_PLUGIN_API bool oplhw_enum_GetDefault(oplhw_backend backend, bool refresh, oplhw_device_info *info);
+
+/* Backends with heavy dependencies (ALSA, libieee1284) can be built as
+ * plugins, which the shared library only loads when they're first used. Each
+ * exports an oplhw_plugin called OPLHW_PLUGIN_SYMBOL, and the library's
+ * oplhw_<backend>_OpenDevice() and oplhw_<backend>_Enumerate() forward to it. */
+#define OPLHW_PLUGIN_ABI 1
+#define OPLHW_PLUGIN_SYMBOL "oplhw_plugin_entry"
+
+typedef struct oplhw_plugin
+{
+	/* Must be OPLHW_PLUGIN_ABI, as plugins share oplhw_device's layout. */
+	uint32_t abi;
+	oplhw_device *(*open)(const char *dev_name, bool isOPL3);
+	size_t (*enumerate)(oplhw_device_info *devices, size_t max);
+} oplhw_plugin;
 
 #endif
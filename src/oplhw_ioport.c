@@ -37,59 +37,73 @@ typedef struct oplhw_ioport_device
 	oplhw_device dev;
 	int iobase;
 	int devport_fd;
+	oplhw_pacing pacing;
 } oplhw_ioport_device;
 
 static void ioport_WritePort(oplhw_ioport_device *io_dev, int port, uint8_t val)
 {
+	uint64_t start = oplhw_time_Now();
 #ifndef USE_DEV_PORT
 	outb(val, io_dev->iobase + port);
+	oplhw_stats_IO(&io_dev->dev, OPLHW_IO_PORT, start, true, 1);
 #else
+	ssize_t res;
+
 	lseek(io_dev->devport_fd, io_dev->iobase + port, SEEK_SET);
-	write(io_dev->devport_fd, &val, 1);
+	res = write(io_dev->devport_fd, &val, 1);
+	/* Count the seek, too. */
+	io_dev->dev.stats.syscalls++;
+	oplhw_stats_IO(&io_dev->dev, OPLHW_IO_SYSCALL, start, res == 1, 1);
 #endif
 }
 
+static void ioport_WriteReg(oplhw_ioport_device *io_dev, uint16_t reg, uint8_t val)
+{
+	int port = (reg & 0x100) ? 2 : 0;
+
+	oplhw_pacing_Wait(&io_dev->pacing, &io_dev->dev);
+	ioport_WritePort(io_dev, port, reg);
+	oplhw_pacing_AddressWritten(&io_dev->pacing);
+
+	oplhw_pacing_Wait(&io_dev->pacing, &io_dev->dev);
+	ioport_WritePort(io_dev, port + 1, val);
+	oplhw_pacing_DataWritten(&io_dev->pacing);
+}
+
 void oplhw_ioport_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
+{
+	ioport_WriteReg((oplhw_ioport_device *)dev, reg, val);
+}
+
+void oplhw_ioport_WriteBatch(oplhw_device *dev, const oplhw_regwrite *writes, size_t n)
 {
 	oplhw_ioport_device *io_dev = (oplhw_ioport_device *)dev;
-	if (reg & 0x100)
-	{
-		ioport_WritePort(io_dev, 2, reg);
-		usleep(10);
-		ioport_WritePort(io_dev, 3, val);
-		usleep(30);
-	}
-	else
-	{
-		ioport_WritePort(io_dev, 0, reg);
-		usleep(10);
-		ioport_WritePort(io_dev, 1, val);
-		usleep(30);
-	}
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		ioport_WriteReg(io_dev, writes[i].reg, writes[i].val);
 }
 
 void oplhw_ioport_CloseDevice(oplhw_device *dev)
 {
-	int i;
 	oplhw_ioport_device *io_dev = (oplhw_ioport_device *)dev;
 	/* Reset the device again, so we don't have hanging notes */
-	for (i = 0; i < 256; ++i)
-	{
-		ioport_WritePort(io_dev, 0, i);
-		ioport_WritePort(io_dev, 1, 0x00);
-	}
+	oplhw_SoftReset(dev);
 #ifndef USE_DEV_PORT
 	ioperm(io_dev->iobase, 4, 0);
+#else
+	close(io_dev->devport_fd);
 #endif
+	free(io_dev);
 }
 
 oplhw_device *oplhw_ioport_OpenDevice(const char *dev_name)
 {
-	int i;
 	oplhw_ioport_device *dev = calloc(1, sizeof(*dev));
 
 	dev->dev.close = &oplhw_ioport_CloseDevice;
 	dev->dev.write = &oplhw_ioport_Write;
+	dev->dev.write_batch = &oplhw_ioport_WriteBatch;
 
 	dev->iobase = strtol(dev_name, NULL, 16);
 
@@ -125,12 +139,10 @@ oplhw_device *oplhw_ioport_OpenDevice(const char *dev_name)
 	else
 		dev->dev.isOPL3 = true;
 
+	oplhw_pacing_Init(&dev->pacing, dev->dev.isOPL3);
+
 	/* And reset. */
-	for (i = 0; i < 256; ++i)
-	{
-		ioport_WritePort(dev, 0, i);
-		ioport_WritePort(dev, 1, 0x00);
-	}
+	oplhw_Reset(&dev->dev);
 
 	return (oplhw_device *)dev;
 }
@@ -34,33 +34,62 @@ typedef struct oplhw_lpt_device
 {
 	oplhw_device dev;
 	struct parport *parport;
+	oplhw_pacing pacing;
 } oplhw_lpt_device;
 
 
-void oplhw_lpt_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
+static void lpt_WriteData(oplhw_lpt_device *lpt_dev, uint8_t val)
 {
-	oplhw_lpt_device *lpt_dev = (oplhw_lpt_device *)dev;
+	uint64_t start = oplhw_time_Now();
+	ieee1284_write_data(lpt_dev->parport, val);
+	oplhw_stats_IO(&lpt_dev->dev, OPLHW_IO_IOCTL, start, true, 1);
+}
 
-	ieee1284_write_data(lpt_dev->parport, reg & 0xFF);
+static void lpt_WriteControl(oplhw_lpt_device *lpt_dev, uint8_t val)
+{
+	uint64_t start = oplhw_time_Now();
+	ieee1284_write_control(lpt_dev->parport, val);
+	oplhw_stats_IO(&lpt_dev->dev, OPLHW_IO_IOCTL, start, true, 1);
+}
+
+static void lpt_WriteReg(oplhw_lpt_device *lpt_dev, uint16_t reg, uint8_t val)
+{
+	oplhw_pacing_Wait(&lpt_dev->pacing, &lpt_dev->dev);
+	lpt_WriteData(lpt_dev, reg & 0xFF);
 	if (reg & 0x100)
 	{
-		ieee1284_write_control(lpt_dev->parport, (C1284_NINIT | C1284_NSTROBE) ^ C1284_INVERTED);
-		ieee1284_write_control(lpt_dev->parport, (C1284_NSTROBE) ^ C1284_INVERTED);
-		ieee1284_write_control(lpt_dev->parport, (C1284_NINIT | C1284_NSTROBE) ^ C1284_INVERTED);
+		lpt_WriteControl(lpt_dev, (C1284_NINIT | C1284_NSTROBE) ^ C1284_INVERTED);
+		lpt_WriteControl(lpt_dev, (C1284_NSTROBE) ^ C1284_INVERTED);
+		lpt_WriteControl(lpt_dev, (C1284_NINIT | C1284_NSTROBE) ^ C1284_INVERTED);
 	}
 	else
 	{
-		ieee1284_write_control(lpt_dev->parport, (C1284_NSELECTIN | C1284_NINIT | C1284_NSTROBE) ^ C1284_INVERTED);
-		ieee1284_write_control(lpt_dev->parport, (C1284_NSELECTIN | C1284_NSTROBE) ^ C1284_INVERTED);
-		ieee1284_write_control(lpt_dev->parport, (C1284_NSELECTIN | C1284_NINIT | C1284_NSTROBE) ^ C1284_INVERTED);
+		lpt_WriteControl(lpt_dev, (C1284_NSELECTIN | C1284_NINIT | C1284_NSTROBE) ^ C1284_INVERTED);
+		lpt_WriteControl(lpt_dev, (C1284_NSELECTIN | C1284_NSTROBE) ^ C1284_INVERTED);
+		lpt_WriteControl(lpt_dev, (C1284_NSELECTIN | C1284_NINIT | C1284_NSTROBE) ^ C1284_INVERTED);
 	}
-	usleep(4);
+	oplhw_pacing_AddressWritten(&lpt_dev->pacing);
+
+	oplhw_pacing_Wait(&lpt_dev->pacing, &lpt_dev->dev);
+	lpt_WriteData(lpt_dev, val);
+	lpt_WriteControl(lpt_dev, (C1284_NSELECTIN | C1284_NINIT) ^ C1284_INVERTED);
+	lpt_WriteControl(lpt_dev, (C1284_NSELECTIN) ^ C1284_INVERTED);
+	lpt_WriteControl(lpt_dev, (C1284_NSELECTIN | C1284_NINIT) ^ C1284_INVERTED);
+	oplhw_pacing_DataWritten(&lpt_dev->pacing);
+}
 
-	ieee1284_write_data(lpt_dev->parport, val);
-	ieee1284_write_control(lpt_dev->parport, (C1284_NSELECTIN | C1284_NINIT) ^ C1284_INVERTED);
-	ieee1284_write_control(lpt_dev->parport, (C1284_NSELECTIN) ^ C1284_INVERTED);
-	ieee1284_write_control(lpt_dev->parport, (C1284_NSELECTIN | C1284_NINIT) ^ C1284_INVERTED);
-	usleep(33);
+void oplhw_lpt_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
+{
+	lpt_WriteReg((oplhw_lpt_device *)dev, reg, val);
+}
+
+void oplhw_lpt_WriteBatch(oplhw_device *dev, const oplhw_regwrite *writes, size_t n)
+{
+	oplhw_lpt_device *lpt_dev = (oplhw_lpt_device *)dev;
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		lpt_WriteReg(lpt_dev, writes[i].reg, writes[i].val);
 }
 
 void oplhw_lpt_CloseDevice(oplhw_device *dev)
@@ -71,15 +100,46 @@ void oplhw_lpt_CloseDevice(oplhw_device *dev)
 	free(lpt_dev);
 }
 
+size_t oplhw_lpt_Enumerate(oplhw_device_info *devices, size_t max)
+{
+	struct parport_list all_ports = {0};
+	size_t num_devices = 0;
+	int i;
+
+	if (ieee1284_find_ports(&all_ports, 0) != E1284_OK)
+		return 0;
+
+	/* There's no way to tell an OPL2LPT from an OPL3LPT, so list ports as
+	 * OPL2LPTs, which work with either. */
+	for (i = 0; i < all_ports.portc && num_devices < max; ++i)
+	{
+		oplhw_device_info *info = &devices[num_devices];
+		memset(info, 0, sizeof(*info));
+		/* Leave out anything with a name too long to open. */
+		if (snprintf(info->uri, sizeof(info->uri), "opl2lpt:%s", all_ports.portv[i]->name) >= (int)sizeof(info->uri))
+			continue;
+		snprintf(info->description, sizeof(info->description), "OPL2LPT on %.64s (use opl3lpt: for an OPL3LPT)", all_ports.portv[i]->name);
+		info->backend = OPLHW_BACKEND_LPT;
+		info->isOPL3 = false;
+		num_devices++;
+	}
+	ieee1284_free_ports(&all_ports);
+
+	return num_devices;
+}
+
 oplhw_device *oplhw_lpt_OpenDevice(const char *dev_name, bool isOPL3)
 {
 	oplhw_lpt_device *dev = calloc(1, sizeof(*dev));
-	struct parport_list all_ports = {};
+	struct parport_list all_ports = {0};
 	int caps = CAP1284_RAW;
+	int i;
 
 	dev->dev.close = &oplhw_lpt_CloseDevice;
 	dev->dev.write = &oplhw_lpt_Write;
+	dev->dev.write_batch = &oplhw_lpt_WriteBatch;
 	dev->dev.isOPL3 = isOPL3;
+	oplhw_pacing_Init(&dev->pacing, isOPL3);
 
 	if (ieee1284_find_ports(&all_ports, 0) != E1284_OK)
 	{
@@ -87,7 +147,7 @@ oplhw_device *oplhw_lpt_OpenDevice(const char *dev_name, bool isOPL3)
 		return NULL;
 	}
 
-	for (int i = 0; i < all_ports.portc; ++i)
+	for (i = 0; i < all_ports.portc; ++i)
 	{
 		if (!dev_name[0] || !strcmp(dev_name, all_ports.portv[i]->name))
 		{
@@ -95,22 +155,19 @@ oplhw_device *oplhw_lpt_OpenDevice(const char *dev_name, bool isOPL3)
 			break;
 		}
 	}
-	//ieee1284_free_ports(&all_ports);
-
-	if (!dev->parport)
-	{
-		free(dev);
-		return NULL;
-	}
 
-	if (ieee1284_open(dev->parport, F1284_EXCL, &caps) != E1284_OK)
+	/* Opening the port takes a reference to it, so the list can go. */
+	if (!dev->parport || ieee1284_open(dev->parport, F1284_EXCL, &caps) != E1284_OK)
 	{
+		ieee1284_free_ports(&all_ports);
 		free(dev);
 		return NULL;
 	}
+	ieee1284_free_ports(&all_ports);
 
 	if (ieee1284_claim(dev->parport) != E1284_OK)
 	{
+		ieee1284_close(dev->parport);
 		free(dev);
 		return NULL;
 	}
@@ -118,3 +175,10 @@ oplhw_device *oplhw_lpt_OpenDevice(const char *dev_name, bool isOPL3)
 	return (oplhw_device *)dev;
 }
 
+#ifdef OPLHW_BUILDING_PLUGIN
+OPLHW_API const oplhw_plugin oplhw_plugin_entry = {
+	OPLHW_PLUGIN_ABI,
+	oplhw_lpt_OpenDevice,
+	oplhw_lpt_Enumerate
+};
+#endif
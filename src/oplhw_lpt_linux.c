@@ -28,6 +28,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <dirent.h>
 
 #include <sys/ioctl.h>
 #include <linux/ppdev.h>
@@ -38,34 +39,57 @@ typedef struct oplhw_lpt_device
 {
 	oplhw_device dev;
 	int fd;
+	oplhw_pacing pacing;
 } oplhw_lpt_device;
 
 
-void oplhw_lpt_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
+/* Write a data or control byte. */
+static void lpt_WritePort(oplhw_lpt_device *lpt_dev, unsigned long request, uint8_t *byte)
+{
+	uint64_t start = oplhw_time_Now();
+	int res = ioctl(lpt_dev->fd, request, byte);
+	oplhw_stats_IO(&lpt_dev->dev, OPLHW_IO_IOCTL, start, res == 0, 1);
+}
+
+static void lpt_WriteReg(oplhw_lpt_device *lpt_dev, uint16_t reg, uint8_t val)
 {
-	oplhw_lpt_device *lpt_dev = (oplhw_lpt_device *)dev;
 	uint8_t reg_byte = reg & 0xFF;
 	uint8_t reg_ctrl_byte0 = (0x01 | 0x04 | 0x08);
 	uint8_t reg_ctrl_byte1 = (0x01 | 0x08);
 	uint8_t val_ctrl_byte0 = (0x04 | 0x08);
 	uint8_t val_ctrl_byte1 = (0x08);
 
-	ioctl(lpt_dev->fd, PPWDATA, &reg_byte);
+	oplhw_pacing_Wait(&lpt_dev->pacing, &lpt_dev->dev);
+	lpt_WritePort(lpt_dev, PPWDATA, &reg_byte);
 
 
-	ioctl(lpt_dev->fd, PPWCONTROL, &reg_ctrl_byte0);
-	ioctl(lpt_dev->fd, PPWCONTROL, &reg_ctrl_byte1);
-	ioctl(lpt_dev->fd, PPWCONTROL, &reg_ctrl_byte0);
+	lpt_WritePort(lpt_dev, PPWCONTROL, &reg_ctrl_byte0);
+	lpt_WritePort(lpt_dev, PPWCONTROL, &reg_ctrl_byte1);
+	lpt_WritePort(lpt_dev, PPWCONTROL, &reg_ctrl_byte0);
+	oplhw_pacing_AddressWritten(&lpt_dev->pacing);
 
-	usleep(4);
+	oplhw_pacing_Wait(&lpt_dev->pacing, &lpt_dev->dev);
+	lpt_WritePort(lpt_dev, PPWDATA, &val);
 
-	ioctl(lpt_dev->fd, PPWDATA, &val);
 
+	lpt_WritePort(lpt_dev, PPWCONTROL, &val_ctrl_byte0);
+	lpt_WritePort(lpt_dev, PPWCONTROL, &val_ctrl_byte1);
+	lpt_WritePort(lpt_dev, PPWCONTROL, &val_ctrl_byte0);
+	oplhw_pacing_DataWritten(&lpt_dev->pacing);
+}
 
-	ioctl(lpt_dev->fd, PPWCONTROL, &val_ctrl_byte0);
-	ioctl(lpt_dev->fd, PPWCONTROL, &val_ctrl_byte1);
-	ioctl(lpt_dev->fd, PPWCONTROL, &val_ctrl_byte0);
-	usleep(33);
+void oplhw_lpt_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
+{
+	lpt_WriteReg((oplhw_lpt_device *)dev, reg, val);
+}
+
+void oplhw_lpt_WriteBatch(oplhw_device *dev, const oplhw_regwrite *writes, size_t n)
+{
+	oplhw_lpt_device *lpt_dev = (oplhw_lpt_device *)dev;
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		lpt_WriteReg(lpt_dev, writes[i].reg, writes[i].val);
 }
 
 void oplhw_lpt_CloseDevice(oplhw_device *dev)
@@ -77,13 +101,49 @@ void oplhw_lpt_CloseDevice(oplhw_device *dev)
 	free(lpt_dev);
 }
 
+size_t oplhw_lpt_Enumerate(oplhw_device_info *devices, size_t max)
+{
+	DIR *dir = opendir("/dev");
+	struct dirent *entry;
+	size_t num_devices = 0;
+
+	if (!dir)
+		return 0;
+
+	while (num_devices < max && (entry = readdir(dir)))
+	{
+		oplhw_device_info *info;
+		const char *num = entry->d_name + strlen("parport");
+
+		if (strncmp(entry->d_name, "parport", strlen("parport")) || !*num || strspn(num, "0123456789") != strlen(num))
+			continue;
+
+		/* There's no way to tell an OPL2LPT from an OPL3LPT, so list
+		 * ports as OPL2LPTs, which work with either. */
+		info = &devices[num_devices];
+		memset(info, 0, sizeof(*info));
+		/* Leave out anything with a name too long to open. */
+		if (snprintf(info->uri, sizeof(info->uri), "opl2lpt:%s", entry->d_name) >= (int)sizeof(info->uri))
+			continue;
+		snprintf(info->description, sizeof(info->description), "OPL2LPT on %.64s (use opl3lpt: for an OPL3LPT)", entry->d_name);
+		info->backend = OPLHW_BACKEND_LPT;
+		info->isOPL3 = false;
+		num_devices++;
+	}
+	closedir(dir);
+
+	return num_devices;
+}
+
 oplhw_device *oplhw_lpt_OpenDevice(const char *dev_name, bool isOPL3)
 {
 	oplhw_lpt_device *dev = calloc(1, sizeof(*dev));
 
 	dev->dev.close = &oplhw_lpt_CloseDevice;
 	dev->dev.write = &oplhw_lpt_Write;
+	dev->dev.write_batch = &oplhw_lpt_WriteBatch;
 	dev->dev.isOPL3 = isOPL3;
+	oplhw_pacing_Init(&dev->pacing, isOPL3);
 
 	dev->fd = open(dev_name, O_WRONLY);
 
@@ -108,6 +168,7 @@ oplhw_device *oplhw_lpt_OpenDevice(const char *dev_name, bool isOPL3)
 
 	if (ioctl(dev->fd, PPCLAIM))
 	{
+		close(dev->fd);
 		free(dev);
 		return NULL;
 	}
@@ -30,28 +30,216 @@ bool oplhw_IsOPL3(oplhw_device *dev)
 	return dev->isOPL3;
 }
 
+static void shadow_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
+{
+	if (reg > 0x1ff)
+		return;
+	if (dev->shared)
+	{
+		__atomic_store_n(&dev->shadow[reg], val, __ATOMIC_RELAXED);
+		__atomic_fetch_or(&dev->shadow_known[reg >> 3], 1 << (reg & 7), __ATOMIC_RELAXED);
+		return;
+	}
+	dev->shadow[reg] = val;
+	dev->shadow_known[reg >> 3] |= 1 << (reg & 7);
+}
+
+static void shadow_WriteBatch(oplhw_device *dev, const oplhw_regwrite *writes, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		shadow_Write(dev, writes[i].reg, writes[i].val);
+}
+
 void oplhw_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
 {
+	uint64_t start = 0;
+	oplhw_regwrite write;
+
+	if (OPLHW_WRITE_TIMED(dev))
+		start = oplhw_time_Now();
+
 	dev->write(dev, reg, val);
+	shadow_Write(dev, reg, val);
+
+	if (OPLHW_WRITE_TIMED(dev))
+	{
+		write.reg = reg;
+		write.val = val;
+		oplhw_stats_Write(dev, start, &write, 1);
+	}
 }
 
-void oplhw_Reset(oplhw_device *dev)
+void oplhw_WriteBatch(oplhw_device *dev, const oplhw_regwrite *writes, size_t n)
+{
+	uint64_t start = 0;
+	size_t i;
+
+	if (OPLHW_WRITE_TIMED(dev))
+		start = oplhw_time_Now();
+
+	if (dev->write_batch)
+	{
+		dev->write_batch(dev, writes, n);
+	}
+	else
+	{
+		/* The device doesn't support batches, so write one at a time. */
+		for (i = 0; i < n; ++i)
+			dev->write(dev, writes[i].reg, writes[i].val);
+	}
+	shadow_WriteBatch(dev, writes, n);
+	if (OPLHW_WRITE_TIMED(dev))
+		oplhw_stats_Write(dev, start, writes, n);
+}
+
+void oplhw_WriteBatchAt(oplhw_device *dev, uint64_t deadline, const oplhw_regwrite *writes, size_t n)
+{
+	uint64_t now = oplhw_time_Now();
+
+	if (dev->write_at)
+	{
+		dev->write_at(dev, deadline, writes, n);
+		shadow_WriteBatch(dev, writes, n);
+		if (OPLHW_WRITE_TIMED(dev))
+			oplhw_stats_Write(dev, now, writes, n);
+		return;
+	}
+
+	/* Make sure everything before this gets out on time, then wait. */
+	if (deadline > now)
+	{
+		oplhw_Flush(dev);
+		now = oplhw_time_Now();
+		if (deadline > now)
+		{
+			oplhw_time_SleepUntil(deadline);
+			dev->stats.sleep_ns += deadline - now;
+		}
+	}
+	oplhw_WriteBatch(dev, writes, n);
+}
+
+void oplhw_WriteAt(oplhw_device *dev, uint64_t deadline, uint16_t reg, uint8_t val)
+{
+	oplhw_regwrite write;
+	write.reg = reg;
+	write.val = val;
+	oplhw_WriteBatchAt(dev, deadline, &write, 1);
+}
+
+void oplhw_Flush(oplhw_device *dev)
+{
+	if (dev->flush)
+		dev->flush(dev);
+}
+
+bool oplhw_SetBuffering(oplhw_device *dev, bool enabled)
+{
+	/* Devices which don't buffer behave as if buffering were off. */
+	if (!dev->set_buffering)
+		return false;
+	return dev->set_buffering(dev, enabled);
+}
+
+/* Add a write of 0 to reg, unless it's known to be 0 already. */
+static size_t reset_Add(oplhw_device *dev, bool minimal, oplhw_regwrite *writes, size_t n, uint16_t reg)
+{
+	if (minimal && (dev->shadow_known[reg >> 3] & (1 << (reg & 7))) && !dev->shadow[reg])
+		return n;
+	writes[n].reg = reg;
+	writes[n].val = 0x00;
+	return n + 1;
+}
+
+static bool reset_IsKeyOn(uint16_t reg)
+{
+	uint8_t low = reg & 0xff;
+	return (low >= 0xB0 && low <= 0xB8) || reg == 0xBD;
+}
+
+size_t oplhw_reset_GetWrites(oplhw_device *dev, bool minimal, oplhw_regwrite *writes)
 {
-	int i;
+	size_t n = 0;
+	uint16_t reg;
 
-	/* NOTE: This resets an OPL3 back to OPL2 mode! */
-	for (i = 0; i < 256; ++i)
+	/* Stop every note first, so nothing is heard half-reset. */
+	for (reg = 0xB0; reg <= 0xB8; ++reg)
 	{
-		dev->write(dev, i, 0x00);
+		n = reset_Add(dev, minimal, writes, n, reg);
+		if (dev->isOPL3)
+			n = reset_Add(dev, minimal, writes, n, reg | 0x100);
 	}
-	
+	n = reset_Add(dev, minimal, writes, n, 0xBD);
+
+	/* Bank 1 only exists in OPL3 mode, so leave turning that off until
+	 * last. NOTE: This resets an OPL3 back to OPL2 mode! */
 	if (dev->isOPL3)
 	{
-		for (i = 0x100; i < 0x1FF; ++i)
+		for (reg = 0x100; reg < 0x1FF; ++reg)
 		{
-			dev->write(dev, i, 0x00);
+			if (!reset_IsKeyOn(reg) && reg != 0x105)
+				n = reset_Add(dev, minimal, writes, n, reg);
 		}
 	}
+
+	for (reg = 0; reg < 0x100; ++reg)
+	{
+		if (!reset_IsKeyOn(reg))
+			n = reset_Add(dev, minimal, writes, n, reg);
+	}
+
+	if (dev->isOPL3)
+		n = reset_Add(dev, minimal, writes, n, 0x105);
+
+	return n;
+}
+
+void oplhw_Reset(oplhw_device *dev)
+{
+	oplhw_regwrite writes[0x200];
+	size_t n;
+
+	if (dev->reset)
+	{
+		dev->reset(dev);
+	}
+	else
+	{
+		n = oplhw_reset_GetWrites(dev, false, writes);
+		oplhw_WriteBatch(dev, writes, n);
+	}
+
+	memset(dev->shadow, 0, sizeof(dev->shadow));
+	memset(dev->shadow_known, 0xff, sizeof(dev->shadow_known));
+}
+
+void oplhw_SoftReset(oplhw_device *dev)
+{
+	oplhw_regwrite writes[0x200];
+	size_t n;
+
+	if (dev->soft_reset)
+	{
+		dev->soft_reset(dev);
+		memset(dev->shadow, 0, sizeof(dev->shadow));
+		memset(dev->shadow_known, 0xff, sizeof(dev->shadow_known));
+		return;
+	}
+
+	n = oplhw_reset_GetWrites(dev, true, writes);
+
+	/* If most registers need clearing anyway, the device's own reset is
+	 * likely to be quicker. */
+	if (dev->reset && n > 0x100)
+	{
+		oplhw_Reset(dev);
+		return;
+	}
+
+	if (n)
+		oplhw_WriteBatch(dev, writes, n);
 }
 
 static const char* get_protocol_path(const char *prefix, const char *path)
@@ -106,6 +294,34 @@ oplhw_device *oplhw_OpenDevice(const char *dev_name)
 			return dev;
 	}
 #endif
+#ifdef WITH_OPLHW_MODULE_EMU
+	else if ((relative_dev_name = get_protocol_path("emu:", dev_name)))
+	{
+		if ((dev = oplhw_emu_OpenDevice(relative_dev_name)))
+			return dev;
+		return NULL;
+	}
+#endif
+	else if ((relative_dev_name = get_protocol_path("capture:", dev_name)))
+	{
+		if ((dev = oplhw_capture_OpenDevice(relative_dev_name)))
+			return dev;
+		return NULL;
+	}
+	else if ((relative_dev_name = get_protocol_path("null:", dev_name)))
+	{
+		if ((dev = oplhw_null_OpenDevice(relative_dev_name)))
+			return dev;
+		return NULL;
+	}
+#ifdef WITH_OPLHW_MODULE_UNIX
+	else if ((relative_dev_name = get_protocol_path("unix:", dev_name)))
+	{
+		if ((dev = oplhw_unix_OpenDevice(relative_dev_name)))
+			return dev;
+		return NULL;
+	}
+#endif
 #ifdef WITH_OPLHW_MODULE_ALSA
 	else if ((relative_dev_name = get_protocol_path("alsa:", dev_name)))
 	{
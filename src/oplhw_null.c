@@ -0,0 +1,58 @@
+/*
+ * oplhw: ALSA hwdep-based library for OPL2-based soundcards.
+ *
+ * Copyright (C) 2023 by David Gow <david@davidgow.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* The "null:" backend throws everything away. It's an OPL3, unless opened as
+ * "null:opl2". Useful for testing, and for measuring the library's overhead. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "oplhw.h"
+#include "oplhw_internal.h"
+
+void oplhw_null_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
+{
+	(void)dev;
+	(void)reg;
+	(void)val;
+}
+
+void oplhw_null_WriteBatch(oplhw_device *dev, const oplhw_regwrite *writes, size_t n)
+{
+	(void)dev;
+	(void)writes;
+	(void)n;
+}
+
+void oplhw_null_CloseDevice(oplhw_device *dev)
+{
+	free(dev);
+}
+
+oplhw_device *oplhw_null_OpenDevice(const char *dev_name)
+{
+	oplhw_device *dev = calloc(1, sizeof(*dev));
+
+	dev->close = &oplhw_null_CloseDevice;
+	dev->write = &oplhw_null_Write;
+	dev->write_batch = &oplhw_null_WriteBatch;
+	dev->isOPL3 = strcmp(dev_name, "opl2") != 0;
+
+	return dev;
+}
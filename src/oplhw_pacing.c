@@ -0,0 +1,72 @@
+/*
+ * oplhw: ALSA hwdep-based library for OPL2-based soundcards.
+ *
+ * Copyright (C) 2023 by David Gow <david@davidgow.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "oplhw.h"
+#include "oplhw_internal.h"
+
+/* The OPL2 needs 12 cycles of its 3.58MHz clock after an address write, and
+ * 84 after a data write. The OPL3 runs at 14.32MHz, and needs 32 cycles after
+ * either. These have a little margin added. */
+#define PACING_OPL2_ADDRESS_NS 3300
+#define PACING_OPL2_DATA_NS 23000
+#define PACING_OPL3_ADDRESS_NS 2300
+#define PACING_OPL3_DATA_NS 2300
+
+/* Waits shorter than this are spun, rather than slept. */
+#define PACING_SPIN_MAX_NS (10 * OPLHW_NS_PER_USEC)
+
+void oplhw_pacing_Init(oplhw_pacing *pacing, bool isOPL3)
+{
+	pacing->address_settle_ns = isOPL3 ? PACING_OPL3_ADDRESS_NS : PACING_OPL2_ADDRESS_NS;
+	pacing->data_settle_ns = isOPL3 ? PACING_OPL3_DATA_NS : PACING_OPL2_DATA_NS;
+	pacing->ready_at = 0;
+}
+
+void oplhw_pacing_Wait(oplhw_pacing *pacing, oplhw_device *dev)
+{
+	uint64_t now = oplhw_time_Now();
+
+	/* If the application's been busy, the chip may have been ready for a
+	 * while already. */
+	if (now >= pacing->ready_at)
+		return;
+
+	if (pacing->ready_at - now < PACING_SPIN_MAX_NS)
+		oplhw_time_SpinUntil(pacing->ready_at);
+	else
+		oplhw_time_SleepUntil(pacing->ready_at);
+
+	dev->stats.sleep_ns += pacing->ready_at - now;
+	if (dev->trace)
+	{
+		oplhw_trace_Record(dev, OPLHW_TRACE_PACE_BEGIN, now, 0, 0);
+		oplhw_trace_Record(dev, OPLHW_TRACE_PACE_END, pacing->ready_at, 0, 0);
+	}
+}
+
+void oplhw_pacing_AddressWritten(oplhw_pacing *pacing)
+{
+	pacing->ready_at = oplhw_time_Now() + pacing->address_settle_ns;
+}
+
+void oplhw_pacing_DataWritten(oplhw_pacing *pacing)
+{
+	pacing->ready_at = oplhw_time_Now() + pacing->data_settle_ns;
+}
@@ -0,0 +1,126 @@
+/*
+ * oplhw: ALSA hwdep-based library for OPL2-based soundcards.
+ *
+ * Copyright (C) 2023 by David Gow <david@davidgow.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/* Loads backends which were built as plugins. The library's own entry points
+ * for them (oplhw_alsa_OpenDevice(), etc.) live here, and dlopen() the real
+ * backend the first time they're called, so programs which never use it
+ * don't pay for loading its dependencies. */
+
+/* For dladdr() */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "oplhw.h"
+#include "oplhw_internal.h"
+
+typedef struct plugin_module
+{
+	const char *name;
+	bool tried;
+	const oplhw_plugin *plugin;
+} plugin_module;
+
+static pthread_mutex_t plugin_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Plugins live in an "oplhw" directory next to the library, both when it's
+ * installed and in the build tree. Failing that, try where they were meant
+ * to be installed. */
+static void *plugin_Open(const char *name)
+{
+	char path[4096];
+	const char *slash;
+	Dl_info info;
+
+	if (dladdr((void *)&oplhw_OpenDevice, &info) && info.dli_fname && (slash = strrchr(info.dli_fname, '/')))
+	{
+		snprintf(path, sizeof(path), "%.*s/oplhw/oplhw_%s.so", (int)(slash - info.dli_fname), info.dli_fname, name);
+		if (access(path, F_OK))
+			snprintf(path, sizeof(path), "%s/oplhw_%s.so", OPLHW_PLUGIN_DIR, name);
+	}
+	else
+		snprintf(path, sizeof(path), "%s/oplhw_%s.so", OPLHW_PLUGIN_DIR, name);
+
+	return dlopen(path, RTLD_NOW | RTLD_LOCAL);
+}
+
+/* Get a plugin, loading it if this is the first time it's been used. Plugins
+ * are never unloaded, as their devices could be open anywhere. */
+static const oplhw_plugin *plugin_Get(plugin_module *module)
+{
+	const oplhw_plugin *plugin;
+
+	pthread_mutex_lock(&plugin_lock);
+	if (!module->tried)
+	{
+		void *handle = plugin_Open(module->name);
+
+		module->tried = true;
+		if (!handle)
+			fprintf(stderr, "Couldn't load the %s backend: %s\n", module->name, dlerror());
+		else if (!(plugin = dlsym(handle, OPLHW_PLUGIN_SYMBOL)) || plugin->abi != OPLHW_PLUGIN_ABI)
+		{
+			fprintf(stderr, "The %s backend doesn't match this version of liboplhw.\n", module->name);
+			dlclose(handle);
+		}
+		else
+			module->plugin = plugin;
+	}
+	plugin = module->plugin;
+	pthread_mutex_unlock(&plugin_lock);
+
+	return plugin;
+}
+
+#ifdef OPLHW_PLUGIN_ALSA
+static plugin_module plugin_alsa = { "alsa", false, NULL };
+
+oplhw_device *oplhw_alsa_OpenDevice(const char *dev_name)
+{
+	const oplhw_plugin *plugin = plugin_Get(&plugin_alsa);
+	return plugin ? plugin->open(dev_name, false) : NULL;
+}
+
+size_t oplhw_alsa_Enumerate(oplhw_device_info *devices, size_t max)
+{
+	const oplhw_plugin *plugin = plugin_Get(&plugin_alsa);
+	return plugin ? plugin->enumerate(devices, max) : 0;
+}
+#endif
+
+#ifdef OPLHW_PLUGIN_LPT
+static plugin_module plugin_lpt = { "lpt", false, NULL };
+
+oplhw_device *oplhw_lpt_OpenDevice(const char *dev_name, bool isOPL3)
+{
+	const oplhw_plugin *plugin = plugin_Get(&plugin_lpt);
+	return plugin ? plugin->open(dev_name, isOPL3) : NULL;
+}
+
+size_t oplhw_lpt_Enumerate(oplhw_device_info *devices, size_t max)
+{
+	const oplhw_plugin *plugin = plugin_Get(&plugin_lpt);
+	return plugin ? plugin->enumerate(devices, max) : 0;
+}
+#endif
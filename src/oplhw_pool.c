@@ -0,0 +1,374 @@
+/*
+ * oplhw: ALSA hwdep-based library for OPL2-based soundcards.
+ *
+ * Copyright (C) 2023 by David Gow <david@davidgow.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Devices made up of several chips. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "oplhw.h"
+#include "oplhw_internal.h"
+
+/* How many writes we'll sort into each chip's batch at once. */
+#define POOL_BATCH_SIZE 64
+
+typedef struct pool_chip
+{
+	oplhw_device *dev;
+	size_t count;
+	oplhw_regwrite batch[POOL_BATCH_SIZE];
+} pool_chip;
+
+typedef struct oplhw_pool_device
+{
+	oplhw_device dev;
+	size_t num_chips;
+	pool_chip *chips;
+} oplhw_pool_device;
+
+static void pool_SendChip(pool_chip *chip, const uint64_t *deadline)
+{
+	if (!chip->count)
+		return;
+	if (deadline)
+		oplhw_WriteBatchAt(chip->dev, *deadline, chip->batch, chip->count);
+	else
+		oplhw_WriteBatch(chip->dev, chip->batch, chip->count);
+	chip->count = 0;
+}
+
+/* Split a batch up by chip. Writes to each chip stay in order, but there's no
+ * ordering between chips. */
+static void pool_Batch(oplhw_pool_device *pool_dev, const uint64_t *deadline, const oplhw_regwrite *writes, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+	{
+		size_t chip_num = writes[i].reg >> 9;
+		pool_chip *chip;
+
+		if (chip_num >= pool_dev->num_chips)
+		{
+			pool_dev->dev.stats.dropped++;
+			continue;
+		}
+		chip = &pool_dev->chips[chip_num];
+		chip->batch[chip->count].reg = writes[i].reg & 0x1ff;
+		chip->batch[chip->count].val = writes[i].val;
+		if (++chip->count == POOL_BATCH_SIZE)
+			pool_SendChip(chip, deadline);
+	}
+
+	for (i = 0; i < pool_dev->num_chips; ++i)
+		pool_SendChip(&pool_dev->chips[i], deadline);
+}
+
+void oplhw_pool_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
+{
+	oplhw_pool_device *pool_dev = (oplhw_pool_device *)dev;
+	size_t chip_num = reg >> 9;
+
+	if (chip_num < pool_dev->num_chips)
+		oplhw_Write(pool_dev->chips[chip_num].dev, reg & 0x1ff, val);
+	else
+		pool_dev->dev.stats.dropped++;
+}
+
+void oplhw_pool_WriteBatch(oplhw_device *dev, const oplhw_regwrite *writes, size_t n)
+{
+	pool_Batch((oplhw_pool_device *)dev, NULL, writes, n);
+}
+
+void oplhw_pool_WriteAt(oplhw_device *dev, uint64_t deadline, const oplhw_regwrite *writes, size_t n)
+{
+	pool_Batch((oplhw_pool_device *)dev, &deadline, writes, n);
+}
+
+void oplhw_pool_Flush(oplhw_device *dev)
+{
+	oplhw_pool_device *pool_dev = (oplhw_pool_device *)dev;
+	size_t i;
+
+	for (i = 0; i < pool_dev->num_chips; ++i)
+		oplhw_Flush(pool_dev->chips[i].dev);
+}
+
+bool oplhw_pool_SetBuffering(oplhw_device *dev, bool enabled)
+{
+	oplhw_pool_device *pool_dev = (oplhw_pool_device *)dev;
+	bool was_buffered = false;
+	size_t i;
+
+	for (i = 0; i < pool_dev->num_chips; ++i)
+		was_buffered |= oplhw_SetBuffering(pool_dev->chips[i].dev, enabled);
+	return was_buffered;
+}
+
+/* Each chip keeps track of its own registers, so reset them one by one. */
+void oplhw_pool_Reset(oplhw_device *dev)
+{
+	oplhw_pool_device *pool_dev = (oplhw_pool_device *)dev;
+	size_t i;
+
+	for (i = 0; i < pool_dev->num_chips; ++i)
+		oplhw_Reset(pool_dev->chips[i].dev);
+}
+
+void oplhw_pool_SoftReset(oplhw_device *dev)
+{
+	oplhw_pool_device *pool_dev = (oplhw_pool_device *)dev;
+	size_t i;
+
+	for (i = 0; i < pool_dev->num_chips; ++i)
+		oplhw_SoftReset(pool_dev->chips[i].dev);
+}
+
+void oplhw_pool_CloseDevice(oplhw_device *dev)
+{
+	oplhw_pool_device *pool_dev = (oplhw_pool_device *)dev;
+	size_t i;
+
+	for (i = 0; i < pool_dev->num_chips; ++i)
+		oplhw_CloseDevice(pool_dev->chips[i].dev);
+	free(pool_dev->chips);
+	free(pool_dev);
+}
+
+oplhw_device *oplhw_CreatePool(oplhw_device **devs, size_t num_devs, bool parallel)
+{
+	oplhw_pool_device *dev;
+	size_t i;
+
+	/* Register numbers only have room for this many chips. */
+	if (!num_devs || num_devs > 0x10000 / 0x200)
+		return NULL;
+
+	dev = calloc(1, sizeof(*dev));
+	dev->dev.close = &oplhw_pool_CloseDevice;
+	dev->dev.write = &oplhw_pool_Write;
+	dev->dev.write_batch = &oplhw_pool_WriteBatch;
+	dev->dev.write_at = &oplhw_pool_WriteAt;
+	dev->dev.flush = &oplhw_pool_Flush;
+	dev->dev.set_buffering = &oplhw_pool_SetBuffering;
+	dev->dev.reset = &oplhw_pool_Reset;
+	dev->dev.soft_reset = &oplhw_pool_SoftReset;
+	dev->dev.isOPL3 = true;
+
+	dev->num_chips = num_devs;
+	dev->chips = calloc(num_devs, sizeof(pool_chip));
+
+	for (i = 0; i < num_devs; ++i)
+	{
+		dev->chips[i].dev = devs[i];
+		/* Bank 1 is only there if every chip has one. */
+		if (!devs[i]->isOPL3)
+			dev->dev.isOPL3 = false;
+	}
+
+	/* Give each chip its own output thread, so a slow one doesn't hold up
+	 * the others. If we can't, just share ours. */
+	if (parallel)
+	{
+		for (i = 0; i < num_devs; ++i)
+		{
+			oplhw_device *async_dev = oplhw_CreateAsyncDevice(devs[i]);
+			if (async_dev)
+				dev->chips[i].dev = async_dev;
+		}
+	}
+
+	return (oplhw_device *)dev;
+}
+
+/* A pair of OPL2s pretending to be an OPL3: bank 0 goes to the first chip,
+ * and bank 1 to the second. We can't do 4-op channels or per-channel
+ * panning, so in OPL3 mode the first chip is hard left, and the second hard
+ * right (assuming they're wired up that way). In OPL2 mode, bank 0 is played
+ * on both, so it's heard from both sides as it would be on an OPL3. */
+typedef struct oplhw_dual_device
+{
+	oplhw_device dev;
+	pool_chip chips[2];
+	/* The OPL3 "NEW" bit, from 0x105. */
+	bool opl3_mode;
+	/* The last 0xB0-0xB8 values mirrored to the second chip in OPL2
+	 * mode, so its notes can be keyed off when switching to OPL3 mode. */
+	uint8_t mirrored_b0[9];
+} oplhw_dual_device;
+
+static void dual_Queue(oplhw_dual_device *dual_dev, int chip_num, const uint64_t *deadline, uint8_t reg, uint8_t val)
+{
+	pool_chip *chip = &dual_dev->chips[chip_num];
+
+	/* The OPL2 has no stereo bits, and only four waveforms. */
+	if ((reg & 0xf0) == 0xc0)
+		val &= 0x0f;
+	else if ((reg & 0xe0) == 0xe0)
+		val &= 0x03;
+
+	chip->batch[chip->count].reg = reg;
+	chip->batch[chip->count].val = val;
+	if (++chip->count == POOL_BATCH_SIZE)
+		pool_SendChip(chip, deadline);
+}
+
+static void dual_Translate(oplhw_dual_device *dual_dev, const uint64_t *deadline, uint16_t reg, uint8_t val)
+{
+	uint8_t low = reg & 0xff;
+
+	int i;
+
+	if (reg == 0x105)
+	{
+		/* OPL3 mode turns on the extra waveforms, so make sure the
+		 * first four are available on both chips. Bank 0 notes were
+		 * also playing on the second chip, which now belongs to bank
+		 * 1, so key them off there. */
+		if ((val & 1) && !dual_dev->opl3_mode)
+		{
+			dual_Queue(dual_dev, 0, deadline, 0x01, 0x20);
+			dual_Queue(dual_dev, 1, deadline, 0x01, 0x20);
+			for (i = 0; i < 9; ++i)
+			{
+				if (dual_dev->mirrored_b0[i] & 0x20)
+					dual_Queue(dual_dev, 1, deadline, 0xb0 + i, dual_dev->mirrored_b0[i] & ~0x20);
+				dual_dev->mirrored_b0[i] = 0;
+			}
+		}
+		dual_dev->opl3_mode = val & 1;
+		return;
+	}
+
+	if (reg & 0x100)
+	{
+		/* 0x104 (4-op connections) can't be done, and the rest of the
+		 * bank 1 globals don't exist. */
+		if (low < 0x20 || low == 0xbd)
+		{
+			dual_dev->dev.stats.dropped++;
+			return;
+		}
+		dual_Queue(dual_dev, 1, deadline, low, val);
+		return;
+	}
+
+	if (!dual_dev->opl3_mode)
+	{
+		if (low >= 0xb0 && low <= 0xb8)
+			dual_dev->mirrored_b0[low - 0xb0] = val;
+		dual_Queue(dual_dev, 0, deadline, low, val);
+		dual_Queue(dual_dev, 1, deadline, low, val);
+		return;
+	}
+
+	/* An OPL3 has no waveform select enable, so keep it on. */
+	if (low == 0x01)
+	{
+		dual_Queue(dual_dev, 0, deadline, low, val | 0x20);
+		dual_Queue(dual_dev, 1, deadline, low, val | 0x20);
+		return;
+	}
+
+	dual_Queue(dual_dev, 0, deadline, low, val);
+	/* Vibrato/tremolo depth and note select affect every channel on an
+	 * OPL3, but rhythm mode is only on bank 0. */
+	if (low == 0x08)
+		dual_Queue(dual_dev, 1, deadline, low, val);
+	else if (low == 0xbd)
+		dual_Queue(dual_dev, 1, deadline, low, val & 0xc0);
+}
+
+static void dual_Batch(oplhw_dual_device *dual_dev, const uint64_t *deadline, const oplhw_regwrite *writes, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		dual_Translate(dual_dev, deadline, writes[i].reg, writes[i].val);
+
+	pool_SendChip(&dual_dev->chips[0], deadline);
+	pool_SendChip(&dual_dev->chips[1], deadline);
+}
+
+void oplhw_dual_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
+{
+	oplhw_regwrite write;
+	write.reg = reg;
+	write.val = val;
+	dual_Batch((oplhw_dual_device *)dev, NULL, &write, 1);
+}
+
+void oplhw_dual_WriteBatch(oplhw_device *dev, const oplhw_regwrite *writes, size_t n)
+{
+	dual_Batch((oplhw_dual_device *)dev, NULL, writes, n);
+}
+
+void oplhw_dual_WriteAt(oplhw_device *dev, uint64_t deadline, const oplhw_regwrite *writes, size_t n)
+{
+	dual_Batch((oplhw_dual_device *)dev, &deadline, writes, n);
+}
+
+void oplhw_dual_Flush(oplhw_device *dev)
+{
+	oplhw_dual_device *dual_dev = (oplhw_dual_device *)dev;
+	oplhw_Flush(dual_dev->chips[0].dev);
+	oplhw_Flush(dual_dev->chips[1].dev);
+}
+
+bool oplhw_dual_SetBuffering(oplhw_device *dev, bool enabled)
+{
+	oplhw_dual_device *dual_dev = (oplhw_dual_device *)dev;
+	bool was_buffered = oplhw_SetBuffering(dual_dev->chips[0].dev, enabled);
+	was_buffered |= oplhw_SetBuffering(dual_dev->chips[1].dev, enabled);
+	return was_buffered;
+}
+
+void oplhw_dual_CloseDevice(oplhw_device *dev)
+{
+	oplhw_dual_device *dual_dev = (oplhw_dual_device *)dev;
+	oplhw_CloseDevice(dual_dev->chips[0].dev);
+	oplhw_CloseDevice(dual_dev->chips[1].dev);
+	free(dual_dev);
+}
+
+oplhw_device *oplhw_CreateDualOPL2(oplhw_device *left_dev, oplhw_device *right_dev)
+{
+	oplhw_dual_device *dev = calloc(1, sizeof(*dev));
+	int i;
+
+	dev->dev.close = &oplhw_dual_CloseDevice;
+	dev->dev.write = &oplhw_dual_Write;
+	dev->dev.write_batch = &oplhw_dual_WriteBatch;
+	dev->dev.write_at = &oplhw_dual_WriteAt;
+	dev->dev.flush = &oplhw_dual_Flush;
+	dev->dev.set_buffering = &oplhw_dual_SetBuffering;
+	dev->dev.isOPL3 = true;
+
+	dev->chips[0].dev = left_dev;
+	dev->chips[1].dev = right_dev;
+
+	/* Drive both chips at once, so we're no slower than a single one. */
+	for (i = 0; i < 2; ++i)
+	{
+		oplhw_device *async_dev = oplhw_CreateAsyncDevice(dev->chips[i].dev);
+		if (async_dev)
+			dev->chips[i].dev = async_dev;
+	}
+
+	return (oplhw_device *)dev;
+}
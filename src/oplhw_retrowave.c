@@ -19,6 +19,11 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
 
 #include "oplhw.h"
 #include "oplhw_internal.h"
@@ -28,92 +33,368 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
+
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+
+
 
+/* Each register write is a 6-byte IO expander command sequence, and a burst
+ * packet can hold any number of them after a 2-byte header. */
+#define RETROWAVE_CMD_LEN 6
+/* Flush when the burst gets this big... */
+#define RETROWAVE_BURST_WRITES 128
+/* ...or when the oldest buffered write is this old (in ns). */
+#define RETROWAVE_BURST_MAX_AGE (1000 * OPLHW_NS_PER_USEC)
 
+#define RETROWAVE_TXBUF_LEN (RETROWAVE_CMD_LEN * RETROWAVE_BURST_WRITES)
+/* Packing adds a start byte, an end byte, and 1 bit for every 7. */
+#define RETROWAVE_PACKED_LEN(len) ((len) + ((len) + 6) / 7 + 2)
+
+/* Every burst starts with the IO expander address and register, 0x42 0x12,
+ * which are always packed the same way:
+ *   0100001 0000100 10...
+ * That's the start byte, two whole bytes, and two bits left over, which are
+ * packed along with the commands. */
+static const uint8_t retrowave_packed_header[] = {0x00, 0x43, 0x09};
+#define RETROWAVE_HEADER_CARRY 0x2
+#define RETROWAVE_HEADER_CARRY_BITS 2
 
 typedef struct oplhw_retrowave_device
 {
 	oplhw_device dev;
 	int fd;
+	/* Whether fd is a serial port (or pty), rather than e.g. a file. */
+	bool is_tty;
+	/* If true, hold onto writes until a flush. */
+	bool buffered;
+	/* The commands in the burst being built, and when the first was queued. */
+	uint8_t txbuf[RETROWAVE_TXBUF_LEN];
+	size_t txlen;
+	uint64_t txstart;
+	/* The packed burst, including the header. */
+	uint8_t packed[RETROWAVE_PACKED_LEN(RETROWAVE_TXBUF_LEN + 2)];
 } oplhw_retrowave_device;
 
+/* Spread the low 56 bits of bits out into 8 bytes of 7 bits each, with the
+ * low bit of each set, and the first 7 bits in the top byte. */
+static uint64_t retrowave_spread(uint64_t bits)
+{
+#ifdef __BMI2__
+	return _pdep_u64(bits, 0xFEFEFEFEFEFEFEFEull) | 0x0101010101010101ull;
+#else
+	uint64_t spread = 0x0101010101010101ull;
+	int i;
+
+	for (i = 0; i < 8; ++i)
+		spread |= ((bits >> (i * 7)) & 0x7F) << (i * 8 + 1);
+	return spread;
+#endif
+}
+
 /* A weird "insert a 1 bit everywhere" protocol, see:
  * https://github.com/SudoMaker/RetroWave/blob/master/RetroWaveLib/Protocol/README.md
+ *
+ * Packs len bytes, after the carry_bits (< 7) bits in carry, padding the last
+ * output byte with zeroes. This doesn't add the start and end bytes. Returns
+ * the number of bytes written to packed, or 0 if it needs more than
+ * packed_len of them.
  */
-static void retrowave_write_pkt(oplhw_retrowave_device *dev, uint8_t *bytes, size_t len)
+static size_t retrowave_pack(const uint8_t *bytes, size_t len, uint64_t carry, int carry_bits, uint8_t *packed, size_t packed_len)
 {
-	uint8_t packed[512];
-	int out_offset = 1;
-	uint16_t buffer = 0;
-	int bits_buffered = 0;
-	int bytes_written = 0;
-	size_t i;
+	size_t out_len = (carry_bits + len * 8 + 6) / 7;
+	uint8_t *out = packed;
+	int i;
+
+	if (out_len > packed_len)
+		return 0;
 
-	packed[0] = '\0';
-	for(i = 0; i < len; ++i)
+	/* 7 bytes in, 8 bytes out, with the leftover bits carried along. */
+	for (; len >= 7; len -= 7, bytes += 7)
 	{
-		if (bits_buffered > 7)
-		{
-			bits_buffered -= 7;
-			packed[out_offset++] = ((buffer >> (bits_buffered - 1)) & 0xFE) | 1;
-		}
-		buffer = buffer << 8 | bytes[i];
-		bits_buffered += 8;
+		uint64_t bits = (uint64_t)bytes[0] << 48 | (uint64_t)bytes[1] << 40 |
+			(uint64_t)bytes[2] << 32 | (uint64_t)bytes[3] << 24 |
+			(uint64_t)bytes[4] << 16 | (uint64_t)bytes[5] << 8 | bytes[6];
+		uint64_t spread;
+
+		bits |= carry << 56;
+		spread = retrowave_spread(bits >> carry_bits);
+		carry = bits & ((1ull << carry_bits) - 1);
 
+		for (i = 0; i < 8; ++i)
+			out[i] = spread >> (56 - i * 8);
+		out += 8;
 	}
-	while (bits_buffered)
+
+	/* What's left fits in a single block, with zeroes after it. */
+	if (len || carry_bits)
 	{
-		if (bits_buffered >= 7)
-		{
-			bits_buffered -= 7;
-			packed[out_offset++] = ((buffer >> (bits_buffered - 1)) & 0xFE) | 1;
-		}
-		else
-		{
-			packed[out_offset++] = (buffer << (7-bits_buffered + 1)) | 1;
-			bits_buffered = 0;
-		}
+		uint64_t bits = carry;
+		int num_bits = carry_bits + len * 8;
+
+		for (i = 0; i < (int)len; ++i)
+			bits = bits << 8 | bytes[i];
+		for (; num_bits > 0; num_bits -= 7)
+			*out++ = ((num_bits >= 7 ? bits >> (num_bits - 7) : bits << (7 - num_bits)) & 0x7F) << 1 | 1;
 	}
 
-	packed[out_offset++] = 0x02;
+	return out - packed;
+}
+
+static void retrowave_send(oplhw_retrowave_device *dev, const uint8_t *packed, size_t len)
+{
+	size_t bytes_written = 0;
 
-	while (bytes_written < out_offset)
+	while (bytes_written < len)
 	{
-		ssize_t res = write(dev->fd, &packed[bytes_written], out_offset - bytes_written);
+		uint64_t start = oplhw_time_Now();
+		ssize_t res = write(dev->fd, &packed[bytes_written], len - bytes_written);
+		bool full = (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+		oplhw_stats_IO(&dev->dev, OPLHW_IO_SYSCALL, start, res >= 0 || full, res > 0 ? res : 0);
 		if (res < 0)
+		{
+			/* The fd is non-blocking, so wait for the port to
+			 * have room, rather than the whole packet to go out. */
+			if (full)
+			{
+				struct pollfd pfd;
+				pfd.fd = dev->fd;
+				pfd.events = POLLOUT;
+				start = oplhw_time_Now();
+				poll(&pfd, 1, -1);
+				dev->dev.stats.sleep_ns += oplhw_time_Now() - start;
+				continue;
+			}
+			if (errno == EINTR)
+				continue;
 			return;
+		}
 		bytes_written += res;
 	}
 }
 
+/* Pack commands into a burst packet, and send it. packed must already start
+ * with retrowave_packed_header. */
+static void retrowave_send_burst(oplhw_retrowave_device *dev, const uint8_t *cmds, size_t cmds_len, uint8_t *packed, size_t packed_len)
+{
+	size_t len = sizeof(retrowave_packed_header);
+
+	len += retrowave_pack(cmds, cmds_len, RETROWAVE_HEADER_CARRY, RETROWAVE_HEADER_CARRY_BITS,
+			      &packed[len], packed_len - len - 1);
+	packed[len++] = 0x02;
+	retrowave_send(dev, packed, len);
+}
+
+/* Send the pending burst packet, if any. */
+static void retrowave_flush(oplhw_retrowave_device *dev)
+{
+	if (!dev->txlen)
+		return;
+
+	retrowave_send_burst(dev, dev->txbuf, dev->txlen, dev->packed, sizeof(dev->packed));
+	dev->txlen = 0;
+}
+
+static void retrowave_encode(uint8_t *cmd, uint16_t reg, uint8_t val)
+{
+	bool port = (reg & 0x100); /* Are we outputting to the 2nd port on OPL3? */
+
+	cmd[0] = port ? 0xE5 : 0xE1;
+	cmd[1] = reg & 0xFF;
+	cmd[2] = port ? 0xE7 : 0xE3;
+	cmd[3] = val;
+	cmd[4] = 0xFB;
+	cmd[5] = val;
+}
+
+/* Add a register write to the pending burst packet. */
+static void retrowave_queue(oplhw_retrowave_device *dev, uint16_t reg, uint8_t val)
+{
+	if (dev->txlen + RETROWAVE_CMD_LEN > RETROWAVE_TXBUF_LEN)
+		retrowave_flush(dev);
+
+	retrowave_encode(&dev->txbuf[dev->txlen], reg, val);
+	dev->txlen += RETROWAVE_CMD_LEN;
+}
+
+/* Make sure the tty sends exactly what we give it, as soon as we give it. */
+static void retrowave_setup_tty(int fd)
+{
+	struct termios tio;
+#ifdef ASYNC_LOW_LATENCY
+	struct serial_struct serial;
+#endif
+
+	if (!tcgetattr(fd, &tio))
+	{
+		cfmakeraw(&tio);
+		tcsetattr(fd, TCSANOW, &tio);
+	}
+
+#ifdef ASYNC_LOW_LATENCY
+	/* Don't let a USB serial adapter sit on data for its latency timer.
+	 * Not every tty (e.g. a pty) supports this, which is fine. */
+	if (!ioctl(fd, TIOCGSERIAL, &serial))
+	{
+		serial.flags |= ASYNC_LOW_LATENCY;
+		ioctl(fd, TIOCSSERIAL, &serial);
+	}
+#endif
+}
+
 void oplhw_retrowave_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
 {
 	oplhw_retrowave_device *rw_dev = (oplhw_retrowave_device *)dev;
-	bool port = (reg & 0x100); /* Are we outputting to the 2nd port on OPL3? */
-	uint8_t pkt[] = {0x42, 0x12, port ? 0xE5 : 0xE1, reg & 0xFF, port ? 0xE7 : 0xE3, val, 0xFB, val};
-	retrowave_write_pkt(rw_dev, pkt, sizeof(pkt));
+	uint64_t now;
+
+	if (!rw_dev->buffered)
+	{
+		retrowave_queue(rw_dev, reg, val);
+		retrowave_flush(rw_dev);
+		return;
+	}
+
+	now = oplhw_time_Now();
+	if (!rw_dev->txlen)
+		rw_dev->txstart = now;
+
+	retrowave_queue(rw_dev, reg, val);
+
+	/* Don't let writes sit in the buffer for too long. */
+	if (now - rw_dev->txstart >= RETROWAVE_BURST_MAX_AGE)
+		retrowave_flush(rw_dev);
+}
+
+void oplhw_retrowave_WriteBatch(oplhw_device *dev, const oplhw_regwrite *writes, size_t n)
+{
+	oplhw_retrowave_device *rw_dev = (oplhw_retrowave_device *)dev;
+	size_t i;
 
+	for (i = 0; i < n; ++i)
+		retrowave_queue(rw_dev, writes[i].reg, writes[i].val);
+
+	retrowave_flush(rw_dev);
+}
+
+void oplhw_retrowave_Flush(oplhw_device *dev)
+{
+	oplhw_retrowave_device *rw_dev = (oplhw_retrowave_device *)dev;
+
+	retrowave_flush(rw_dev);
+
+	/* Wait until everything has actually left the serial port. */
+	if (rw_dev->is_tty)
+	{
+		uint64_t start = oplhw_time_Now();
+		int res = tcdrain(rw_dev->fd);
+		oplhw_stats_IO(dev, OPLHW_IO_DRAIN, start, res == 0, 0);
+	}
+}
+
+bool oplhw_retrowave_SetBuffering(oplhw_device *dev, bool enabled)
+{
+	oplhw_retrowave_device *rw_dev = (oplhw_retrowave_device *)dev;
+	bool old_buffered = rw_dev->buffered;
+
+	if (!enabled)
+		retrowave_flush(rw_dev);
+	rw_dev->buffered = enabled;
+	return old_buffered;
+}
+
+/* Send the whole reset as one burst, however big. */
+void oplhw_retrowave_Reset(oplhw_device *dev)
+{
+	oplhw_retrowave_device *rw_dev = (oplhw_retrowave_device *)dev;
+	oplhw_regwrite writes[0x200];
+	uint8_t cmds[0x200 * RETROWAVE_CMD_LEN];
+	uint8_t packed[RETROWAVE_PACKED_LEN(sizeof(cmds) + 2)];
+	size_t n, i;
+
+	retrowave_flush(rw_dev);
+
+	n = oplhw_reset_GetWrites(dev, false, writes);
+	for (i = 0; i < n; ++i)
+		retrowave_encode(&cmds[i * RETROWAVE_CMD_LEN], writes[i].reg, writes[i].val);
+
+	memcpy(packed, retrowave_packed_header, sizeof(retrowave_packed_header));
+	retrowave_send_burst(rw_dev, cmds, n * RETROWAVE_CMD_LEN, packed, sizeof(packed));
 }
 
 void oplhw_retrowave_CloseDevice(oplhw_device *dev)
 {
 	oplhw_retrowave_device *rw_dev = (oplhw_retrowave_device *)dev;
 
+	retrowave_flush(rw_dev);
 	close(rw_dev->fd);
 	free(rw_dev);
 }
 
+/* Whether a /dev/serial/by-id name looks like a RetroWave board. */
+static bool retrowave_is_board(const char *name)
+{
+	for (; *name; ++name)
+	{
+		if (!strncasecmp(name, "retrowave", strlen("retrowave")))
+			return true;
+	}
+	return false;
+}
+
+size_t oplhw_retrowave_Enumerate(oplhw_device_info *devices, size_t max)
+{
+	DIR *dir = opendir("/dev/serial/by-id");
+	struct dirent *entry;
+	size_t num_devices = 0;
+
+	if (!dir)
+		return 0;
+
+	while (num_devices < max && (entry = readdir(dir)))
+	{
+		oplhw_device_info *info;
+
+		if (!retrowave_is_board(entry->d_name))
+			continue;
+
+		info = &devices[num_devices];
+		memset(info, 0, sizeof(*info));
+		/* Leave out anything with a name too long to open. */
+		if (snprintf(info->uri, sizeof(info->uri), "retrowave:/dev/serial/by-id/%s", entry->d_name) >= (int)sizeof(info->uri))
+			continue;
+		snprintf(info->description, sizeof(info->description), "RetroWave OPL3 (%.96s)", entry->d_name);
+		info->backend = OPLHW_BACKEND_RETROWAVE;
+		info->isOPL3 = true;
+		num_devices++;
+	}
+	closedir(dir);
+
+	return num_devices;
+}
+
 oplhw_device *oplhw_retrowave_OpenDevice(const char *dev_name)
 {
 	oplhw_retrowave_device *dev = calloc(1, sizeof(*dev));
 
 	dev->dev.close = &oplhw_retrowave_CloseDevice;
 	dev->dev.write = &oplhw_retrowave_Write;
+	dev->dev.write_batch = &oplhw_retrowave_WriteBatch;
+	dev->dev.flush = &oplhw_retrowave_Flush;
+	dev->dev.set_buffering = &oplhw_retrowave_SetBuffering;
+	dev->dev.reset = &oplhw_retrowave_Reset;
 	
 	/* All RetroWave OPL3s are, indeed, OPL3s */
 	dev->dev.isOPL3 = true;
 
-	dev->fd = open(dev_name, O_RDWR);
+	memcpy(dev->packed, retrowave_packed_header, sizeof(retrowave_packed_header));
+
+	dev->fd = open(dev_name, O_RDWR | O_NOCTTY | O_NONBLOCK);
 
 	if (dev->fd < 0)
 	{
@@ -121,6 +402,10 @@ oplhw_device *oplhw_retrowave_OpenDevice(const char *dev_name)
 		return NULL;
 	}
 
+	dev->is_tty = isatty(dev->fd);
+	if (dev->is_tty)
+		retrowave_setup_tty(dev->fd);
+
 	return (oplhw_device *)dev;
 }
 
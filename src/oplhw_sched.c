@@ -0,0 +1,297 @@
+/*
+ * oplhw: ALSA hwdep-based library for OPL2-based soundcards.
+ *
+ * Copyright (C) 2023 by David Gow <david@davidgow.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "oplhw.h"
+#include "oplhw_internal.h"
+
+#define SCHED_INITIAL_EVENTS 256
+/* The most writes we'll send in a single batch. */
+#define SCHED_BATCH_SIZE 64
+/* If the next event is further away than this, wait on the condition variable
+ * (so an earlier event can wake us), otherwise do an accurate sleep. */
+#define SCHED_COARSE_WAIT_NS (2000 * OPLHW_NS_PER_USEC)
+
+typedef struct sched_event
+{
+	uint64_t deadline;
+	/* Keeps writes with the same deadline in the order they were made. */
+	uint64_t seq;
+	oplhw_regwrite write;
+} sched_event;
+
+/* The scheduler keeps pending writes in a binary min-heap, ordered by
+ * deadline, and an output thread which sleeps until the earliest one is due.
+ */
+typedef struct oplhw_sched_device
+{
+	oplhw_device dev;
+	oplhw_device *next;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t drained;
+	bool quit;
+	/* True while the output thread is writing to the backing device. */
+	bool busy;
+
+	sched_event *events;
+	size_t num_events;
+	size_t max_events;
+	uint64_t next_seq;
+} oplhw_sched_device;
+
+static bool sched_EventBefore(const sched_event *a, const sched_event *b)
+{
+	if (a->deadline != b->deadline)
+		return a->deadline < b->deadline;
+	return a->seq < b->seq;
+}
+
+static void sched_Push(oplhw_sched_device *dev, uint64_t deadline, oplhw_regwrite write)
+{
+	size_t i = dev->num_events++;
+
+	if (dev->num_events > dev->max_events)
+	{
+		dev->max_events *= 2;
+		dev->events = realloc(dev->events, dev->max_events * sizeof(sched_event));
+	}
+
+	dev->events[i].deadline = deadline;
+	dev->events[i].seq = dev->next_seq++;
+	dev->events[i].write = write;
+
+	/* Sift up. */
+	while (i)
+	{
+		size_t parent = (i - 1) / 2;
+		sched_event tmp;
+		if (!sched_EventBefore(&dev->events[i], &dev->events[parent]))
+			break;
+		tmp = dev->events[i];
+		dev->events[i] = dev->events[parent];
+		dev->events[parent] = tmp;
+		i = parent;
+	}
+}
+
+static sched_event sched_Pop(oplhw_sched_device *dev)
+{
+	sched_event top = dev->events[0];
+	size_t i = 0;
+
+	dev->events[0] = dev->events[--dev->num_events];
+
+	/* Sift down. */
+	for (;;)
+	{
+		size_t child = i * 2 + 1;
+		sched_event tmp;
+		if (child >= dev->num_events)
+			break;
+		if (child + 1 < dev->num_events && sched_EventBefore(&dev->events[child + 1], &dev->events[child]))
+			child++;
+		if (!sched_EventBefore(&dev->events[child], &dev->events[i]))
+			break;
+		tmp = dev->events[i];
+		dev->events[i] = dev->events[child];
+		dev->events[child] = tmp;
+		i = child;
+	}
+
+	return top;
+}
+
+static void *sched_OutputThread(void *data)
+{
+	oplhw_sched_device *dev = (oplhw_sched_device *)data;
+	oplhw_regwrite batch[SCHED_BATCH_SIZE];
+	bool flushed = true;
+
+	pthread_mutex_lock(&dev->lock);
+	for (;;)
+	{
+		uint64_t deadline, now;
+		size_t count = 0;
+
+		if (!dev->num_events)
+		{
+			/* Make sure the backing device isn't holding onto anything. */
+			if (!flushed)
+			{
+				dev->busy = true;
+				pthread_mutex_unlock(&dev->lock);
+				oplhw_Flush(dev->next);
+				pthread_mutex_lock(&dev->lock);
+				dev->busy = false;
+				flushed = true;
+				continue;
+			}
+			pthread_cond_broadcast(&dev->drained);
+			if (dev->quit)
+				break;
+			pthread_cond_wait(&dev->wake, &dev->lock);
+			continue;
+		}
+		if (dev->quit)
+			break;
+
+		deadline = dev->events[0].deadline;
+		now = oplhw_time_Now();
+
+		if (deadline > now + SCHED_COARSE_WAIT_NS)
+		{
+			/* Wake up a little early, so we can sleep accurately. */
+			struct timespec ts;
+			uint64_t wake_time = deadline - SCHED_COARSE_WAIT_NS / 2;
+			ts.tv_sec = wake_time / OPLHW_NS_PER_SEC;
+			ts.tv_nsec = wake_time % OPLHW_NS_PER_SEC;
+			pthread_cond_timedwait(&dev->wake, &dev->lock, &ts);
+			continue;
+		}
+
+		/* Anything scheduled while we're in here may be up to
+		 * SCHED_COARSE_WAIT_NS late, which is fine for music. */
+		if (deadline > now)
+		{
+			pthread_mutex_unlock(&dev->lock);
+			oplhw_time_SleepUntil(deadline);
+			pthread_mutex_lock(&dev->lock);
+			dev->dev.stats.sleep_ns += deadline - now;
+			continue;
+		}
+
+		/* Send everything that's due. */
+		while (dev->num_events && count < SCHED_BATCH_SIZE && dev->events[0].deadline <= now)
+			batch[count++] = sched_Pop(dev).write;
+
+		dev->busy = true;
+		pthread_mutex_unlock(&dev->lock);
+		oplhw_WriteBatch(dev->next, batch, count);
+		pthread_mutex_lock(&dev->lock);
+		dev->busy = false;
+		flushed = false;
+	}
+	pthread_mutex_unlock(&dev->lock);
+
+	return NULL;
+}
+
+void oplhw_sched_WriteAt(oplhw_device *dev, uint64_t deadline, const oplhw_regwrite *writes, size_t n)
+{
+	oplhw_sched_device *sched_dev = (oplhw_sched_device *)dev;
+	bool wake;
+	size_t i;
+
+	pthread_mutex_lock(&sched_dev->lock);
+	/* Only wake the output thread if these are now the first writes due. */
+	wake = !sched_dev->num_events || deadline < sched_dev->events[0].deadline;
+	for (i = 0; i < n; ++i)
+		sched_Push(sched_dev, deadline, writes[i]);
+	if (wake)
+		pthread_cond_signal(&sched_dev->wake);
+	pthread_mutex_unlock(&sched_dev->lock);
+	OPLHW_TRACE(dev, OPLHW_TRACE_ENQUEUE, n > 0xffff ? 0xffff : n, 0);
+}
+
+void oplhw_sched_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
+{
+	oplhw_regwrite write;
+	write.reg = reg;
+	write.val = val;
+	oplhw_sched_WriteAt(dev, oplhw_time_Now(), &write, 1);
+}
+
+void oplhw_sched_WriteBatch(oplhw_device *dev, const oplhw_regwrite *writes, size_t n)
+{
+	oplhw_sched_WriteAt(dev, oplhw_time_Now(), writes, n);
+}
+
+void oplhw_sched_Flush(oplhw_device *dev)
+{
+	oplhw_sched_device *sched_dev = (oplhw_sched_device *)dev;
+
+	pthread_mutex_lock(&sched_dev->lock);
+	while (sched_dev->num_events || sched_dev->busy)
+		pthread_cond_wait(&sched_dev->drained, &sched_dev->lock);
+	pthread_mutex_unlock(&sched_dev->lock);
+}
+
+void oplhw_sched_CloseDevice(oplhw_device *dev)
+{
+	oplhw_sched_device *sched_dev = (oplhw_sched_device *)dev;
+
+	pthread_mutex_lock(&sched_dev->lock);
+	sched_dev->quit = true;
+	pthread_cond_signal(&sched_dev->wake);
+	pthread_mutex_unlock(&sched_dev->lock);
+	pthread_join(sched_dev->thread, NULL);
+
+	pthread_cond_destroy(&sched_dev->drained);
+	pthread_cond_destroy(&sched_dev->wake);
+	pthread_mutex_destroy(&sched_dev->lock);
+
+	oplhw_CloseDevice(sched_dev->next);
+	free(sched_dev->events);
+	free(sched_dev);
+}
+
+oplhw_device *oplhw_CreateScheduler(oplhw_device *backing_dev)
+{
+	oplhw_sched_device *dev = calloc(1, sizeof(*dev));
+	pthread_condattr_t attr;
+
+	dev->dev.close = &oplhw_sched_CloseDevice;
+	dev->dev.write = &oplhw_sched_Write;
+	dev->dev.write_batch = &oplhw_sched_WriteBatch;
+	dev->dev.write_at = &oplhw_sched_WriteAt;
+	dev->dev.flush = &oplhw_sched_Flush;
+	dev->dev.isOPL3 = backing_dev->isOPL3;
+	dev->next = backing_dev;
+
+	dev->max_events = SCHED_INITIAL_EVENTS;
+	dev->events = malloc(dev->max_events * sizeof(sched_event));
+
+	/* Deadlines are on CLOCK_MONOTONIC, so the timed wait must be, too. */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&dev->lock, NULL);
+	pthread_cond_init(&dev->wake, &attr);
+	pthread_cond_init(&dev->drained, NULL);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&dev->thread, NULL, sched_OutputThread, dev))
+	{
+		pthread_cond_destroy(&dev->drained);
+		pthread_cond_destroy(&dev->wake);
+		pthread_mutex_destroy(&dev->lock);
+		free(dev->events);
+		free(dev);
+		return NULL;
+	}
+
+	return (oplhw_device *)dev;
+}
@@ -0,0 +1,597 @@
+/*
+ * oplhw: ALSA hwdep-based library for OPL2-based soundcards.
+ *
+ * Copyright (C) 2023 by David Gow <david@davidgow.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Parsers for register-dump song files: IMF (type 0 and 1), KMF, DOSBox DRO
+ * (v1 and v2), and VGM (the OPL chips only).
+ *
+ * The file is mapped into memory, and events are decoded straight out of it.
+ * When a song is opened, we make one pass over it to find its length, and
+ * remember where we were (and what every register held) every so often, so
+ * that seeking only needs to decode a few events.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "oplhw.h"
+#include "oplhw_internal.h"
+
+#define SONG_DEFAULT_IMF_RATE 560
+#define SONG_DRO_RATE 1000
+#define SONG_VGM_RATE 44100
+
+/* How many events between seek index entries. */
+#define SONG_INDEX_INTERVAL 2048
+
+#define KMF_SIG "KMF\x1a"
+#define DRO_SIG "DBRAWOPL"
+#define VGM_SIG "Vgm "
+
+typedef enum song_format
+{
+	SONG_IMF,
+	SONG_KMF,
+	SONG_DRO1,
+	SONG_DRO2,
+	SONG_VGM
+} song_format;
+
+/* Where we are in the song. */
+typedef struct song_cursor
+{
+	size_t pos;
+	/* In the song's own units: ticks, milliseconds or samples. */
+	uint64_t time;
+	/* DRO v1: which register bank writes go to. */
+	uint16_t bank;
+	/* KMF: writes left in the current group, and the delay after it. */
+	uint8_t group_left;
+	uint8_t group_delay;
+} song_cursor;
+
+typedef struct song_index_entry
+{
+	song_cursor cursor;
+	uint8_t regs[0x200];
+} song_index_entry;
+
+struct oplhw_song
+{
+	const uint8_t *data;
+	size_t size;
+	song_format format;
+
+	/* Where the events are. */
+	size_t start, end;
+	uint32_t rate;
+	bool isOPL3;
+
+	/* DRO v2 */
+	uint8_t short_delay, long_delay;
+	uint8_t codemap_len;
+	const uint8_t *codemap;
+
+	song_cursor cursor;
+	uint64_t last_time_ns;
+	uint64_t length;
+
+	song_index_entry *index;
+	size_t index_len;
+};
+
+static uint16_t song_Read16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t song_Read32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t song_ToNs(oplhw_song *song, uint64_t time)
+{
+	return time * OPLHW_NS_PER_SEC / song->rate;
+}
+
+/* Decoders: each reads one write, and the time it happens at, and advances
+ * the cursor past it (and any delay which follows). */
+
+static bool song_NextIMF(oplhw_song *song, song_cursor *c, uint64_t *time, uint16_t *reg, uint8_t *val)
+{
+	const uint8_t *p = song->data + c->pos;
+
+	if (c->pos + 4 > song->end)
+		return false;
+
+	*time = c->time;
+	*reg = p[0];
+	*val = p[1];
+	c->time += song_Read16(p + 2);
+	c->pos += 4;
+	return true;
+}
+
+static bool song_NextKMF(oplhw_song *song, song_cursor *c, uint64_t *time, uint16_t *reg, uint8_t *val)
+{
+	for (;;)
+	{
+		const uint8_t *p = song->data + c->pos;
+
+		if (c->pos + 2 > song->end)
+			return false;
+		c->pos += 2;
+
+		if (c->group_left)
+		{
+			*time = c->time;
+			*reg = p[0];
+			*val = p[1];
+			if (!--c->group_left)
+				c->time += c->group_delay;
+			return true;
+		}
+
+		/* Start of a group: the number of writes, and the delay after. */
+		c->group_left = p[0];
+		c->group_delay = p[1];
+		if (!c->group_left)
+			c->time += c->group_delay;
+	}
+}
+
+static bool song_NextDRO1(oplhw_song *song, song_cursor *c, uint64_t *time, uint16_t *reg, uint8_t *val)
+{
+	const uint8_t *data = song->data;
+
+	while (c->pos < song->end)
+	{
+		uint8_t code = data[c->pos++];
+
+		switch (code)
+		{
+		case 0x00: /* Short delay */
+			if (c->pos + 1 > song->end)
+				return false;
+			c->time += data[c->pos] + 1;
+			c->pos += 1;
+			continue;
+		case 0x01: /* Long delay */
+			if (c->pos + 2 > song->end)
+				return false;
+			c->time += song_Read16(data + c->pos) + 1;
+			c->pos += 2;
+			continue;
+		case 0x02: /* Low bank */
+			c->bank = 0;
+			continue;
+		case 0x03: /* High bank */
+			c->bank = 0x100;
+			continue;
+		case 0x04: /* Escape, for registers which clash with the above */
+			if (c->pos + 2 > song->end)
+				return false;
+			code = data[c->pos++];
+			break;
+		default:
+			if (c->pos + 1 > song->end)
+				return false;
+			break;
+		}
+
+		*time = c->time;
+		*reg = c->bank | code;
+		*val = data[c->pos++];
+		return true;
+	}
+	return false;
+}
+
+static bool song_NextDRO2(oplhw_song *song, song_cursor *c, uint64_t *time, uint16_t *reg, uint8_t *val)
+{
+	while (c->pos + 2 <= song->end)
+	{
+		const uint8_t *p = song->data + c->pos;
+		uint8_t index = p[0] & 0x7f;
+
+		c->pos += 2;
+
+		if (p[0] == song->short_delay)
+		{
+			c->time += p[1] + 1;
+			continue;
+		}
+		if (p[0] == song->long_delay)
+		{
+			c->time += (p[1] + 1) << 8;
+			continue;
+		}
+		if (index >= song->codemap_len)
+			continue;
+
+		*time = c->time;
+		*reg = song->codemap[index] | ((p[0] & 0x80) ? 0x100 : 0);
+		*val = p[1];
+		return true;
+	}
+	return false;
+}
+
+/* The number of operand bytes for VGM commands we don't care about. */
+static int song_VGMSkipLength(const uint8_t *p)
+{
+	uint8_t cmd = p[0];
+
+	if (cmd >= 0x30 && cmd <= 0x3f)
+		return 1;
+	if (cmd == 0x4f || cmd == 0x50)
+		return 1;
+	if ((cmd >= 0x40 && cmd <= 0x4e) || (cmd >= 0x51 && cmd <= 0x5f))
+		return 2;
+	if (cmd >= 0xa0 && cmd <= 0xbf)
+		return 2;
+	if (cmd >= 0xc0 && cmd <= 0xdf)
+		return 3;
+	if (cmd >= 0xe0)
+		return 4;
+	switch (cmd)
+	{
+	case 0x68: return 11;
+	case 0x90: case 0x91: case 0x95: return 4;
+	case 0x92: return 5;
+	case 0x93: return 10;
+	case 0x94: return 1;
+	}
+	return -1;
+}
+
+static bool song_NextVGM(oplhw_song *song, song_cursor *c, uint64_t *time, uint16_t *reg, uint8_t *val)
+{
+	const uint8_t *data = song->data;
+
+	while (c->pos < song->end)
+	{
+		const uint8_t *p = data + c->pos;
+		uint8_t cmd = p[0];
+		int skip;
+
+		switch (cmd)
+		{
+		case 0x5a: /* YM3812 */
+		case 0x5b: /* YM3526 */
+		case 0x5c: /* Y8950 */
+		case 0x5e: /* YMF262 port 0 */
+		case 0x5f: /* YMF262 port 1 */
+			if (c->pos + 3 > song->end)
+				return false;
+			c->pos += 3;
+			*time = c->time;
+			*reg = p[1] | ((cmd == 0x5f) ? 0x100 : 0);
+			*val = p[2];
+			return true;
+		case 0x61:
+			if (c->pos + 3 > song->end)
+				return false;
+			c->time += song_Read16(p + 1);
+			c->pos += 3;
+			continue;
+		case 0x62:
+			c->time += 735;
+			c->pos++;
+			continue;
+		case 0x63:
+			c->time += 882;
+			c->pos++;
+			continue;
+		case 0x66: /* End of data */
+			return false;
+		case 0x67: /* Data block */
+			if (c->pos + 7 > song->end)
+				return false;
+			c->pos += 7 + song_Read32(p + 3);
+			continue;
+		}
+
+		if ((cmd & 0xf0) == 0x70)
+		{
+			c->time += (cmd & 0x0f) + 1;
+			c->pos++;
+			continue;
+		}
+		if ((cmd & 0xf0) == 0x80)
+		{
+			c->time += cmd & 0x0f;
+			c->pos++;
+			continue;
+		}
+
+		skip = song_VGMSkipLength(p);
+		if (skip < 0)
+			return false;
+		c->pos += 1 + skip;
+	}
+	return false;
+}
+
+static bool song_Next(oplhw_song *song, song_cursor *c, uint64_t *time, uint16_t *reg, uint8_t *val)
+{
+	switch (song->format)
+	{
+	case SONG_IMF: return song_NextIMF(song, c, time, reg, val);
+	case SONG_KMF: return song_NextKMF(song, c, time, reg, val);
+	case SONG_DRO1: return song_NextDRO1(song, c, time, reg, val);
+	case SONG_DRO2: return song_NextDRO2(song, c, time, reg, val);
+	case SONG_VGM: return song_NextVGM(song, c, time, reg, val);
+	}
+	return false;
+}
+
+/* Work out what sort of file this is, and where the events are. */
+static bool song_ParseHeader(oplhw_song *song, unsigned imf_rate)
+{
+	const uint8_t *data = song->data;
+	size_t size = song->size;
+
+	if (size >= 8 && !memcmp(data, KMF_SIG, 4))
+	{
+		song->format = SONG_KMF;
+		song->rate = song_Read16(data + 4);
+		song->start = 8;
+		song->end = 8 + song_Read16(data + 6);
+	}
+	else if (size >= 24 && !memcmp(data, DRO_SIG, 8))
+	{
+		uint16_t major = song_Read16(data + 8);
+		song->rate = SONG_DRO_RATE;
+		if (major == 2)
+		{
+			if (size < 26)
+				return false;
+			song->format = SONG_DRO2;
+			song->isOPL3 = data[20] != 0;
+			if (data[21] != 0 || data[22] != 0)
+				return false; /* Only interleaved, uncompressed data. */
+			song->short_delay = data[23];
+			song->long_delay = data[24];
+			song->codemap_len = data[25];
+			if (song->codemap_len > 0x80 || size < 26u + song->codemap_len)
+				return false;
+			song->codemap = data + 26;
+			song->start = 26 + song->codemap_len;
+			song->end = song->start + (size_t)song_Read32(data + 12) * 2;
+		}
+		else
+		{
+			song->format = SONG_DRO1;
+			/* The hardware type is a byte in early files, and a
+			 * 32-bit value in later ones. */
+			song->isOPL3 = data[20] != 0;
+			song->start = (data[21] || data[22] || data[23]) ? 21 : 24;
+			song->end = song->start + song_Read32(data + 16);
+		}
+	}
+	else if (size >= 0x40 && !memcmp(data, VGM_SIG, 4))
+	{
+		uint32_t version = song_Read32(data + 0x08);
+		song->format = SONG_VGM;
+		song->rate = SONG_VGM_RATE;
+		song->start = 0x40;
+		if (version >= 0x150 && song_Read32(data + 0x34))
+			song->start = 0x34 + song_Read32(data + 0x34);
+		song->end = song_Read32(data + 0x04) ? 4 + (size_t)song_Read32(data + 0x04) : size;
+		if (version >= 0x151 && size >= 0x60)
+			song->isOPL3 = song_Read32(data + 0x5c) != 0;
+	}
+	else
+	{
+		uint16_t len;
+		if (size < 4)
+			return false;
+		song->format = SONG_IMF;
+		song->rate = imf_rate ? imf_rate : SONG_DEFAULT_IMF_RATE;
+		/* "Type 1" IMF files start with a length. Type 0 files start
+		 * with an empty write, so that's how we tell them apart. */
+		len = song_Read16(data);
+		if (len)
+		{
+			song->start = 2;
+			song->end = 2 + len;
+		}
+		else
+		{
+			song->start = 0;
+			song->end = size;
+		}
+	}
+
+	if (!song->rate)
+		return false;
+	if (song->end > size)
+		song->end = size;
+	return true;
+}
+
+/* Go through the whole song once, to get its length and build the index. */
+static bool song_BuildIndex(oplhw_song *song)
+{
+	song_cursor c;
+	uint8_t regs[0x200];
+	size_t max_index = 16;
+	size_t events = 0;
+	uint64_t time;
+	uint16_t reg;
+	uint8_t val;
+
+	memset(&c, 0, sizeof(c));
+	c.pos = song->start;
+	memset(regs, 0, sizeof(regs));
+
+	song->index = malloc(max_index * sizeof(song_index_entry));
+	if (!song->index)
+		return false;
+
+	for (;;)
+	{
+		song_cursor before = c;
+
+		if (!song_Next(song, &c, &time, &reg, &val))
+			break;
+
+		if (!(events++ % SONG_INDEX_INTERVAL))
+		{
+			if (song->index_len == max_index)
+			{
+				song_index_entry *new_index;
+				max_index *= 2;
+				new_index = realloc(song->index, max_index * sizeof(song_index_entry));
+				if (!new_index)
+					return false;
+				song->index = new_index;
+			}
+			song->index[song->index_len].cursor = before;
+			memcpy(song->index[song->index_len].regs, regs, sizeof(regs));
+			song->index_len++;
+		}
+
+		regs[reg & 0x1ff] = val;
+	}
+
+	song->length = c.time;
+	return true;
+}
+
+oplhw_song *oplhw_OpenSong(const char *path, unsigned imf_rate)
+{
+	oplhw_song *song;
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || !st.st_size)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	/* The mapping stays valid once the file is closed. */
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	song = calloc(1, sizeof(*song));
+	song->data = data;
+	song->size = st.st_size;
+
+	if (!song_ParseHeader(song, imf_rate) || !song_BuildIndex(song))
+	{
+		oplhw_CloseSong(song);
+		return NULL;
+	}
+
+	song->cursor.pos = song->start;
+	return song;
+}
+
+void oplhw_CloseSong(oplhw_song *song)
+{
+	munmap((void *)song->data, song->size);
+	free(song->index);
+	free(song);
+}
+
+bool oplhw_SongIsOPL3(oplhw_song *song)
+{
+	return song->isOPL3;
+}
+
+uint64_t oplhw_GetSongLength(oplhw_song *song)
+{
+	return song_ToNs(song, song->length);
+}
+
+bool oplhw_NextSongEvent(oplhw_song *song, oplhw_songevent *event)
+{
+	uint64_t time;
+
+	if (!song_Next(song, &song->cursor, &time, &event->reg, &event->val))
+		return false;
+
+	event->time_ns = song_ToNs(song, time);
+	event->delta_ns = event->time_ns - song->last_time_ns;
+	song->last_time_ns = event->time_ns;
+	return true;
+}
+
+void oplhw_SeekSong(oplhw_song *song, uint64_t time_ns, uint8_t *regs)
+{
+	uint8_t tmp_regs[0x200];
+	song_cursor c;
+	size_t lo = 0, hi = song->index_len;
+	uint64_t time;
+	uint16_t reg;
+	uint8_t val;
+
+	if (!regs)
+		regs = tmp_regs;
+
+	/* Find the last index entry before the time we want. */
+	while (hi - lo > 1)
+	{
+		size_t mid = (lo + hi) / 2;
+		if (song_ToNs(song, song->index[mid].cursor.time) < time_ns)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	if (song->index_len)
+	{
+		c = song->index[lo].cursor;
+		memcpy(regs, song->index[lo].regs, 0x200);
+	}
+	else
+	{
+		memset(&c, 0, sizeof(c));
+		c.pos = song->start;
+		memset(regs, 0, 0x200);
+	}
+
+	/* Then play everything up until then. */
+	for (;;)
+	{
+		song_cursor next = c;
+		if (!song_Next(song, &next, &time, &reg, &val) || song_ToNs(song, time) >= time_ns)
+			break;
+		regs[reg & 0x1ff] = val;
+		c = next;
+	}
+
+	song->cursor = c;
+	song->last_time_ns = time_ns;
+}
@@ -0,0 +1,166 @@
+/*
+ * oplhw: ALSA hwdep-based library for OPL2-based soundcards.
+ *
+ * Copyright (C) 2023 by David Gow <david@davidgow.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "oplhw.h"
+#include "oplhw_internal.h"
+
+/* Every register, plus key-off for every channel and the drums. */
+#define STATE_MAX_WRITES (0x200 + 32)
+
+#define STATE_KNOWN(state, reg) ((state)->known[(reg) >> 3] & (1 << ((reg) & 7)))
+
+/* Working out how to get from one state to another. cur is what the chip
+ * will have after the writes so far. */
+typedef struct state_diff
+{
+	oplhw_state cur;
+	const oplhw_state *target;
+	oplhw_regwrite writes[STATE_MAX_WRITES];
+	size_t n;
+} state_diff;
+
+/* Operator register rows, and each channel's first operator. */
+static const uint8_t state_op_rows[] = { 0x20, 0x40, 0x60, 0x80, 0xE0 };
+static const uint8_t state_first_op[9] = { 0x00, 0x01, 0x02, 0x08, 0x09, 0x0A, 0x10, 0x11, 0x12 };
+
+void oplhw_SaveState(oplhw_device *dev, oplhw_state *state)
+{
+	memcpy(state->regs, dev->shadow, sizeof(state->regs));
+	memcpy(state->known, dev->shadow_known, sizeof(state->known));
+}
+
+/* Whether reg needs to be written to reach the target. */
+static bool state_Differs(state_diff *diff, uint16_t reg)
+{
+	return STATE_KNOWN(diff->target, reg) &&
+	       (!STATE_KNOWN(&diff->cur, reg) || diff->cur.regs[reg] != diff->target->regs[reg]);
+}
+
+static void state_Add(state_diff *diff, uint16_t reg, uint8_t val)
+{
+	diff->writes[diff->n].reg = reg;
+	diff->writes[diff->n].val = val;
+	diff->n++;
+	diff->cur.regs[reg] = val;
+	diff->cur.known[reg >> 3] |= 1 << (reg & 7);
+}
+
+static void state_AddIfDiffers(state_diff *diff, uint16_t reg)
+{
+	if (state_Differs(diff, reg))
+		state_Add(diff, reg, diff->target->regs[reg]);
+}
+
+/* Whether anything about a channel's sound will change. */
+static bool state_ChannelDiffers(state_diff *diff, uint16_t bank, int channel)
+{
+	uint16_t op = bank | state_first_op[channel];
+	size_t i;
+
+	if (state_Differs(diff, bank | (0xA0 + channel)) || state_Differs(diff, bank | (0xB0 + channel)) ||
+	    state_Differs(diff, bank | (0xC0 + channel)))
+		return true;
+
+	for (i = 0; i < sizeof(state_op_rows); ++i)
+	{
+		if (state_Differs(diff, op + state_op_rows[i]) || state_Differs(diff, op + state_op_rows[i] + 3))
+			return true;
+	}
+	return false;
+}
+
+/* Key off every playing channel which is about to change, so nothing is heard
+ * until it's been set up. */
+static void state_KeyOff(state_diff *diff, bool opl3)
+{
+	bool mode_differs = state_Differs(diff, 0x104) || state_Differs(diff, 0x105);
+	uint8_t four_op = diff->cur.regs[0x104] | diff->target->regs[0x104];
+	bool drums_differ = state_Differs(diff, 0xBD);
+	uint16_t bank;
+	int channel;
+
+	for (bank = 0; bank <= (opl3 ? 0x100 : 0); bank += 0x100)
+	{
+		for (channel = 0; channel < 9; ++channel)
+		{
+			uint16_t reg = bank | (0xB0 + channel);
+			bool differs = mode_differs || state_ChannelDiffers(diff, bank, channel);
+
+			/* 4-op channels are only as unchanged as their partner. */
+			if (!differs && channel < 6 && (four_op & (1 << (channel % 3 + (bank ? 3 : 0)))))
+				differs = state_ChannelDiffers(diff, bank, channel < 3 ? channel + 3 : channel - 3);
+
+			if (!bank && channel >= 6 && differs)
+				drums_differ = true;
+
+			if (differs && STATE_KNOWN(&diff->cur, reg) && (diff->cur.regs[reg] & 0x20))
+				state_Add(diff, reg, diff->cur.regs[reg] & ~0x20);
+		}
+	}
+
+	/* The drums are keyed on in 0xBD. */
+	if (drums_differ && STATE_KNOWN(&diff->cur, 0xBD) && (diff->cur.regs[0xBD] & 0x1F))
+		state_Add(diff, 0xBD, diff->cur.regs[0xBD] & ~0x1F);
+}
+
+static bool state_IsKeyOn(uint16_t reg)
+{
+	uint8_t low = reg & 0xff;
+	return (low >= 0xB0 && low <= 0xB8) || reg == 0xBD;
+}
+
+void oplhw_RestoreState(oplhw_device *dev, const oplhw_state *state)
+{
+	state_diff diff;
+	uint16_t reg, last = dev->isOPL3 ? 0x200 : 0x100;
+	bool opl3_on = STATE_KNOWN(state, 0x105) && (state->regs[0x105] & 1);
+
+	oplhw_SaveState(dev, &diff.cur);
+	diff.target = state;
+	diff.n = 0;
+
+	state_KeyOff(&diff, dev->isOPL3);
+
+	/* Bank 1 only exists in OPL3 mode, so turn it on first, or off last. */
+	if (dev->isOPL3 && opl3_on)
+		state_AddIfDiffers(&diff, 0x105);
+
+	for (reg = 0; reg < last; ++reg)
+	{
+		if (!state_IsKeyOn(reg) && reg != 0x105)
+			state_AddIfDiffers(&diff, reg);
+	}
+
+	if (dev->isOPL3 && !opl3_on)
+		state_AddIfDiffers(&diff, 0x105);
+
+	/* Finally, start the notes which should be playing. */
+	for (reg = 0; reg < last; reg += 0x100)
+	{
+		uint16_t channel;
+		for (channel = 0; channel < 9; ++channel)
+			state_AddIfDiffers(&diff, reg | (0xB0 + channel));
+	}
+	state_AddIfDiffers(&diff, 0xBD);
+
+	if (diff.n)
+		oplhw_WriteBatch(dev, diff.writes, diff.n);
+}
@@ -0,0 +1,159 @@
+/*
+ * oplhw: ALSA hwdep-based library for OPL2-based soundcards.
+ *
+ * Copyright (C) 2023 by David Gow <david@davidgow.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "oplhw.h"
+#include "oplhw_internal.h"
+
+/* The latency histogram is log-linear: each power of two is split into
+ * 2^STATS_SUB_BITS buckets, so every bucket is within 12.5% of its value. */
+#define STATS_SUB_BITS 3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+
+static unsigned stats_Bucket(uint64_t ns)
+{
+	unsigned msb, bucket;
+
+	if (ns < STATS_SUB_BUCKETS)
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	bucket = (msb - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS + ((ns >> (msb - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1));
+	if (bucket >= OPLHW_LATENCY_BUCKETS)
+		bucket = OPLHW_LATENCY_BUCKETS - 1;
+	return bucket;
+}
+
+uint64_t oplhw_GetLatencyBucketStart(unsigned bucket)
+{
+	unsigned msb;
+
+	if (bucket < STATS_SUB_BUCKETS)
+		return bucket;
+
+	msb = bucket / STATS_SUB_BUCKETS + STATS_SUB_BITS - 1;
+	return (uint64_t)(STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS) << (msb - STATS_SUB_BITS);
+}
+
+uint64_t oplhw_GetLatencyPercentile(const oplhw_stats *stats, double fraction)
+{
+	uint64_t total = 0, seen = 0, target;
+	unsigned i;
+
+	for (i = 0; i < OPLHW_LATENCY_BUCKETS; ++i)
+		total += stats->latency[i];
+	if (!total)
+		return 0;
+
+	target = (uint64_t)(fraction * total);
+	for (i = 0; i < OPLHW_LATENCY_BUCKETS; ++i)
+	{
+		seen += stats->latency[i];
+		if (seen > target)
+			return oplhw_GetLatencyBucketStart(i);
+	}
+	return oplhw_GetLatencyBucketStart(OPLHW_LATENCY_BUCKETS - 1);
+}
+
+void oplhw_stats_IO(oplhw_device *dev, oplhw_io_kind kind, uint64_t start, bool ok, size_t bytes)
+{
+	uint64_t now = oplhw_time_Now();
+
+	if (kind == OPLHW_IO_DRAIN)
+	{
+		dev->stats.drain_ns += now - start;
+		dev->stats.drains++;
+	}
+	else
+		dev->stats.io_ns += now - start;
+
+	if (kind == OPLHW_IO_SYSCALL)
+		dev->stats.syscalls++;
+	else if (kind == OPLHW_IO_IOCTL)
+		dev->stats.ioctls++;
+	if (ok)
+		dev->stats.bytes_sent += bytes;
+	else
+		dev->stats.errors++;
+
+	if (__builtin_expect(dev->trace != NULL, 0))
+	{
+		uint16_t traced_bytes = (bytes > 0xffff) ? 0xffff : bytes;
+		oplhw_trace_Record(dev, OPLHW_TRACE_IO_BEGIN, start, traced_bytes, kind);
+		oplhw_trace_Record(dev, OPLHW_TRACE_IO_END, now, traced_bytes, kind);
+	}
+}
+
+void oplhw_stats_Write(oplhw_device *dev, uint64_t start, const oplhw_regwrite *writes, size_t n)
+{
+	uint64_t now = oplhw_time_Now();
+
+	/* With statistics off, we're only here for tracing. */
+	if (!dev->stats_off)
+	{
+		unsigned bucket = stats_Bucket(now - start);
+
+		if (dev->shared)
+		{
+			__atomic_fetch_add(&dev->stats.writes, n, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&dev->stats.latency[bucket], 1, __ATOMIC_RELAXED);
+		}
+		else
+		{
+			dev->stats.writes += n;
+			dev->stats.latency[bucket]++;
+		}
+	}
+
+	/* The beginning is recorded late, so that it's just one branch. */
+	if (__builtin_expect(dev->trace != NULL, 0))
+	{
+		if (n == 1)
+		{
+			oplhw_trace_Record(dev, OPLHW_TRACE_WRITE_BEGIN, start, writes->reg, writes->val);
+			oplhw_trace_Record(dev, OPLHW_TRACE_WRITE_END, now, writes->reg, writes->val);
+		}
+		else
+		{
+			uint16_t count = (n > 0xffff) ? 0xffff : n;
+			oplhw_trace_Record(dev, OPLHW_TRACE_BATCH_BEGIN, start, count, 0);
+			oplhw_trace_Record(dev, OPLHW_TRACE_BATCH_END, now, count, 0);
+		}
+	}
+}
+
+void oplhw_GetStats(oplhw_device *dev, oplhw_stats *stats)
+{
+	/* If another thread is writing, this might be a little out of date,
+	 * but that's fine for statistics. */
+	memcpy(stats, &dev->stats, sizeof(*stats));
+}
+
+bool oplhw_SetStatsEnabled(oplhw_device *dev, bool enabled)
+{
+	bool was_enabled = !dev->stats_off;
+	dev->stats_off = !enabled;
+	return was_enabled;
+}
+
+void oplhw_ResetStats(oplhw_device *dev)
+{
+	memset(&dev->stats, 0, sizeof(dev->stats));
+}
@@ -0,0 +1,320 @@
+/*
+ * oplhw: ALSA hwdep-based library for OPL2-based soundcards.
+ *
+ * Copyright (C) 2023 by David Gow <david@davidgow.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <sched.h>
+
+#include "oplhw.h"
+#include "oplhw_internal.h"
+
+/* Must be a power of two. */
+#define TS_QUEUE_LEN 4096
+#define TS_QUEUE_MASK (TS_QUEUE_LEN - 1)
+/* How many writes we copy out of the queue at once. */
+#define TS_BATCH_SIZE 64
+
+/* Each slot has a sequence number, which says whether it's free (seq ==
+ * position), or holds a published write (seq == position + 1). Groups of
+ * writes take up consecutive slots, and only the first slot is marked with
+ * the length: it's published last, so the group becomes visible all at once.
+ */
+typedef struct ts_slot
+{
+	size_t seq;
+	uint64_t deadline;
+	uint32_t group_len;
+	bool timed;
+	oplhw_regwrite write;
+} ts_slot;
+
+/* The thread-safe device lets any number of threads write at once. Writers
+ * reserve slots in a lock-free queue, then whichever thread gets the
+ * "combiner" flag sends everything published so far to the backing device.
+ * Nobody waits for the backing device unless the queue is full.
+ */
+typedef struct oplhw_ts_device
+{
+	oplhw_device dev;
+	oplhw_device *next;
+
+	/* Reserved by writers with compare-and-swap. */
+	size_t head;
+	uint8_t pad0[64];
+	/* Only touched by whoever holds the combiner flag. */
+	size_t tail;
+	int combining;
+	uint8_t pad1[64];
+
+	ts_slot ring[TS_QUEUE_LEN];
+} oplhw_ts_device;
+
+static bool ts_TryLock(oplhw_ts_device *dev)
+{
+	return !__atomic_exchange_n(&dev->combining, 1, __ATOMIC_SEQ_CST);
+}
+
+static void ts_Lock(oplhw_ts_device *dev)
+{
+	while (!ts_TryLock(dev))
+		sched_yield();
+}
+
+/* Whether the first group in the queue is ready to send. */
+static bool ts_Pending(oplhw_ts_device *dev)
+{
+	size_t tail = __atomic_load_n(&dev->tail, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&dev->ring[tail & TS_QUEUE_MASK].seq, __ATOMIC_SEQ_CST) == tail + 1;
+}
+
+static void ts_Send(oplhw_ts_device *dev, bool timed, uint64_t deadline, const oplhw_regwrite *writes, size_t n)
+{
+	if (timed)
+		oplhw_WriteBatchAt(dev->next, deadline, writes, n);
+	else
+		oplhw_WriteBatch(dev->next, writes, n);
+}
+
+/* Send every published group to the backing device, stopping at the first one
+ * which has been reserved but not yet published. Must hold the combiner flag. */
+static void ts_Drain(oplhw_ts_device *dev)
+{
+	oplhw_regwrite batch[TS_BATCH_SIZE];
+	size_t tail = dev->tail;
+
+	for (;;)
+	{
+		ts_slot *first = &dev->ring[tail & TS_QUEUE_MASK];
+		size_t len, i, count = 0;
+		uint64_t deadline;
+		bool timed;
+
+		if (__atomic_load_n(&first->seq, __ATOMIC_ACQUIRE) != tail + 1)
+			break;
+
+		/* The rest of the group was published before its first slot. */
+		len = first->group_len;
+		timed = first->timed;
+		deadline = first->deadline;
+		for (i = 0; i < len; ++i)
+		{
+			ts_slot *slot = &dev->ring[(tail + i) & TS_QUEUE_MASK];
+			batch[count++] = slot->write;
+			if (count == TS_BATCH_SIZE)
+			{
+				ts_Send(dev, timed, deadline, batch, count);
+				count = 0;
+			}
+		}
+		if (count)
+			ts_Send(dev, timed, deadline, batch, count);
+
+		/* Hand the slots back to the writers. */
+		for (i = 0; i < len; ++i)
+			__atomic_store_n(&dev->ring[(tail + i) & TS_QUEUE_MASK].seq, tail + i + TS_QUEUE_LEN, __ATOMIC_RELEASE);
+		tail += len;
+		__atomic_store_n(&dev->tail, tail, __ATOMIC_SEQ_CST);
+	}
+}
+
+/* Give up the combiner flag. Anything published while we held it is sent by
+ * whoever picks it up next, which might be us again. */
+static void ts_Unlock(oplhw_ts_device *dev)
+{
+	for (;;)
+	{
+		__atomic_store_n(&dev->combining, 0, __ATOMIC_SEQ_CST);
+		/* A writer who couldn't get the flag is relying on us to check
+		 * for its writes after we've dropped it. */
+		if (!ts_Pending(dev) || !ts_TryLock(dev))
+			return;
+		ts_Drain(dev);
+	}
+}
+
+/* Send any published writes, unless another thread is already doing so. */
+static void ts_Combine(oplhw_ts_device *dev)
+{
+	if (ts_TryLock(dev))
+	{
+		ts_Drain(dev);
+		ts_Unlock(dev);
+	}
+}
+
+/* Send writes straight to the backing device if nothing is queued before them.
+ * Returns false if they need to go through the queue. */
+static bool ts_TryDirect(oplhw_ts_device *dev, bool timed, uint64_t deadline, const oplhw_regwrite *writes, size_t n, bool wait)
+{
+	bool sent = false;
+
+	if (wait)
+		ts_Lock(dev);
+	else if (!ts_TryLock(dev))
+		return false;
+
+	ts_Drain(dev);
+	/* If another writer has reserved slots which it hasn't published yet,
+	 * those might be ahead of some of our own earlier writes, so we have to
+	 * queue behind them. */
+	if (__atomic_load_n(&dev->head, __ATOMIC_SEQ_CST) == dev->tail)
+	{
+		ts_Send(dev, timed, deadline, writes, n);
+		sent = true;
+	}
+	ts_Unlock(dev);
+	return sent;
+}
+
+static void ts_Submit(oplhw_ts_device *dev, bool timed, uint64_t deadline, const oplhw_regwrite *writes, size_t n)
+{
+	size_t pos, i;
+
+	if (!n)
+		return;
+
+	/* If the device is idle, skip the queue altogether. */
+	if (ts_TryDirect(dev, timed, deadline, writes, n, false))
+		return;
+
+	/* A group which will never fit in the queue has to wait until the queue
+	 * is empty, and be written directly. */
+	if (n > TS_QUEUE_LEN)
+	{
+		while (!ts_TryDirect(dev, timed, deadline, writes, n, true))
+			sched_yield();
+		return;
+	}
+
+	/* Reserve n slots. They're freed in order, so if the last is free,
+	 * they all are. */
+	pos = __atomic_load_n(&dev->head, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		size_t last = pos + n - 1;
+		size_t seq = __atomic_load_n(&dev->ring[last & TS_QUEUE_MASK].seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)(seq - last);
+
+		if (!diff)
+		{
+			if (__atomic_compare_exchange_n(&dev->head, &pos, pos + n, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+			continue;
+		}
+		if (diff < 0)
+		{
+			/* The queue is full: help empty it. */
+			ts_Combine(dev);
+			sched_yield();
+		}
+		pos = __atomic_load_n(&dev->head, __ATOMIC_RELAXED);
+	}
+
+	/* Fill in the group, publishing the first slot last. */
+	for (i = n; i-- > 0;)
+	{
+		ts_slot *slot = &dev->ring[(pos + i) & TS_QUEUE_MASK];
+		slot->write = writes[i];
+		if (i)
+		{
+			__atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		slot->group_len = n;
+		slot->timed = timed;
+		slot->deadline = deadline;
+		__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+	}
+	OPLHW_TRACE(&dev->dev, OPLHW_TRACE_ENQUEUE, n, 0);
+
+	ts_Combine(dev);
+}
+
+void oplhw_ts_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
+{
+	oplhw_regwrite write;
+	write.reg = reg;
+	write.val = val;
+	ts_Submit((oplhw_ts_device *)dev, false, 0, &write, 1);
+}
+
+void oplhw_ts_WriteBatch(oplhw_device *dev, const oplhw_regwrite *writes, size_t n)
+{
+	ts_Submit((oplhw_ts_device *)dev, false, 0, writes, n);
+}
+
+void oplhw_ts_WriteAt(oplhw_device *dev, uint64_t deadline, const oplhw_regwrite *writes, size_t n)
+{
+	ts_Submit((oplhw_ts_device *)dev, true, deadline, writes, n);
+}
+
+void oplhw_ts_Flush(oplhw_device *dev)
+{
+	oplhw_ts_device *ts_dev = (oplhw_ts_device *)dev;
+
+	ts_Lock(ts_dev);
+	ts_Drain(ts_dev);
+	oplhw_Flush(ts_dev->next);
+	ts_Unlock(ts_dev);
+}
+
+bool oplhw_ts_SetBuffering(oplhw_device *dev, bool enabled)
+{
+	oplhw_ts_device *ts_dev = (oplhw_ts_device *)dev;
+	bool was_buffered;
+
+	ts_Lock(ts_dev);
+	ts_Drain(ts_dev);
+	was_buffered = oplhw_SetBuffering(ts_dev->next, enabled);
+	ts_Unlock(ts_dev);
+	return was_buffered;
+}
+
+void oplhw_ts_CloseDevice(oplhw_device *dev)
+{
+	oplhw_ts_device *ts_dev = (oplhw_ts_device *)dev;
+
+	/* Nobody should be writing any more, so everything has been published. */
+	ts_Lock(ts_dev);
+	ts_Drain(ts_dev);
+
+	oplhw_CloseDevice(ts_dev->next);
+	free(ts_dev);
+}
+
+oplhw_device *oplhw_CreateThreadSafeDevice(oplhw_device *backing_dev)
+{
+	oplhw_ts_device *dev = calloc(1, sizeof(*dev));
+	size_t i;
+
+	dev->dev.close = &oplhw_ts_CloseDevice;
+	dev->dev.write = &oplhw_ts_Write;
+	dev->dev.write_batch = &oplhw_ts_WriteBatch;
+	dev->dev.write_at = &oplhw_ts_WriteAt;
+	dev->dev.flush = &oplhw_ts_Flush;
+	dev->dev.set_buffering = &oplhw_ts_SetBuffering;
+	dev->dev.isOPL3 = backing_dev->isOPL3;
+	dev->dev.shared = true;
+	dev->next = backing_dev;
+
+	for (i = 0; i < TS_QUEUE_LEN; ++i)
+		dev->ring[i].seq = i;
+
+	return (oplhw_device *)dev;
+}
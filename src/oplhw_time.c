@@ -0,0 +1,97 @@
+/*
+ * oplhw: ALSA hwdep-based library for OPL2-based soundcards.
+ *
+ * Copyright (C) 2023 by David Gow <david@davidgow.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "oplhw.h"
+#include "oplhw_internal.h"
+
+#define TIME_CALIBRATION_SLEEPS 8
+#define TIME_CALIBRATION_SLEEP_NS (50 * OPLHW_NS_PER_USEC)
+#define TIME_MAX_SLACK_NS (500 * OPLHW_NS_PER_USEC)
+
+uint64_t oplhw_time_Now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * OPLHW_NS_PER_SEC + ts.tv_nsec;
+}
+
+/* How early to wake up from clock_nanosleep(), and spin for the rest. */
+static uint64_t time_sleep_slack;
+static pthread_once_t time_calibrate_once = PTHREAD_ONCE_INIT;
+
+static void time_SleepAbs(uint64_t deadline)
+{
+	struct timespec ts;
+	ts.tv_sec = deadline / OPLHW_NS_PER_SEC;
+	ts.tv_nsec = deadline % OPLHW_NS_PER_SEC;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/* Work out how late clock_nanosleep() tends to wake us up. */
+static void time_Calibrate(void)
+{
+	uint64_t worst = 0;
+	int i;
+
+	for (i = 0; i < TIME_CALIBRATION_SLEEPS; ++i)
+	{
+		uint64_t deadline = oplhw_time_Now() + TIME_CALIBRATION_SLEEP_NS;
+		uint64_t late;
+		time_SleepAbs(deadline);
+		late = oplhw_time_Now() - deadline;
+		if (late > worst)
+			worst = late;
+	}
+
+	/* Leave some margin, but don't spin for too long if the system was
+	 * just busy while we were measuring. */
+	time_sleep_slack = worst + worst / 2;
+	if (time_sleep_slack > TIME_MAX_SLACK_NS)
+		time_sleep_slack = TIME_MAX_SLACK_NS;
+}
+
+void oplhw_time_SpinUntil(uint64_t deadline)
+{
+	while (oplhw_time_Now() < deadline)
+	{
+#if defined(__i386__) || defined(__x86_64__)
+		__builtin_ia32_pause();
+#endif
+	}
+}
+
+void oplhw_time_SleepUntil(uint64_t deadline)
+{
+	pthread_once(&time_calibrate_once, time_Calibrate);
+
+	if (deadline > oplhw_time_Now() + time_sleep_slack)
+		time_SleepAbs(deadline - time_sleep_slack);
+
+	oplhw_time_SpinUntil(deadline);
+}
+
+uint64_t oplhw_GetTime(void)
+{
+	return oplhw_time_Now();
+}
@@ -0,0 +1,197 @@
+/*
+ * oplhw: ALSA hwdep-based library for OPL2-based soundcards.
+ *
+ * Copyright (C) 2023 by David Gow <david@davidgow.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "oplhw.h"
+#include "oplhw_internal.h"
+
+/* The most devices which can share a trace. */
+#define TRACE_MAX_TRACKS 64
+#define TRACE_NAME_LEN 32
+
+typedef struct trace_record
+{
+	uint64_t time;
+	uint16_t track;
+	uint16_t reg;
+	uint8_t val;
+	uint8_t phase;
+} trace_record;
+
+/* The trace is a ring of fixed-size records. Writers claim a record with an
+ * atomic increment, so any number of devices and threads can share one, and
+ * the oldest records are overwritten once it's full. */
+struct oplhw_trace
+{
+	size_t head;
+	size_t mask;
+	trace_record *records;
+
+	unsigned num_tracks;
+	char track_names[TRACE_MAX_TRACKS][TRACE_NAME_LEN];
+};
+
+void oplhw_trace_Record(oplhw_device *dev, oplhw_trace_phase phase, uint64_t time, uint16_t reg, uint8_t val)
+{
+	oplhw_trace *trace = dev->trace;
+	size_t pos = __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+	trace_record *record = &trace->records[pos & trace->mask];
+
+	record->time = time;
+	record->track = dev->trace_track;
+	record->reg = reg;
+	record->val = val;
+	record->phase = phase;
+}
+
+oplhw_trace *oplhw_CreateTrace(size_t num_records)
+{
+	oplhw_trace *trace;
+	size_t len = 1;
+
+	if (!num_records)
+		return NULL;
+	while (len < num_records)
+		len *= 2;
+
+	trace = calloc(1, sizeof(*trace));
+	trace->records = calloc(len, sizeof(trace_record));
+	trace->mask = len - 1;
+	return trace;
+}
+
+void oplhw_DestroyTrace(oplhw_trace *trace)
+{
+	free(trace->records);
+	free(trace);
+}
+
+void oplhw_SetTrace(oplhw_device *dev, oplhw_trace *trace, const char *name)
+{
+	unsigned track;
+
+	if (!trace)
+	{
+		dev->trace = NULL;
+		return;
+	}
+
+	track = __atomic_fetch_add(&trace->num_tracks, 1, __ATOMIC_RELAXED);
+	if (track >= TRACE_MAX_TRACKS)
+		track = TRACE_MAX_TRACKS - 1;
+	else
+	{
+		strncpy(trace->track_names[track], name ? name : "", TRACE_NAME_LEN - 1);
+		trace->track_names[track][TRACE_NAME_LEN - 1] = '\0';
+	}
+
+	dev->trace_track = track;
+	dev->trace = trace;
+}
+
+static void trace_WriteString(FILE *out, const char *str)
+{
+	fputc('"', out);
+	for (; *str; ++str)
+	{
+		if (*str == '"' || *str == '\\')
+			fprintf(out, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(out, "\\u%04x", *str);
+		else
+			fputc(*str, out);
+	}
+	fputc('"', out);
+}
+
+static void trace_WriteRecord(FILE *out, const trace_record *record)
+{
+	static const char *const names[] = {
+		"write", "write", "batch", "batch", "pace", "pace", "io", "io", "enqueue"
+	};
+	static const char *const io_kinds[] = { "port", "syscall", "ioctl", "drain" };
+	static const char phases[] = { 'B', 'E', 'B', 'E', 'B', 'E', 'B', 'E', 'i' };
+
+	if (record->phase > OPLHW_TRACE_ENQUEUE)
+		return;
+
+	/* Timestamps are in microseconds. */
+	fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":1,\"tid\":%u",
+	        names[record->phase], phases[record->phase],
+	        (unsigned long long)(record->time / OPLHW_NS_PER_USEC),
+	        (unsigned)(record->time % OPLHW_NS_PER_USEC), record->track);
+
+	switch (record->phase)
+	{
+	case OPLHW_TRACE_WRITE_BEGIN:
+		fprintf(out, ",\"args\":{\"reg\":\"0x%03x\",\"val\":\"0x%02x\"}", record->reg, record->val);
+		break;
+	case OPLHW_TRACE_BATCH_BEGIN:
+		fprintf(out, ",\"args\":{\"writes\":%u}", record->reg);
+		break;
+	case OPLHW_TRACE_IO_BEGIN:
+		fprintf(out, ",\"args\":{\"bytes\":%u,\"kind\":\"%s\"}", record->reg,
+		        record->val <= OPLHW_IO_DRAIN ? io_kinds[record->val] : "?");
+		break;
+	case OPLHW_TRACE_ENQUEUE:
+		fprintf(out, ",\"s\":\"t\",\"args\":{\"writes\":%u}", record->reg);
+		break;
+	default:
+		break;
+	}
+	fputc('}', out);
+}
+
+bool oplhw_DumpTrace(oplhw_trace *trace, const char *path)
+{
+	FILE *out = fopen(path, "w");
+	size_t head, pos, num_tracks, i;
+	bool ok;
+
+	if (!out)
+		return false;
+
+	head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+	num_tracks = __atomic_load_n(&trace->num_tracks, __ATOMIC_RELAXED);
+	if (num_tracks > TRACE_MAX_TRACKS)
+		num_tracks = TRACE_MAX_TRACKS;
+
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"oplhw\"}}");
+	for (i = 0; i < num_tracks; ++i)
+	{
+		fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", (unsigned)i);
+		trace_WriteString(out, trace->track_names[i]);
+		fprintf(out, "}}");
+	}
+
+	/* Oldest first. */
+	pos = (head > trace->mask + 1) ? head - (trace->mask + 1) : 0;
+	for (; pos < head; ++pos)
+		trace_WriteRecord(out, &trace->records[pos & trace->mask]);
+
+	fprintf(out, "\n]}\n");
+	ok = !ferror(out);
+	if (fclose(out))
+		ok = false;
+	return ok;
+}
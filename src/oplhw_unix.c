@@ -0,0 +1,349 @@
+/*
+ * oplhw: ALSA hwdep-based library for OPL2-based soundcards.
+ *
+ * Copyright (C) 2023 by David Gow <david@davidgow.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* The "unix:" backend: a client for oplhwd. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "oplhw.h"
+#include "oplhw_internal.h"
+#include "oplhw_unix.h"
+
+/* Completed messages are kept here until they're sent. */
+#define UNIX_OUT_BUFFER_LEN (4 * OPLHWD_MAX_MSG_LEN)
+
+typedef struct oplhw_unix_device
+{
+	oplhw_device dev;
+	int fd;
+	bool buffered;
+
+	/* The message we're currently adding writes to. */
+	size_t num_pending;
+	bool pending_timed;
+	uint64_t pending_deadline;
+	oplhw_regwrite pending[OPLHWD_MAX_WRITES];
+
+	size_t out_len;
+	uint8_t out[UNIX_OUT_BUFFER_LEN];
+} oplhw_unix_device;
+
+static bool unix_SendAll(oplhw_unix_device *dev, const uint8_t *data, size_t len)
+{
+	while (len)
+	{
+		uint64_t start = oplhw_time_Now();
+		ssize_t sent = send(dev->fd, data, len, MSG_NOSIGNAL);
+		oplhw_stats_IO(&dev->dev, OPLHW_IO_SYSCALL, start, sent >= 0, sent > 0 ? sent : 0);
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += sent;
+		len -= sent;
+	}
+	return true;
+}
+
+static bool unix_RecvAll(oplhw_unix_device *dev, uint8_t *data, size_t len)
+{
+	while (len)
+	{
+		uint64_t start = oplhw_time_Now();
+		ssize_t received = recv(dev->fd, data, len, 0);
+		oplhw_stats_IO(&dev->dev, OPLHW_IO_SYSCALL, start, received > 0, 0);
+		if (received < 0 && errno == EINTR)
+			continue;
+		if (received <= 0)
+			return false;
+		data += received;
+		len -= received;
+	}
+	return true;
+}
+
+static void unix_SendOut(oplhw_unix_device *dev)
+{
+	if (!dev->out_len)
+		return;
+	if (!unix_SendAll(dev, dev->out, dev->out_len))
+		fprintf(stderr, "Lost connection to oplhwd: %s\n", strerror(errno));
+	dev->out_len = 0;
+}
+
+static void unix_AppendHeader(oplhw_unix_device *dev, uint8_t type, uint8_t flags, uint16_t count)
+{
+	uint8_t *out;
+
+	/* Leave room for a short payload, too. */
+	if (dev->out_len + OPLHWD_HEADER_LEN + 8 > UNIX_OUT_BUFFER_LEN)
+		unix_SendOut(dev);
+
+	out = &dev->out[dev->out_len];
+	out[0] = type;
+	out[1] = flags;
+	out[2] = count & 0xff;
+	out[3] = count >> 8;
+	dev->out_len += OPLHWD_HEADER_LEN;
+}
+
+/* Turn the pending writes into a message in the output buffer. */
+static void unix_EndMessage(oplhw_unix_device *dev)
+{
+	size_t count = dev->num_pending;
+	size_t bitmap_len = (count + 7) / 8;
+	uint8_t *out;
+	size_t i;
+
+	if (!count)
+		return;
+
+	if (dev->out_len + OPLHWD_MAX_MSG_LEN > UNIX_OUT_BUFFER_LEN)
+		unix_SendOut(dev);
+
+	unix_AppendHeader(dev, OPLHWD_MSG_WRITES, dev->pending_timed ? OPLHWD_WRITES_TIMED : 0, count);
+	out = &dev->out[dev->out_len];
+
+	if (dev->pending_timed)
+	{
+		for (i = 0; i < 8; ++i)
+			*out++ = (dev->pending_deadline >> (i * 8)) & 0xff;
+	}
+
+	memset(out + count * 2, 0, bitmap_len);
+	for (i = 0; i < count; ++i)
+	{
+		out[i * 2] = dev->pending[i].reg & 0xff;
+		out[i * 2 + 1] = dev->pending[i].val;
+		if (dev->pending[i].reg & 0x100)
+			out[count * 2 + i / 8] |= 1 << (i % 8);
+	}
+	out += count * 2 + bitmap_len;
+
+	dev->out_len = out - dev->out;
+	dev->num_pending = 0;
+}
+
+/* Send everything, including the message we're working on. */
+static void unix_Send(oplhw_unix_device *dev)
+{
+	unix_EndMessage(dev);
+	unix_SendOut(dev);
+}
+
+/* Add writes to the pending message, starting a new one if the timing differs. */
+static void unix_Queue(oplhw_unix_device *dev, bool timed, uint64_t deadline, const oplhw_regwrite *writes, size_t n)
+{
+	if (dev->num_pending && (dev->pending_timed != timed || (timed && dev->pending_deadline != deadline)))
+		unix_EndMessage(dev);
+
+	dev->pending_timed = timed;
+	dev->pending_deadline = deadline;
+
+	while (n)
+	{
+		size_t count = OPLHWD_MAX_WRITES - dev->num_pending;
+		if (count > n)
+			count = n;
+		memcpy(&dev->pending[dev->num_pending], writes, count * sizeof(oplhw_regwrite));
+		dev->num_pending += count;
+		writes += count;
+		n -= count;
+		if (dev->num_pending == OPLHWD_MAX_WRITES)
+			unix_EndMessage(dev);
+	}
+}
+
+/* Wait until the daemon has dealt with everything we've sent. */
+static void unix_Sync(oplhw_unix_device *dev)
+{
+	uint8_t ack;
+
+	unix_EndMessage(dev);
+	unix_AppendHeader(dev, OPLHWD_MSG_SYNC, 0, 0);
+	unix_SendOut(dev);
+	if (!unix_RecvAll(dev, &ack, 1) || ack != OPLHWD_SYNC_ACK)
+		fprintf(stderr, "Lost connection to oplhwd.\n");
+}
+
+void oplhw_unix_Write(oplhw_device *dev, uint16_t reg, uint8_t val)
+{
+	oplhw_unix_device *unix_dev = (oplhw_unix_device *)dev;
+	oplhw_regwrite write;
+
+	write.reg = reg;
+	write.val = val;
+	unix_Queue(unix_dev, false, 0, &write, 1);
+	if (!unix_dev->buffered)
+		unix_Send(unix_dev);
+}
+
+void oplhw_unix_WriteBatch(oplhw_device *dev, const oplhw_regwrite *writes, size_t n)
+{
+	oplhw_unix_device *unix_dev = (oplhw_unix_device *)dev;
+	unix_Queue(unix_dev, false, 0, writes, n);
+	unix_Send(unix_dev);
+}
+
+void oplhw_unix_WriteAt(oplhw_device *dev, uint64_t deadline, const oplhw_regwrite *writes, size_t n)
+{
+	oplhw_unix_device *unix_dev = (oplhw_unix_device *)dev;
+
+	/* The daemon does the waiting, so timed writes can be buffered, too. */
+	unix_Queue(unix_dev, true, deadline, writes, n);
+	if (!unix_dev->buffered)
+		unix_Send(unix_dev);
+}
+
+void oplhw_unix_Flush(oplhw_device *dev)
+{
+	unix_Sync((oplhw_unix_device *)dev);
+}
+
+bool oplhw_unix_SetBuffering(oplhw_device *dev, bool enabled)
+{
+	oplhw_unix_device *unix_dev = (oplhw_unix_device *)dev;
+	bool was_buffered = unix_dev->buffered;
+
+	if (!enabled)
+		unix_Send(unix_dev);
+	unix_dev->buffered = enabled;
+	return was_buffered;
+}
+
+void oplhw_unix_CloseDevice(oplhw_device *dev)
+{
+	oplhw_unix_device *unix_dev = (oplhw_unix_device *)dev;
+
+	unix_Send(unix_dev);
+	close(unix_dev->fd);
+	free(unix_dev);
+}
+
+oplhw_device *oplhw_unix_OpenDevice(const char *dev_name)
+{
+	oplhw_unix_device *dev;
+	struct sockaddr_un addr;
+	uint8_t hello[OPLHWD_HELLO_LEN];
+	int fd;
+
+	if (!*dev_name)
+		dev_name = OPLHWD_DEFAULT_SOCKET;
+
+	if (strlen(dev_name) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "Socket path \"%s\" is too long.\n", dev_name);
+		return NULL;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, dev_name);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		return NULL;
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+	{
+		fprintf(stderr, "Couldn't connect to oplhwd at \"%s\": %s\n", dev_name, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	dev = calloc(1, sizeof(*dev));
+	dev->fd = fd;
+
+	if (!unix_RecvAll(dev, hello, OPLHWD_HELLO_LEN) ||
+	    memcmp(hello, OPLHWD_MAGIC, 4) || hello[4] != OPLHWD_VERSION)
+	{
+		fprintf(stderr, "\"%s\" isn't a compatible oplhwd.\n", dev_name);
+		close(fd);
+		free(dev);
+		return NULL;
+	}
+
+	dev->dev.close = &oplhw_unix_CloseDevice;
+	dev->dev.write = &oplhw_unix_Write;
+	dev->dev.write_batch = &oplhw_unix_WriteBatch;
+	dev->dev.write_at = &oplhw_unix_WriteAt;
+	dev->dev.flush = &oplhw_unix_Flush;
+	dev->dev.set_buffering = &oplhw_unix_SetBuffering;
+	dev->dev.isOPL3 = hello[5] & OPLHWD_HELLO_OPL3;
+
+	return (oplhw_device *)dev;
+}
+
+size_t oplhw_unix_Enumerate(oplhw_device_info *devices, size_t max)
+{
+	struct stat st;
+	oplhw_device *dev;
+
+	/* Don't complain about not being able to connect if there's obviously
+	 * no daemon there. */
+	if (!max || stat(OPLHWD_DEFAULT_SOCKET, &st) || !S_ISSOCK(st.st_mode))
+		return 0;
+
+	dev = oplhw_unix_OpenDevice("");
+	if (!dev)
+		return 0;
+
+	memset(&devices[0], 0, sizeof(devices[0]));
+	strcpy(devices[0].uri, "unix:");
+	snprintf(devices[0].description, sizeof(devices[0].description), "oplhwd at %s", OPLHWD_DEFAULT_SOCKET);
+	devices[0].backend = OPLHW_BACKEND_UNIX;
+	devices[0].isOPL3 = dev->isOPL3;
+	oplhw_unix_CloseDevice(dev);
+
+	return 1;
+}
+
+uint32_t oplhw_ReserveChannels(oplhw_device *unix_dev, uint32_t channels)
+{
+	oplhw_unix_device *dev = (oplhw_unix_device *)unix_dev;
+	uint8_t reply[4];
+	int i;
+
+	/* Only oplhwd can reserve channels. */
+	if (unix_dev->close != &oplhw_unix_CloseDevice)
+		return 0;
+
+	unix_EndMessage(dev);
+	unix_AppendHeader(dev, OPLHWD_MSG_RESERVE, 0, 0);
+	for (i = 0; i < 4; ++i)
+		dev->out[dev->out_len++] = (channels >> (i * 8)) & 0xff;
+	unix_SendOut(dev);
+
+	if (!unix_RecvAll(dev, reply, 4))
+	{
+		fprintf(stderr, "Lost connection to oplhwd.\n");
+		return 0;
+	}
+	return reply[0] | (reply[1] << 8) | (reply[2] << 16) | ((uint32_t)reply[3] << 24);
+}
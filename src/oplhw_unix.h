@@ -0,0 +1,65 @@
+/*
+ * oplhw: ALSA hwdep-based library for OPL2-based soundcards.
+ *
+ * Copyright (C) 2023 by David Gow <david@davidgow.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* The protocol spoken between oplhwd and the "unix:" backend.
+ *
+ * When a client connects, the daemon sends a hello: the magic "OPLd", a
+ * version byte, a flags byte (OPLHWD_HELLO_OPL3), and two zero bytes.
+ *
+ * After that, the client sends messages, each starting with a 4-byte header:
+ * the message type, a flags byte, and a little-endian 16-bit count.
+ *
+ * OPLHWD_MSG_WRITES: count register writes. If OPLHWD_WRITES_TIMED is set, a
+ *	little-endian 64-bit CLOCK_MONOTONIC deadline (in ns) comes first. Then
+ *	there are count (register, value) byte pairs, followed by a bitmap of
+ *	which of them are to bank 1, (count + 7) / 8 bytes long.
+ * OPLHWD_MSG_SYNC: the daemon replies with a single OPLHWD_SYNC_ACK byte once
+ *	everything before it has been handed to the device.
+ * OPLHWD_MSG_RESERVE: followed by a little-endian 32-bit mask of channels
+ *	(bank 1 channels are 9-17) the client wants to itself. Other clients'
+ *	writes to them are dropped. The daemon replies with the 32-bit mask of
+ *	channels the client now has; channels other clients have are left out.
+ */
+
+#ifndef OPLHW_UNIX_H
+#define OPLHW_UNIX_H
+
+#define OPLHWD_DEFAULT_SOCKET "/tmp/oplhwd.sock"
+
+#define OPLHWD_MAGIC "OPLd"
+#define OPLHWD_VERSION 1
+#define OPLHWD_HELLO_LEN 8
+#define OPLHWD_HELLO_OPL3 0x01
+
+#define OPLHWD_HEADER_LEN 4
+
+#define OPLHWD_MSG_WRITES 0x01
+#define OPLHWD_MSG_SYNC 0x02
+#define OPLHWD_MSG_RESERVE 0x03
+
+#define OPLHWD_WRITES_TIMED 0x01
+
+#define OPLHWD_SYNC_ACK 0x06
+
+/* The most writes in a single message. */
+#define OPLHWD_MAX_WRITES 1024
+/* The longest possible message. */
+#define OPLHWD_MAX_MSG_LEN (OPLHWD_HEADER_LEN + 8 + OPLHWD_MAX_WRITES * 2 + OPLHWD_MAX_WRITES / 8)
+
+#define OPLHWD_NUM_CHANNELS 18
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ * oplhw: ALSA hwdep-based library for OPL2-based soundcards.
+ *
+ * Copyright (C) 2023 by David Gow <david@davidgow.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Renders a single note from the emulator for each of a few attack rates,
+ * with and without key scale rate, and checks that each one is audible.
+ * Key scaling can push AR 12-14 up to rate 15, which attacks instantly. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "oplhw.h"
+
+#define RENDER_FRAMES 4096
+
+static double render_note(uint8_t ar, bool ksr, uint8_t block)
+{
+	static int16_t buffer[RENDER_FRAMES * 2];
+	oplhw_device *dev = oplhw_OpenDevice("emu:");
+	double sum = 0;
+	size_t i;
+
+	if (!dev)
+		return -1;
+
+	/* Modulator silent, carrier at full volume, channel 0. */
+	oplhw_Write(dev, 0x20, 0x01);
+	oplhw_Write(dev, 0x23, (ksr ? 0x10 : 0x00) | 0x21);
+	oplhw_Write(dev, 0x40, 0x3f);
+	oplhw_Write(dev, 0x43, 0x00);
+	oplhw_Write(dev, 0x60, 0xff);
+	oplhw_Write(dev, 0x63, ar << 4);
+	oplhw_Write(dev, 0x80, 0x0f);
+	oplhw_Write(dev, 0x83, 0x0f);
+	oplhw_Write(dev, 0xc0, 0x31);
+	oplhw_Write(dev, 0xa0, 0x41);
+	oplhw_Write(dev, 0xb0, 0x20 | (block << 2) | 0x01);
+
+	if (oplhw_EmuRender(dev, buffer, RENDER_FRAMES) != RENDER_FRAMES)
+	{
+		oplhw_CloseDevice(dev);
+		return -1;
+	}
+	for (i = 0; i < RENDER_FRAMES * 2; ++i)
+		sum += abs(buffer[i]);
+
+	oplhw_CloseDevice(dev);
+	return sum / (RENDER_FRAMES * 2);
+}
+
+int main(void)
+{
+	static const uint8_t blocks[] = {0, 4, 7};
+	int failures = 0;
+	uint8_t ar;
+	size_t b;
+	int ksr;
+
+	for (ar = 8; ar <= 15; ++ar)
+	{
+		for (ksr = 0; ksr <= 1; ++ksr)
+		{
+			for (b = 0; b < sizeof(blocks); ++b)
+			{
+				double level = render_note(ar, ksr, blocks[b]);
+				if (level < 100)
+				{
+					fprintf(stderr, "AR %d, KSR %d, block %d: mean level %f\n",
+						ar, ksr, blocks[b], level);
+					++failures;
+				}
+			}
+		}
+	}
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
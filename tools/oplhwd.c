@@ -0,0 +1,393 @@
+/*
+ * oplhw: ALSA hwdep-based library for OPL2-based soundcards.
+ *
+ * Copyright (C) 2023 by David Gow <david@davidgow.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* oplhwd: shares one OPL device between several processes, which connect to
+ * it with the "unix:" device. Writes from all of the clients go through a
+ * scheduler device, so timed writes are merged in order. */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "oplhw.h"
+#include "oplhw_unix.h"
+
+#define MAX_CLIENTS 32
+/* Big enough for a whole message, plus whatever came after it. */
+#define CLIENT_BUFFER_LEN (4 * OPLHWD_MAX_MSG_LEN)
+
+typedef struct client
+{
+	int fd;
+	size_t in_len;
+	uint8_t in[CLIENT_BUFFER_LEN];
+} client;
+
+static oplhw_device *dev;
+static client *clients[MAX_CLIENTS];
+/* Which client has reserved each channel, or -1. */
+static int channel_owner[OPLHWD_NUM_CHANNELS];
+static volatile sig_atomic_t quit = 0;
+
+static void handle_signal(int sig)
+{
+	(void)sig;
+	quit = 1;
+}
+
+/* Get the channel a register belongs to, or -1 if it's not channel-specific. */
+static int reg_channel(uint16_t reg)
+{
+	int bank = (reg & 0x100) ? 9 : 0;
+	int low = reg & 0xff;
+	int slot;
+
+	if ((low >= 0xa0 && low <= 0xa8) || (low >= 0xb0 && low <= 0xb8) || (low >= 0xc0 && low <= 0xc8))
+		return bank + (low & 0x0f);
+
+	if ((low >= 0x20 && low < 0xa0) || low >= 0xe0)
+	{
+		slot = low & 0x1f;
+		if (slot >= 0x16 || (slot & 7) >= 6)
+			return -1;
+		return bank + (slot >> 3) * 3 + (slot & 7) % 3;
+	}
+
+	return -1;
+}
+
+static bool send_all(int fd, const uint8_t *data, size_t len)
+{
+	while (len)
+	{
+		ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += sent;
+		len -= sent;
+	}
+	return true;
+}
+
+static void drop_client(int index)
+{
+	oplhw_regwrite key_off;
+	int i;
+
+	/* Don't leave notes hanging on channels nobody else can use. */
+	for (i = 0; i < OPLHWD_NUM_CHANNELS; ++i)
+	{
+		if (channel_owner[i] != index)
+			continue;
+		channel_owner[i] = -1;
+		key_off.reg = (i < 9) ? (0xb0 + i) : (0x1b0 + i - 9);
+		key_off.val = 0;
+		oplhw_WriteBatch(dev, &key_off, 1);
+	}
+
+	close(clients[index]->fd);
+	free(clients[index]);
+	clients[index] = NULL;
+}
+
+static uint32_t reserve_channels(int index, uint32_t wanted)
+{
+	uint32_t granted = 0;
+	int i;
+
+	for (i = 0; i < OPLHWD_NUM_CHANNELS; ++i)
+	{
+		bool want = (wanted >> i) & 1;
+		if (channel_owner[i] == index && !want)
+			channel_owner[i] = -1;
+		else if (channel_owner[i] == -1 && want)
+			channel_owner[i] = index;
+		if (channel_owner[i] == index)
+			granted |= 1u << i;
+	}
+	return granted;
+}
+
+/* Handle one message. Returns its length, 0 if it's incomplete, or -1 if the
+ * client is talking nonsense. */
+static long handle_message(int index, const uint8_t *msg, size_t len)
+{
+	oplhw_regwrite writes[OPLHWD_MAX_WRITES];
+	const uint8_t *pairs, *bitmap;
+	size_t count, msg_len, num_writes = 0, i;
+	uint64_t deadline = 0;
+	uint8_t reply[4];
+
+	if (len < OPLHWD_HEADER_LEN)
+		return 0;
+	count = msg[2] | (msg[3] << 8);
+
+	switch (msg[0])
+	{
+	case OPLHWD_MSG_WRITES:
+		if (count > OPLHWD_MAX_WRITES)
+			return -1;
+		pairs = msg + OPLHWD_HEADER_LEN;
+		if (msg[1] & OPLHWD_WRITES_TIMED)
+			pairs += 8;
+		bitmap = pairs + count * 2;
+		msg_len = (bitmap - msg) + (count + 7) / 8;
+		if (len < msg_len)
+			return 0;
+
+		if (msg[1] & OPLHWD_WRITES_TIMED)
+		{
+			for (i = 0; i < 8; ++i)
+				deadline |= (uint64_t)msg[OPLHWD_HEADER_LEN + i] << (i * 8);
+		}
+
+		for (i = 0; i < count; ++i)
+		{
+			uint16_t reg = pairs[i * 2];
+			int channel;
+
+			if (bitmap[i / 8] & (1 << (i % 8)))
+				reg |= 0x100;
+			/* Leave other clients' channels alone. */
+			channel = reg_channel(reg);
+			if (channel != -1 && channel_owner[channel] != -1 && channel_owner[channel] != index)
+				continue;
+			writes[num_writes].reg = reg;
+			writes[num_writes].val = pairs[i * 2 + 1];
+			num_writes++;
+		}
+
+		if (msg[1] & OPLHWD_WRITES_TIMED)
+			oplhw_WriteBatchAt(dev, deadline, writes, num_writes);
+		else
+			oplhw_WriteBatch(dev, writes, num_writes);
+		return msg_len;
+
+	case OPLHWD_MSG_SYNC:
+		/* Wait for the scheduler to send everything queued so far. */
+		oplhw_Flush(dev);
+		reply[0] = OPLHWD_SYNC_ACK;
+		if (!send_all(clients[index]->fd, reply, 1))
+			return -1;
+		return OPLHWD_HEADER_LEN;
+
+	case OPLHWD_MSG_RESERVE:
+	{
+		uint32_t granted;
+
+		if (len < OPLHWD_HEADER_LEN + 4)
+			return 0;
+		msg += OPLHWD_HEADER_LEN;
+		granted = reserve_channels(index, msg[0] | (msg[1] << 8) | (msg[2] << 16) | ((uint32_t)msg[3] << 24));
+		for (i = 0; i < 4; ++i)
+			reply[i] = (granted >> (i * 8)) & 0xff;
+		if (!send_all(clients[index]->fd, reply, 4))
+			return -1;
+		return OPLHWD_HEADER_LEN + 4;
+	}
+
+	default:
+		return -1;
+	}
+}
+
+static void read_client(int index)
+{
+	client *c = clients[index];
+	size_t pos = 0;
+	ssize_t received;
+
+	received = recv(c->fd, c->in + c->in_len, CLIENT_BUFFER_LEN - c->in_len, 0);
+	if (received < 0 && errno == EINTR)
+		return;
+	if (received <= 0)
+	{
+		drop_client(index);
+		return;
+	}
+	c->in_len += received;
+
+	for (;;)
+	{
+		long msg_len = handle_message(index, c->in + pos, c->in_len - pos);
+		if (msg_len < 0)
+		{
+			fprintf(stderr, "Dropping client sending bad messages.\n");
+			drop_client(index);
+			return;
+		}
+		if (!msg_len)
+			break;
+		pos += msg_len;
+	}
+
+	memmove(c->in, c->in + pos, c->in_len - pos);
+	c->in_len -= pos;
+}
+
+static void accept_client(int listen_fd)
+{
+	uint8_t hello[OPLHWD_HELLO_LEN];
+	int fd, i;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd == -1)
+		return;
+
+	for (i = 0; i < MAX_CLIENTS; ++i)
+	{
+		if (!clients[i])
+			break;
+	}
+	if (i == MAX_CLIENTS)
+	{
+		fprintf(stderr, "Too many clients.\n");
+		close(fd);
+		return;
+	}
+
+	memcpy(hello, OPLHWD_MAGIC, 4);
+	hello[4] = OPLHWD_VERSION;
+	hello[5] = oplhw_IsOPL3(dev) ? OPLHWD_HELLO_OPL3 : 0;
+	hello[6] = hello[7] = 0;
+	if (!send_all(fd, hello, OPLHWD_HELLO_LEN))
+	{
+		close(fd);
+		return;
+	}
+
+	clients[i] = calloc(1, sizeof(client));
+	clients[i]->fd = fd;
+}
+
+int main(int argc, char **argv)
+{
+	const char *socket_path = OPLHWD_DEFAULT_SOCKET;
+	const char *devname = NULL;
+	struct pollfd fds[MAX_CLIENTS + 1];
+	int fd_client[MAX_CLIENTS + 1];
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	int listen_fd, i;
+
+	for (i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "--socket") && i + 1 < argc)
+			socket_path = argv[++i];
+		else if (argv[i][0] != '-' && !devname)
+			devname = argv[i];
+		else
+		{
+			fprintf(stderr, "Usage: %s [--socket path] [device]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "Socket path \"%s\" is too long.\n", socket_path);
+		return 1;
+	}
+
+	dev = oplhw_OpenDevice(devname);
+	if (!dev)
+	{
+		fprintf(stderr, "Couldn't open OPL device \"%s\"\n", devname ? devname : "");
+		return 1;
+	}
+	/* The scheduler keeps us from blocking on the chip, and puts timed
+	 * writes from different clients in order. */
+	dev = oplhw_CreateScheduler(dev);
+	oplhw_Reset(dev);
+
+	for (i = 0; i < OPLHWD_NUM_CHANNELS; ++i)
+		channel_owner[i] = -1;
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	unlink(socket_path);
+	if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listen_fd, 8) == -1)
+	{
+		fprintf(stderr, "Couldn't listen on \"%s\": %s\n", socket_path, strerror(errno));
+		oplhw_CloseDevice(dev);
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	printf("oplhwd: listening on %s\n", socket_path);
+
+	while (!quit)
+	{
+		int num_fds = 1;
+
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+		for (i = 0; i < MAX_CLIENTS; ++i)
+		{
+			if (!clients[i])
+				continue;
+			fds[num_fds].fd = clients[i]->fd;
+			fds[num_fds].events = POLLIN;
+			fd_client[num_fds] = i;
+			num_fds++;
+		}
+
+		if (poll(fds, num_fds, -1) == -1)
+			continue;
+
+		for (i = 1; i < num_fds; ++i)
+		{
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+				read_client(fd_client[i]);
+		}
+		if (fds[0].revents & POLLIN)
+			accept_client(listen_fd);
+	}
+
+	for (i = 0; i < MAX_CLIENTS; ++i)
+	{
+		if (clients[i])
+			drop_client(i);
+	}
+	close(listen_fd);
+	unlink(socket_path);
+
+	oplhw_Reset(dev);
+	oplhw_Flush(dev);
+	oplhw_CloseDevice(dev);
+	return 0;
+}